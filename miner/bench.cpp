@@ -0,0 +1,457 @@
+#include "momentum.hpp"
+#include "momentum_sha512.hpp"
+#include "hashtable.hpp"
+#include "search_pool.hpp"
+#include "options.hpp"
+#include <fc/crypto/sha256.hpp>
+#include <fc/io/json.hpp>
+#include <fc/reflect/variant.hpp>
+#include <fc/time.hpp>
+#include <fc/variant.hpp>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+
+/**
+ *  One timed phase of one configuration.  `items` counts nonces for the
+ *  search phases, messages for the SHA-512 kernels and headers for header_sha.
+ */
+struct bench_result
+  {
+  std::string phase;
+  std::string engine;     ///< table or sort for the search phases
+  std::string backend;
+  uint32_t    threads;
+  int         table_bits; ///< 0 where no birthday table is used
+  uint64_t    items;
+  double      seconds;
+  double      rate; ///< items per second
+  };
+
+FC_REFLECT(bench_result, (phase)(engine)(backend)(threads)(table_bits)(items)(seconds)(rate) )
+
+#define BENCH_CHUNK_NONCES (1 << 15)
+
+uint64_t&                        get_thread_count();
+static volatile uint64_t         bench_sink = 0;
+static std::vector<bench_result> results;
+
+static double seconds_since(const fc::time_point& start)
+  {
+  return (fc::time_point::now() - start).count() / 1000000.0;
+  }
+
+static void record(const std::string& phase, const std::string& engine, const std::string& backend, uint32_t threads,
+                   int table_bits, uint64_t items, double seconds)
+  {
+  bench_result r;
+  r.phase = phase;
+  r.engine = engine;
+  r.backend = backend;
+  r.threads = threads;
+  r.table_bits = table_bits;
+  r.items = items;
+  r.seconds = seconds;
+  r.rate = seconds > 0 ? items / seconds : 0;
+  results.push_back(r);
+  std::cerr << phase << " " << engine << " " << backend << " threads " << threads << ": " << r.rate << "/s\n";
+  }
+
+/** every kernel of the registry, with one head for all lanes and with a head per lane */
+static void bench_kernels(uint32_t hashes)
+  {
+  const std::vector<momentum_sha512_kernel>& kernels = get_momentum_sha512_kernels();
+  for (size_t i = 0; i < kernels.size(); ++i)
+    {
+    record("sha512", "", kernels[i].name, 1, 0, hashes, time_momentum_sha512(kernels[i], false, hashes) );
+    record("sha512_multi", "", kernels[i].name, 1, 0, hashes, time_momentum_sha512(kernels[i], true, hashes) );
+    }
+  }
+
+/** the miner's Hash(header, 88) that every collision found goes through */
+static void bench_header_sha(uint64_t count)
+  {
+  char           header[88] = { 0 };
+  uint64_t       sink = 0;
+  fc::time_point start = fc::time_point::now();
+  for (uint32_t i = 0; i < count; ++i)
+    {
+    memcpy(header + 80, &i, sizeof(i) );
+    fc::sha256 h = fc::sha256::hash(fc::sha256::hash(header, sizeof(header) ) );
+    sink += h._hash[0];
+    }
+  record("header_sha", "", "fc", 1, 0, count, seconds_since(start) );
+  bench_sink += sink;
+  }
+
+/** birthdays of nonces [begin, end) into birthdays[nonce - begin] */
+static void hash_range(const momentum_sha512_kernel& sha, const momentum_midstate& mid,
+                       uint32_t begin, uint32_t end, uint64_t* birthdays)
+  {
+  uint32_t nonces[MOMENTUM_SHA512_MAX_LANES];
+  uint64_t digest[MOMENTUM_SHA512_MAX_LANES][8];
+  for (uint32_t i = begin; i < end; i += sha.lanes * BIRTHDAYS_PER_HASH)
+    {
+    for (uint32_t l = 0; l < sha.lanes; ++l)
+      nonces[l] = i + l * BIRTHDAYS_PER_HASH;
+    sha.hash(mid, nonces, digest);
+    for (uint32_t l = 0; l < sha.lanes; ++l)
+      for (uint32_t x = 0; x < BIRTHDAYS_PER_HASH; ++x)
+        birthdays[nonces[l] - begin + x] = digest[l][x] >> (64 - SEARCH_SPACE_BITS);
+    }
+  }
+
+typedef std::vector< std::pair<uint32_t, uint32_t> > collisions;
+
+static void store_range(hashtable& table, const uint64_t* birthdays, uint32_t begin, uint32_t end, collisions& found)
+  {
+  for (uint32_t n = begin; n < end; ++n)
+    {
+    uint64_t birthday = birthdays[n - begin];
+    if (birthday == 0)
+      continue;
+    uint32_t cur = table.store(birthday, n);
+    if (cur != uint32_t(-1) )
+      {
+      found.push_back(std::make_pair(cur, n) );
+      found.push_back(std::make_pair(n, cur) );
+      }
+    }
+  }
+
+/** birthdays of nonces [begin, end) into the partitions of one worker, as the sort engine does */
+static void partition_range(const uint64_t* birthdays, uint32_t begin, uint32_t end, std::vector< std::vector<uint64_t> >& mine)
+  {
+  const uint64_t key_mask = (uint64_t(1) << SORT_KEY_BITS) - 1;
+  for (uint32_t n = begin; n < end; ++n)
+    {
+    uint64_t birthday = birthdays[n - begin];
+    if (birthday != 0)
+      mine[birthday >> SORT_KEY_BITS].push_back( ( (birthday & key_mask) << 26) | n);
+    }
+  }
+
+/** gathers partition p from all workers, sorts it and pairs up equal birthdays */
+static void collide_partition(uint32_t p, const std::vector< std::vector< std::vector<uint64_t> > >& entries,
+                              std::vector<uint64_t>& sorted, collisions& found)
+  {
+  const uint64_t nonce_mask = (1 << 26) - 1;
+  sorted.clear();
+  for (size_t w = 0; w < entries.size(); ++w)
+    sorted.insert(sorted.end(), entries[w][p].begin(), entries[w][p].end() );
+  std::sort(sorted.begin(), sorted.end() );
+  for (size_t i = 1; i < sorted.size(); ++i)
+    {
+    size_t first = i - 1;
+    while (i < sorted.size() && (sorted[i] >> 26) == (sorted[first] >> 26) )
+      {
+      uint32_t a = uint32_t(sorted[first] & nonce_mask);
+      uint32_t b = uint32_t(sorted[i] & nonce_mask);
+      if (a != 0 && b != 0)
+        {
+        found.push_back(std::make_pair(a, b) );
+        found.push_back(std::make_pair(b, a) );
+        }
+      ++i;
+      }
+    }
+  }
+
+/** the birthdays of all nonces into `birthdays`, @return seconds taken */
+static double hash_all(search_pool& pool, const momentum_sha512_kernel& sha, const momentum_midstate& mid,
+                       uint32_t chunks, uint64_t* birthdays)
+  {
+  fc::time_point start = fc::time_point::now();
+  pool.wait(pool.submit(chunks, [&](uint32_t chunk, uint32_t){
+                          uint32_t first = chunk * BENCH_CHUNK_NONCES;
+                          hash_range(sha, mid, first, first + BENCH_CHUNK_NONCES, birthdays + first);
+                          }
+                        ) );
+  return seconds_since(start);
+  }
+
+static void prepare_head(uint32_t it, momentum_midstate& mid)
+  {
+  fc::sha256 head;
+  memset(&head, 0, sizeof(head) );
+  head._hash[0] = it;
+  momentum_sha512_prepare( (const unsigned char*)&head, mid);
+  }
+
+/**
+ *  Times the phases of the table engine for one thread count and table size:
+ *  hash (all birthdays into memory), collide (inserting them into the table,
+ *  which finds the collisions, and merging those of all workers) and search
+ *  (hash and insert fused the way momentum_search runs them).
+ */
+static void bench_table(uint32_t threads, int table_bits, uint32_t nonce_bits, uint32_t iterations)
+  {
+  const momentum_sha512_kernel& sha = get_momentum_sha512();
+  const uint32_t                nonces = uint32_t(1) << nonce_bits;
+  const uint32_t                chunks = nonces / BENCH_CHUNK_NONCES;
+  search_pool                   pool(threads);
+  hashtable                     table(table_bits);
+  std::vector<uint64_t>         birthdays(nonces);
+  std::vector<collisions>       found(pool.size() );
+  double                        hash_time = 0, collide_time = 0, search_time = 0;
+  uint64_t*                     b = &birthdays[0];
+
+  for (uint32_t it = 0; it < iterations; ++it)
+    {
+    momentum_midstate mid;
+    prepare_head(it, mid);
+    hash_time += hash_all(pool, sha, mid, chunks, b);
+
+    table.reset();
+    for (size_t w = 0; w < found.size(); ++w)
+      found[w].clear();
+    fc::time_point start = fc::time_point::now();
+    pool.wait(pool.submit(chunks, [&](uint32_t chunk, uint32_t worker){
+                            uint32_t first = chunk * BENCH_CHUNK_NONCES;
+                            store_range(table, b + first, first, first + BENCH_CHUNK_NONCES, found[worker]);
+                            }
+                          ) );
+    collisions all;
+    for (size_t w = 0; w < found.size(); ++w)
+      all.insert(all.end(), found[w].begin(), found[w].end() );
+    collide_time += seconds_since(start);
+    bench_sink += all.size();
+
+    table.reset();
+    start = fc::time_point::now();
+    pool.wait(pool.submit(chunks, [&](uint32_t chunk, uint32_t worker){
+                            uint64_t local[MOMENTUM_SHA512_MAX_LANES * BIRTHDAYS_PER_HASH];
+                            uint32_t step = sha.lanes * BIRTHDAYS_PER_HASH;
+                            for (uint32_t n = chunk * BENCH_CHUNK_NONCES; n < (chunk + 1) * BENCH_CHUNK_NONCES; n += step)
+                              {
+                              hash_range(sha, mid, n, n + step, local);
+                              store_range(table, local, n, n + step, found[worker]);
+                              }
+                            }
+                          ) );
+    search_time += seconds_since(start);
+    }
+
+  uint64_t items = uint64_t(nonces) * iterations;
+  record("hash", "table", sha.name, pool.size(), table_bits, items, hash_time);
+  record("collide", "table", "hashtable", pool.size(), table_bits, items, collide_time);
+  record("search", "table", sha.name, pool.size(), table_bits, items, search_time);
+  }
+
+/**
+ *  Times the phases of the sort engine for one thread count: hash, partition
+ *  (every worker appends the birthdays to its own partitions), collide (each
+ *  partition gathered, sorted and scanned, and the collisions of all workers
+ *  merged) and search (hash and partition fused, then collide).
+ */
+static void bench_sort(uint32_t threads, uint32_t nonce_bits, uint32_t iterations)
+  {
+  const momentum_sha512_kernel&                       sha = get_momentum_sha512();
+  const uint32_t                                      nonces = uint32_t(1) << nonce_bits;
+  const uint32_t                                      chunks = nonces / BENCH_CHUNK_NONCES;
+  search_pool                                         pool(threads);
+  std::vector<uint64_t>                               birthdays(nonces);
+  std::vector<collisions>                             found(pool.size() );
+  std::vector< std::vector< std::vector<uint64_t> > > entries(pool.size(), std::vector< std::vector<uint64_t> >(SORT_PARTITIONS) );
+  std::vector< std::vector<uint64_t> >                scratch(pool.size() );
+  double                                              hash_time = 0, partition_time = 0, collide_time = 0, search_time = 0;
+  uint64_t*                                           b = &birthdays[0];
+
+  // keeps the capacity between searches like the engine does
+  auto reset = [&](){
+    size_t expected = nonces / (size_t(pool.size() ) * SORT_PARTITIONS);
+    for (size_t w = 0; w < entries.size(); ++w)
+      {
+      found[w].clear();
+      for (uint32_t p = 0; p < SORT_PARTITIONS; ++p)
+        {
+        entries[w][p].clear();
+        entries[w][p].reserve(expected + expected / 8 + 16);
+        }
+      }
+    };
+  auto collide_all = [&](){
+    pool.wait(pool.submit(SORT_PARTITIONS, [&](uint32_t p, uint32_t worker){ collide_partition(p, entries, scratch[worker], found[worker]); }
+                          ) );
+    collisions all;
+    for (size_t w = 0; w < found.size(); ++w)
+      all.insert(all.end(), found[w].begin(), found[w].end() );
+    bench_sink += all.size();
+    };
+
+  for (uint32_t it = 0; it < iterations; ++it)
+    {
+    momentum_midstate mid;
+    prepare_head(it, mid);
+    hash_time += hash_all(pool, sha, mid, chunks, b);
+
+    reset();
+    fc::time_point start = fc::time_point::now();
+    pool.wait(pool.submit(chunks, [&](uint32_t chunk, uint32_t worker){
+                            uint32_t first = chunk * BENCH_CHUNK_NONCES;
+                            partition_range(b + first, first, first + BENCH_CHUNK_NONCES, entries[worker]);
+                            }
+                          ) );
+    partition_time += seconds_since(start);
+
+    start = fc::time_point::now();
+    collide_all();
+    collide_time += seconds_since(start);
+
+    reset();
+    start = fc::time_point::now();
+    pool.wait(pool.submit(chunks, [&](uint32_t chunk, uint32_t worker){
+                            uint64_t local[MOMENTUM_SHA512_MAX_LANES * BIRTHDAYS_PER_HASH];
+                            uint32_t step = sha.lanes * BIRTHDAYS_PER_HASH;
+                            for (uint32_t n = chunk * BENCH_CHUNK_NONCES; n < (chunk + 1) * BENCH_CHUNK_NONCES; n += step)
+                              {
+                              hash_range(sha, mid, n, n + step, local);
+                              partition_range(local, n, n + step, entries[worker]);
+                              }
+                            }
+                          ) );
+    collide_all();
+    search_time += seconds_since(start);
+    }
+
+  uint64_t items = uint64_t(nonces) * iterations;
+  record("hash", "sort", sha.name, pool.size(), 0, items, hash_time);
+  record("partition", "sort", "radix", pool.size(), 0, items, partition_time);
+  record("collide", "sort", "std::sort", pool.size(), 0, items, collide_time);
+  record("search", "sort", sha.name, pool.size(), 0, items, search_time);
+  }
+
+static std::vector<uint64_t> parse_list(const std::string& list)
+  {
+  std::vector<uint64_t> values;
+  std::stringstream     ss(list);
+  std::string           item;
+  while (std::getline(ss, item, ',') )
+    values.push_back(fc::variant(item).as_uint64() );
+  return values;
+  }
+
+static void print_results(const std::string& format)
+  {
+  if (format == "json")
+    {
+    std::cout << fc::json::to_pretty_string(fc::variant(results) ) << "\n";
+    return;
+    }
+  if (format == "csv")
+    {
+    std::cout << "phase,engine,backend,threads,table_bits,items,seconds,rate\n";
+    for (size_t i = 0; i < results.size(); ++i)
+      {
+      const bench_result& r = results[i];
+      std::cout << r.phase << "," << r.engine << "," << r.backend << "," << r.threads << "," << r.table_bits << ","
+                << r.items << "," << r.seconds << "," << r.rate << "\n";
+      }
+    return;
+    }
+  std::cout << std::left << std::setw(14) << "phase" << std::setw(8) << "engine" << std::setw(18) << "backend" << std::setw(9) << "threads"
+            << std::setw(12) << "table_bits" << std::setw(14) << "items" << std::setw(12) << "seconds" << "rate/s\n";
+  for (size_t i = 0; i < results.size(); ++i)
+    {
+    const bench_result& r = results[i];
+    std::cout << std::setw(14) << r.phase << std::setw(8) << r.engine << std::setw(18) << r.backend << std::setw(9) << r.threads
+              << std::setw(12) << r.table_bits << std::setw(14) << r.items << std::setw(12) << r.seconds
+              << r.rate << "\n";
+    }
+  }
+
+static void print_usage(const std::string& name)
+  {
+  std::cerr << "Usage: " << name << " [OPTIONS]\n"
+            << "  --engine=E[,E...]       collision search engines to sweep, table and sort (default both)\n"
+            << "  --threads=N[,N...]      search thread counts to sweep (default hardware)\n"
+            << "  --table-bits=B[,B...]   table engine sizes, 2^B buckets of 64 bytes (default "
+            << HASHTABLE_DEFAULT_BUCKET_BITS << ")\n"
+            << "  --nonce-bits=N          nonces per search, 2^N with 15 <= N <= 26 (default 26)\n"
+            << "  --iterations=N          searches per configuration (default 3)\n"
+            << "  --hashes=N              messages per hash backend (default 1048576)\n"
+            << "  --sha512=NAME           SHA-512 kernel of the search phases (default fastest)\n"
+            << "  --format=text|json|csv  output on stdout, progress goes to stderr\n";
+  }
+
+int main(int argc, char** argv)
+  {
+  std::map<std::string, std::string> options;
+  std::vector<std::string>           args = parse_args(argc, argv, options);
+  if (args.size() > 1 || options.count("help") )
+    {
+    print_usage(args[0]);
+    return -1;
+    }
+
+  std::vector<std::string> engines;
+  std::vector<uint64_t>    threads(1, get_thread_count() );
+  std::vector<uint64_t>    table_bits(1, HASHTABLE_DEFAULT_BUCKET_BITS);
+  uint64_t                 nonce_bits = 26;
+  uint64_t                 iterations = 3;
+  uint64_t                 hashes = 1 << 20;
+  std::string              format = options.count("format") ? options["format"] : "text";
+  std::stringstream        engine_list(options.count("engine") ? options["engine"] : "table,sort");
+  for (std::string e; std::getline(engine_list, e, ','); )
+    {
+    if (e != "table" && e != "sort")
+      {
+      print_usage(args[0]);
+      return -1;
+      }
+    engines.push_back(e);
+    }
+  if (options.count("threads") )
+    threads = parse_list(options["threads"]);
+  if (options.count("table-bits") )
+    table_bits = parse_list(options["table-bits"]);
+  if (options.count("nonce-bits") )
+    nonce_bits = fc::variant(options["nonce-bits"]).as_uint64();
+  if (options.count("iterations") )
+    iterations = fc::variant(options["iterations"]).as_uint64();
+  if (options.count("hashes") )
+    hashes = fc::variant(options["hashes"]).as_uint64();
+  if (nonce_bits < 15 || nonce_bits > 26 || (format != "text" && format != "json" && format != "csv") )
+    {
+    print_usage(args[0]);
+    return -1;
+    }
+  for (size_t i = 0; i < table_bits.size(); ++i)
+    {
+    if (table_bits[i] < HASHTABLE_MIN_BUCKET_BITS || table_bits[i] > HASHTABLE_MAX_BUCKET_BITS)
+      {
+      print_usage(args[0]);
+      return -1;
+      }
+    }
+
+  if (options.count("sha512") && !select_momentum_sha512(options["sha512"]) )
+    {
+    print_usage(args[0]);
+    return -1;
+    }
+
+  hashes += (MOMENTUM_SHA512_MAX_LANES - hashes % MOMENTUM_SHA512_MAX_LANES) % MOMENTUM_SHA512_MAX_LANES;
+  bench_kernels(uint32_t(hashes) );
+  bench_header_sha(hashes);
+
+  for (size_t e = 0; e < engines.size(); ++e)
+    {
+    for (size_t t = 0; t < threads.size(); ++t)
+      {
+      if (engines[e] == "sort")
+        {
+        bench_sort(uint32_t(threads[t]), uint32_t(nonce_bits), uint32_t(iterations) );
+        continue;
+        }
+      for (size_t b = 0; b < table_bits.size(); ++b)
+        bench_table(uint32_t(threads[t]), int(table_bits[b]), uint32_t(nonce_bits), uint32_t(iterations) );
+      }
+    }
+
+  print_results(format);
+  return 0;
+  }
@@ -1,11 +1,16 @@
 #include "bitcoin.hpp"
 #include "base64.hpp"
 #include <fc/crypto/hex.hpp>
-#include <boost/property_tree/json_parser.hpp>
-#include <ostream>
-#include <istream>
+#include <algorithm>
+#include <ctype.h>
+#include <functional>
 #include <iostream>
 #include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
 
 #include <exception>
 #include <sstream>
@@ -14,114 +19,514 @@
 #include <boost/exception/diagnostic_information.hpp>
 
 namespace bitcoin {
-  typedef boost::error_info<struct bitcoin_msg_, std::string> bitcoin_msg;
+    #define COIN 100000000ll
 
-  struct exception : public virtual boost::exception, public virtual std::exception
+    #define THROW_BITCOIN_EXCEPTION(fmt, ...) \
+  do { \
+    std::stringstream ss; ss << boost::format(fmt) __VA_ARGS__; \
+    BOOST_THROW_EXCEPTION(::bitcoin::exception() << ::bitcoin::bitcoin_msg(ss.str()) ); \
+    } \
+  while (0)
+
+  using namespace boost::asio::ip;
+
+  /** `s` quoted as a JSON string, for every string parameter; addresses come from miners and may hold anything */
+  static std::string json_string(const std::string& s)
     {
-    const char* what() const throw()
+    static const char hex[] = "0123456789abcdef";
+    std::string       out = "\"";
+    for (size_t i = 0; i < s.size(); ++i)
       {
-      return "bitcoin::exception";
+      unsigned char c = (unsigned char)s[i];
+      if (c == '"' || c == '\\')
+        {
+        out += '\\';
+        out += char(c);
+        }
+      else if (c < 0x20)
+        {
+        out += "\\u00";
+        out += hex[c >> 4];
+        out += hex[c & 15];
+        }
+      else
+        out += char(c);
       }
+    return out + "\"";
+    }
 
-    virtual void rethrow() const
+  namespace detail {
+    /** case insensitive prefix compare, header names are not case sensitive */
+    static bool starts_with_nocase(const char* s, const char* prefix)
       {
-      BOOST_THROW_EXCEPTION(*this);
+      for ( ; *prefix; ++s, ++prefix)
+        if (tolower( (unsigned char)*s) != tolower( (unsigned char)*prefix) )
+          return false;
+      return true;
       }
 
-    const std::string& message() const
+    /** reads the leading decimal digits of s, strtoull is missing on older compilers */
+    static uint64_t parse_uint64(const char* s)
       {
-      return *boost::get_error_info<bitcoin_msg>(*this);
+      uint64_t v = 0;
+      for ( ; *s >= '0' && *s <= '9'; ++s)
+        v = v * 10 + uint64_t(*s - '0');
+      return v;
       }
+
+    struct json_token
+      {
+      enum token_type { object, array, string, primitive };
+
+      token_type  type;
+      const char* begin;  ///< strings without the quotes, still escaped
+      const char* end;
+      uint32_t    next;   ///< index of the first token after this value
+      };
+
+    /**
+     *  A parsed JSON-RPC reply.  The tokens point into the reply buffer, so
+     *  nothing is copied until a value is read, and the document is only
+     *  valid until the next request on the connection.
+     */
+    class json_doc
+    {
+public:
+      void parse(const char* begin, const char* end)
+        {
+        text_begin = begin;
+        text_end = end;
+        tokens.clear();
+        open.clear();
+        for (const char* p = begin; p < end; ++p)
+          {
+          switch (*p)
+            {
+            case ' ': case '\t': case '\r': case '\n': case ':': case ',':
+              break;
+            case '{': case '[':
+              open.push_back(uint32_t(tokens.size() ) );
+              push(*p == '{' ? json_token::object : json_token::array, p, p);
+              break;
+            case '}': case ']':
+              {
+              json_token::token_type type = *p == '}' ? json_token::object : json_token::array;
+              if (open.empty() || tokens[open.back()].type != type)
+                THROW_BITCOIN_EXCEPTION("Invalid JSON in response");
+              tokens[open.back()].end = p + 1;
+              tokens[open.back()].next = uint32_t(tokens.size() );
+              open.pop_back();
+              break;
+              }
+            case '"':
+              {
+              const char* q = p + 1;
+              while (q < end && *q != '"')
+                q += *q == '\\' ? 2 : 1;
+              if (q >= end)
+                THROW_BITCOIN_EXCEPTION("Unterminated string in response");
+              push(json_token::string, p + 1, q);
+              p = q;
+              break;
+              }
+            default:
+              {
+              const char* q = p;
+              while (q < end && !strchr(",]}: \t\r\n", *q) )
+                ++q;
+              if (!strchr("-0123456789tfn", *p) )
+                THROW_BITCOIN_EXCEPTION("Invalid JSON in response");
+              push(json_token::primitive, p, q);
+              p = q - 1;
+              }
+            }
+          if (open.empty() && !tokens.empty() )
+            break;
+          }
+        if (tokens.empty() || !open.empty() )
+          THROW_BITCOIN_EXCEPTION("Incomplete JSON in response");
+        }
+
+      /** @return the token of the value at a dotted path of keys, 0 is the root, -1 if there is none */
+      int find(const std::string& path) const
+        {
+        uint32_t    cur = 0;
+        size_t      pos = 0;
+        while (pos < path.size() )
+          {
+          size_t      dot = path.find('.', pos);
+          if (dot == std::string::npos)
+            dot = path.size();
+          const char* key = path.data() + pos;
+          size_t      key_size = dot - pos;
+          if (tokens[cur].type != json_token::object)
+            return -1;
+
+          uint32_t k = cur + 1;
+          for ( ; k + 1 < tokens[cur].next; k = tokens[k + 1].next)
+            {
+            const json_token& t = tokens[k];
+            if (size_t(t.end - t.begin) == key_size && memcmp(t.begin, key, key_size) == 0)
+              break;
+            }
+          if (k + 1 >= tokens[cur].next)
+            return -1;
+          cur = k + 1;
+          pos = dot + 1;
+          }
+        return int(cur);
+        }
+
+      template<typename T>
+      T get(const std::string& path) const
+        {
+        int i = find(path);
+        if (i < 0)
+          THROW_BITCOIN_EXCEPTION("No %1% in response", % path);
+        T v;
+        read(i, v);
+        return v;
+        }
+
+      bool is_null(int i) const
+        {
+        return tokens[i].type == json_token::primitive && *tokens[i].begin == 'n';
+        }
+
+      /** calls f with the token of every element of the array at i */
+      template<typename F>
+      void for_each_element(int i, F f) const
+        {
+        if (tokens[i].type != json_token::array)
+          THROW_BITCOIN_EXCEPTION("Expected an array in response");
+        for (uint32_t e = i + 1; e < tokens[i].next; e = tokens[e].next)
+          f(int(e) );
+        }
+
+      void read(int i, std::string& v) const
+        {
+        const json_token& t = tokens[i];
+        if (t.type != json_token::string)
+          {
+          v.assign(t.begin, t.end);
+          return;
+          }
+        v.clear();
+        v.reserve(t.end - t.begin);
+        for (const char* c = t.begin; c < t.end; ++c)
+          {
+          if (*c != '\\' || c + 1 >= t.end)
+            {
+            v += *c;
+            continue;
+            }
+          switch (*++c)
+            {
+            case 'b': v += '\b'; break;
+            case 'f': v += '\f'; break;
+            case 'n': v += '\n'; break;
+            case 'r': v += '\r'; break;
+            case 't': v += '\t'; break;
+            case 'u':
+              {
+              unsigned cp = c + 4 < t.end ? unsigned(strtoul(std::string(c + 1, c + 5).c_str(), nullptr, 16) ) : 0;
+              c += 4;
+              if (cp < 0x80)
+                v += char(cp);
+              else if (cp < 0x800)
+                {
+                v += char(0xc0 | (cp >> 6) );
+                v += char(0x80 | (cp & 0x3f) );
+                }
+              else
+                {
+                v += char(0xe0 | (cp >> 12) );
+                v += char(0x80 | ( (cp >> 6) & 0x3f) );
+                v += char(0x80 | (cp & 0x3f) );
+                }
+              break;
+              }
+            default: v += *c;
+            }
+          }
+        }
+
+      void read(int i, bool& v) const
+        {
+        v = *tokens[i].begin == 't';
+        }
+
+      void read(int i, double& v) const
+        {
+        char buf[64];
+        v = strtod(number(i, buf), nullptr);
+        }
+
+      void read(int i, uint64_t& v) const
+        {
+        char        buf[64];
+        const char* n = number(i, buf);
+        v = strpbrk(n, ".eE") ? uint64_t(strtod(n, nullptr) ) : parse_uint64(n);
+        }
+
+      void read(int i, int64_t& v) const
+        {
+        char        buf[64];
+        const char* n = number(i, buf);
+        if (strpbrk(n, ".eE") )
+          v = int64_t(strtod(n, nullptr) );
+        else
+          v = *n == '-' ? -int64_t(parse_uint64(n + 1) ) : int64_t(parse_uint64(n) );
+        }
+
+      void read(int i, uint32_t& v) const
+        {
+        uint64_t n;
+        read(i, n);
+        v = uint32_t(n);
+        }
+
+      void read(int i, int32_t& v) const
+        {
+        int64_t n;
+        read(i, n);
+        v = int32_t(n);
+        }
+
+      std::string text() const
+        {
+        return std::string(text_begin, text_end);
+        }
+
+private:
+      void push(json_token::token_type type, const char* begin, const char* end)
+        {
+        json_token t;
+        t.type = type;
+        t.begin = begin;
+        t.end = end;
+        t.next = uint32_t(tokens.size() + 1);
+        tokens.push_back(t);
+        }
+
+      /** copies the number at i into buf (the reply is not terminated) */
+      const char* number(int i, char (&buf)[64]) const
+        {
+        const json_token& t = tokens[i];
+        size_t            n = std::min<size_t>(t.end - t.begin, sizeof(buf) - 1);
+        memcpy(buf, t.begin, n);
+        buf[n] = '\0';
+        return buf;
+        }
+
+      const char*             text_begin;
+      const char*             text_end;
+      std::vector<json_token> tokens;
+      std::vector<uint32_t>   open;
     };
-    #define COIN 100000000ll
 
-    #define THROW_BITCOIN_EXCEPTION(fmt, ...) \
-  do { \
-    std::stringstream ss; ss << boost::format(fmt) __VA_ARGS__; \
-    BOOST_THROW_EXCEPTION(::bitcoin::exception() << ::bitcoin::bitcoin_msg(ss.str()) ); \
-    } \
-  while (0)
+    /** one JSON-RPC request, idempotent ones are resent once if a reused connection dropped */
+    struct rpc_call
+      {
+      rpc_call(const std::string& j, bool i = true)
+        : json(j), idempotent(i){}
 
-  using namespace boost::asio::ip;
+      std::string json;
+      bool        idempotent;
+      };
 
-  namespace detail {
     class client
     {
 public:
       client(boost::asio::io_service& i, bitcoin::client* c)
-        : ios(i), sock(i), self(c)
+        : ios(i), sock(i), self(c), reused(false), written(false)
                   {}
 
-      boost::property_tree::ptree request(const std::string& json)
+      /** sends one request and parses the reply, which stays valid until the next request */
+      const json_doc& request(const std::string& json, bool idempotent = true, const std::string& path = "/")
+        {
+        std::vector<rpc_call> calls(1, rpc_call(json, idempotent) );
+        pipeline(calls, [](size_t, const json_doc&){}, path);
+        return reply;
+        }
+
+      /**
+       *  Writes all calls at once on the keep-alive connection and hands the
+       *  replies to on_reply in order, so a batch costs one round trip.
+       */
+      void pipeline(const std::vector<rpc_call>& calls, const std::function<void (size_t, const json_doc&)>& on_reply,
+                    const std::string& path = "/")
+        {
+        bool idempotent = true;
+        for (size_t i = 0; i < calls.size(); ++i)
+          idempotent &= calls[i].idempotent;
+
+        size_t replies = 0;
+        try
+          {
+          try
+            {
+            send(calls, path, on_reply, replies);
+            }
+          catch (const boost::system::system_error&)
+            {
+            // bitcoind may have dropped an idle connection, try a fresh one
+            // unless a reply got through or a call must not run twice
+            sock.close();
+            if (!reused || replies || !idempotent)
+              throw;
+            send(calls, path, on_reply, replies);
+            }
+          }
+        catch (...)
+          {
+          // replies may be left unread, the next request must not take one for its own
+          sock.close();
+          if (!written)
+            BOOST_THROW_EXCEPTION(::bitcoin::not_sent_error() << ::bitcoin::bitcoin_msg(boost::current_exception_diagnostic_information() ) );
+          throw;
+          }
+        }
+
+      void send(const std::vector<rpc_call>& calls, const std::string& path,
+                const std::function<void (size_t, const json_doc&)>& on_reply, size_t& replies)
+        {
+        written = false;
+        if (!sock.is_open() )
+          {
+          boost::system::error_code error;
+          sock.connect(ep, error);
+          if (error)
+            throw boost::system::system_error(error);
+          sock.set_option(boost::asio::socket_base::keep_alive(true) );
+          sock.set_option(tcp::no_delay(true) );
+          response.consume(response.size() );
+          reused = false;
+          }
+
+        out.clear();
+        for (size_t i = 0; i < calls.size(); ++i)
+          {
+          out += "POST ";
+          out += path;
+          out += " HTTP/1.1\r\nHost: ";
+          out += host;
+          out += "\r\nConnection: keep-alive\r\nContent-Type: application/json-rpc\r\nAuthorization: Basic ";
+          out += b64_password;
+          out += "\r\nContent-Length: ";
+          out += std::to_string(static_cast<unsigned long long>(calls[i].json.size() ) );
+          out += "\r\n\r\n";
+          out += calls[i].json;
+          }
+        boost::asio::write(sock, boost::asio::buffer(out) );
+        written = true;
+
+        for ( ; replies < calls.size(); ++replies)
+          {
+          read_reply();
+          on_reply(replies, reply);
+          }
+        reused = true;
+        }
+
+      /** reads the next reply into `reply` */
+      void read_reply()
         {
-        boost::system::error_code error = boost::asio::error::host_not_found;
-        sock.close();
-        sock.connect(ep, error);
-        if (error)
-          throw boost::system::system_error(error);
-
-        boost::asio::streambuf request_buf;
-        std::ostream           request_info(&request_buf);
-        request_info << "POST / HTTP/1.1\n";
-        request_info << "Host: 127.0.0.1\n";
-        request_info << "Content-Type: application/json-rpc\n";
-        request_info << "Authorization: Basic " << b64_password << "\n";
-        request_info << "Content-Length: " << json.size() << "\n\n";
-
-        request_info << json;
-        // std::cout << std::endl;
-
-
-        boost::asio::write(sock, request_buf);
-
-        // Read the response status line. The response streambuf will automatically
-        //     // grow to accommodate the entire line. The growth may be limited by passing
-        //         // a maximum size to the streambuf constructor.
-        boost::asio::streambuf response;
-        boost::asio::read_until(sock, response, "\n");
-
-        std::istream           response_stream(&response);
-        std::string            http_version;
-        response_stream >> http_version;
-        unsigned int           status_code;
-        response_stream >> status_code;
-        std::string            status_message;
-        std::getline(response_stream, status_message);
-        if (!response_stream || http_version.substr(0, 5) != "HTTP/")
+        size_t      header_size = boost::asio::read_until(sock, response, "\r\n\r\n");
+        // the buffer is not NUL terminated, the parsing below needs a copy that is
+        std::string header_text(boost::asio::buffer_cast<const char*>(response.data() ), header_size);
+        const char* header = header_text.c_str();
+
+        unsigned    status_code = 0;
+        if (header_size < 12 || strncmp(header, "HTTP/", 5) != 0 ||
+            sscanf(header + 8, " %u", &status_code) != 1)
           THROW_BITCOIN_EXCEPTION("Invalid Response");
+
+        size_t      content_length = size_t(-1);
+        bool        close = strncmp(header, "HTTP/1.0", 8) == 0;
+        const char* end = header + header_size;
+        for (const char* line = strstr(header, "\r\n") + 2; line < end; line = strstr(line, "\r\n") + 2)
+          {
+          if (header_value(line, "Content-Length") )
+            content_length = size_t(parse_uint64(header_value(line, "Content-Length") ) );
+          else if (header_value(line, "Connection") )
+            close = starts_with_nocase(header_value(line, "Connection"), "close");
+          else if (header_value(line, "X-Long-Polling") )
+            {
+            const char* v = header_value(line, "X-Long-Polling");
+            longpoll_path.assign(v, strstr(v, "\r\n") );
+            }
+          }
+        response.consume(header_size);
+
+        boost::system::error_code error;
+        if (content_length == size_t(-1) )
+          {
+          // no length, the body ends with the connection
+          boost::asio::read(sock, response, boost::asio::transfer_all(), error);
+          if (error != boost::asio::error::eof)
+            throw boost::system::system_error(error);
+          content_length = response.size();
+          close = true;
+          }
+        else if (response.size() < content_length)
+          {
+          boost::asio::read(sock, response, boost::asio::transfer_exactly(content_length - response.size() ) );
+          }
+
+        const char* body = boost::asio::buffer_cast<const char*>(response.data() );
         if (status_code != 200)
-          THROW_BITCOIN_EXCEPTION("Response returned with status code %1%", % status_code);
-        boost::asio::read_until(sock, response, "\n");
-
-        // Process the response headers.
-        std::string header;
-        while (std::getline(response_stream, header) && header != "\r")
-                                                                                      {}
-        //        std::cout << "header:"<< header << "\n";
-        //     std::cout << "\n";
-
-        boost::asio::read_until(sock, response, "\n");
-        // Write whatever content we already have to output.
-        std::stringstream req;
-        if (response.size() > 0)
-          req << &response;
-        //  std::cerr<<req.str()<<"\n";
-
-        using boost::property_tree::ptree;
-        ptree             pt;
-        std::stringstream rtnss(req.str());
-        boost::property_tree::json_parser::read_json(rtnss, pt);
-        return pt;
+          {
+          std::string message;
+          try
+            {
+            reply.parse(body, body + content_length);
+            message = reply.get<std::string>("error.message");
+            }
+          catch (...)
+            {}
+          response.consume(content_length);
+          if (close)
+            sock.close();
+          std::stringstream ss;
+          ss << "Response returned with status code " << status_code << " " << message;
+          BOOST_THROW_EXCEPTION(::bitcoin::rpc_error() << ::bitcoin::bitcoin_msg(ss.str() ) );
+          }
+        reply.parse(body, body + content_length);
+
+        // the reply points into the buffer, only drop it once it was handed out
+        response.consume(content_length);
+        if (close)
+          sock.close();
+        }
+
+      /** @return the value of a header line named `name`, null if it is another header */
+      static const char* header_value(const char* line, const char* name)
+        {
+        if (!starts_with_nocase(line, name) || line[strlen(name)] != ':')
+          return nullptr;
+        line += strlen(name) + 1;
+        while (*line == ' ')
+          ++line;
+        return line;
         }
 
       boost::asio::io_service& ios;
       tcp::socket              sock;
       tcp::endpoint            ep;
       bitcoin::client*         self;
-
+      bool                     reused;    ///< a request already went over the connection
+      bool                     written;   ///< the requests of the latest send() went out in full
+      boost::asio::streambuf   response;
+      std::string              out;
+      json_doc                 reply;
+
+      std::string              host;
+      std::string              host_port;
       std::string              user;
       std::string              pass;
       std::string              b64_password;
+      std::string              longpoll_path;
     };     // detail::client
     } // namespace detail
 
@@ -144,6 +549,10 @@ namespace bitcoin {
     my->pass = pass;
     my->b64_password = base64_encode( (const unsigned char*)pre_encode.c_str(), pre_encode.size() );
 
+    // the connection is kept alive between requests, nothing to do if it is up
+    if (my->host_port == host_port && my->sock.is_open() )
+      return true;
+
     std::string               host = host_port.substr(0, host_port.find(':') );
     std::string               port = host_port.substr(host.size() + 1);
 
@@ -153,28 +562,31 @@ namespace bitcoin {
     tcp::resolver::iterator   end;
 
     boost::system::error_code error = boost::asio::error::host_not_found;
-    while (error && epi != end)
+    for ( ; error && epi != end; ++epi)
       {
       my->sock.close();
       my->sock.connect(*epi, error);
+      if (!error)
+        my->ep = *epi;
       }
     if (error)
       {
       std::cerr << boost::system::system_error(error).what() << std::endl;
       return false;
       }
-    my->ep = *epi;
-
-    std::string getinfo = "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getinfo\", \"params\": [] }";
-
-    //    boost::property_tree::json_parser::write_json( std::cerr, my->request(getinfo) );
+    my->sock.set_option(boost::asio::socket_base::keep_alive(true) );
+    my->sock.set_option(tcp::no_delay(true) );
+    my->response.consume(my->response.size() );
+    my->reused = false;
+    my->host = host;
+    my->host_port = host_port;
     return true;
     }
 
   server_info client::getinfo()
     {
     std::string                 getinfo = "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getinfo\", \"params\": [] }";
-    boost::property_tree::ptree pt = my->request(getinfo);
+    const detail::json_doc&     pt = my->request(getinfo);
 
     server_info                 si;
     si.version = pt.get<uint64_t   >("result.version");
@@ -197,7 +609,7 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getreceivedbyaddress\", \"params\": [";
-    ss << "\"" << address << "\",";
+    ss << json_string(address) << ",";
     ss << minconf;
     ss << "] }";
     return int64_t(my->request(ss.str()).get<double>("result") * 100000000);
@@ -207,28 +619,46 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getreceivedbyaccount\", \"params\": [";
-    ss << "\"" << account << "\",";
+    ss << json_string(account) << ",";
     ss << minconf;
     ss << "] }";
     return int64_t(my->request(ss.str()).get<double>("result") * 100000000);
     }
 
-  uint64_t client::getbalance(const std::string& account, uint32_t minconf)
+  static std::string getbalance_request(const std::string& account, uint32_t minconf)
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getbalance\", \"params\": [";
-    ss << "\"" << account << "\",";
+    ss << json_string(account) << ",";
     ss << minconf;
     ss << "] }";
-    boost::property_tree::json_parser::write_json(std::cerr, my->request(ss.str()) );
-    return int64_t(my->request(ss.str()).get<double>("result") * 100000000);
+    return ss.str();
+    }
+
+  uint64_t client::getbalance(const std::string& account, uint32_t minconf)
+    {
+    return int64_t(my->request(getbalance_request(account, minconf) ).get<double>("result") * 100000000);
+    }
+
+  std::vector<uint64_t> client::getbalances(const std::vector<std::string>& accounts, uint32_t minconf)
+    {
+    std::vector<detail::rpc_call> calls;
+    for (size_t i = 0; i < accounts.size(); ++i)
+      calls.push_back(detail::rpc_call(getbalance_request(accounts[i], minconf) ) );
+
+    std::vector<uint64_t> balances(accounts.size() );
+    my->pipeline(calls, [&](size_t i, const detail::json_doc& reply){
+                   balances[i] = int64_t(reply.get<double>("result") * 100000000);
+                   }
+                 );
+    return balances;
     }
 
   std::string client::getaccount(const std::string& address)
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getaccount\", \"params\": [";
-    ss << "\"" << address << "\"";
+    ss << json_string(address);
     ss << "] }";
     return my->request(ss.str()).get<std::string>("result");
     }
@@ -237,7 +667,7 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getaccountaddress\", \"params\": [";
-    ss << "\"" << address << "\"";
+    ss << json_string(address);
     ss << "] }";
     return my->request(ss.str()).get<std::string>("result");
     }
@@ -267,7 +697,7 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getgenerate\", \"params\": []}";
-    return my->request(ss.str()).get<std::string>("result") == "true";
+    return my->request(ss.str()).get<bool>("result");
     }
 
   uint32_t client::getblocknumber()
@@ -281,23 +711,23 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getnewaddress\", \"params\": [";
-    ss << "\"" << account << "\"";
+    ss << json_string(account);
     ss << "] }";
-    return my->request(ss.str()).get<std::string>("result");
+    return my->request(ss.str(), false).get<std::string>("result");
     }
 
   address_info client::validateaddress(const std::string& address)
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"validateaddress\", \"params\": [";
-    ss << "\"" << address << "\"";
+    ss << json_string(address);
     ss << "] }";
-    boost::property_tree::ptree pt = my->request(ss.str());
-    address_info                ai;
-    ai.isvalid = pt.get<std::string>("result.isvalid") == "true";
-    ai.ismine = pt.get<std::string>("result.ismine") == "true";
-    ai.address = pt.get<std::string>("result.address");
-    ai.account = pt.get<std::string>("result.account");
+    const detail::json_doc& pt = my->request(ss.str());
+    address_info            ai;
+    ai.isvalid = pt.get<bool>("result.isvalid");
+    ai.ismine = ai.isvalid && pt.get<bool>("result.ismine");
+    ai.address = ai.isvalid ? pt.get<std::string>("result.address") : address;
+    ai.account = pt.find("result.account") >= 0 ? pt.get<std::string>("result.account") : std::string();
     return ai;
     }
 
@@ -305,8 +735,8 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"setaccount\", \"params\": [";
-    ss << "\"" << address << "\",";
-    ss << "\"" << account << "\"";
+    ss << json_string(address) << ",";
+    ss << json_string(account);
     ss << "] }";
     my->request(ss.str());
     }
@@ -315,22 +745,16 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getaddressesbyaccount\", \"params\": [";
-    ss << "\"" << account << "\"";
+    ss << json_string(account);
     ss << "] }";
-    boost::property_tree::ptree pt = my->request(ss.str());
-    boost::property_tree::json_parser::write_json(std::cerr, pt);
-
-
-    std::vector<std::string>                    addresses;
-    boost::property_tree::ptree&                child = pt.get_child("result");
-    boost::property_tree::ptree::const_iterator itr = child.begin();
-    while (itr != child.end() )
-      {
-      addresses.push_back(itr->second.data());
-      ++itr;
-      }
-
-
+    const detail::json_doc&  pt = my->request(ss.str());
+
+    std::vector<std::string> addresses;
+    pt.for_each_element(pt.find("result"), [&](int i){
+                          addresses.push_back(std::string() );
+                          pt.read(i, addresses.back() );
+                          }
+                        );
     return addresses;
     }
 
@@ -338,7 +762,7 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"backupwallet\", \"params\": [";
-    ss << "\"" << dest << "\"";
+    ss << json_string(dest.string() );
     ss << "] }";
     return my->request(ss.str()).get<std::string>("error");
     }
@@ -347,14 +771,14 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"walletpassphrase\", \"params\": [";
-    ss << "\"" << pass << "\",";
+    ss << json_string(pass) << ",";
     ss << time;
     ss << "] }";
     auto str = ss.str();
     std::cerr << "\n\n" << str << "\n";
 
-    auto pt = my->request(str);
-    boost::property_tree::json_parser::write_json(std::cerr, pt);
+    const detail::json_doc& pt = my->request(str);
+    std::cerr << pt.text() << "\n";
     return 0; //pt.get<bool>("result");
     }
 
@@ -362,18 +786,39 @@ namespace bitcoin {
     {
     std::stringstream ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"sendtoaddress\", \"params\": [";
-    ss << "\"" << addr << "\",";
+    ss << json_string(addr) << ",";
     ss << double(amt) / COIN;
     ss << "] }";
     auto str = ss.str();
     std::cerr << "\n\n" << str << "\n";
 
-    auto pt = my->request(str);
+    // never resent, a dropped connection may still have paid
+    const detail::json_doc& pt = my->request(str, false);
     std::cerr << "send " << amt << " TO " << addr << ":\n";
-    boost::property_tree::json_parser::write_json(std::cerr, pt);
+    std::cerr << pt.text() << "\n";
     return pt.get<std::string>("result");
     }
 
+  std::string client::sendmany(const std::string& from_account, const std::vector<payment>& payments, uint32_t minconf)
+    {
+    std::stringstream ss;
+    ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"sendmany\", \"params\": [";
+    ss << json_string(from_account) << ",{";
+    for (size_t i = 0; i < payments.size(); ++i)
+      {
+      // exact to the satoshi, a double would print 6 significant digits
+      char amount[32];
+      sprintf(amount, "%llu.%08llu", (unsigned long long)(payments[i].second / COIN), (unsigned long long)(payments[i].second % COIN) );
+      ss << (i ? "," : "") << json_string(payments[i].first) << ":" << amount;
+      }
+    ss << "},";
+    ss << minconf;
+    ss << "] }";
+
+    // never resent, a dropped connection may still have paid
+    return my->request(ss.str(), false).get<std::string>("result");
+    }
+
   void hex_to_bin(const std::string& hexstr, std::vector<char>& bytes)
     {
     bytes.clear();
@@ -386,40 +831,59 @@ namespace bitcoin {
       }
     }
 
+  static work read_work(const detail::json_doc& pt)
+    {
+    std::vector<char> bytes;
+    hex_to_bin(pt.get<std::string>("result.data"), bytes);
+    if (bytes.size() < sizeof(work) )
+      THROW_BITCOIN_EXCEPTION("Short getwork data");
+    work              w;
+    memcpy( (char*)&w, bytes.data(), sizeof(w) );
+    return w;
+    }
+
   work client::getwork()
     {
     std::stringstream            ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getwork\", \"params\":[]}";
-    boost::property_tree::ptree  pt = my->request(ss.str());
-    std::vector<char>            bytes;
-    boost::property_tree::ptree& child = pt.get_child("result");
-    std::string                  data = child.get<std::string>("data");
-    hex_to_bin(data, bytes);
-    work                         w;
-    memcpy( (char*)&w, bytes.data(), sizeof(w) );
-    return w;
+    return read_work(my->request(ss.str()) );
+    }
+
+  std::string client::getwork_longpoll_path()
+    {
+    const std::string& lp = my->longpoll_path;
+    // the path may come as a full url, only the path part is requested
+    if (lp.compare(0, 7, "http://") == 0)
+      {
+      size_t slash = lp.find('/', 7);
+      return slash == std::string::npos ? std::string("/") : lp.substr(slash);
+      }
+    return lp;
+    }
+
+  work client::getwork_longpoll(const std::string& path)
+    {
+    std::stringstream            ss;
+    ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getwork\", \"params\":[]}";
+    return read_work(my->request(ss.str(), true, path) );
     }
 
   std::string client::gettarget()
     {
     std::stringstream            ss;
     ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getwork\", \"params\":[]}";
-    boost::property_tree::ptree  pt = my->request(ss.str());
-    //   boost::property_tree::json_parser::write_json( std::cerr, pt );
-    std::vector<char>            bytes;
-    boost::property_tree::ptree& child = pt.get_child("result");
-    return child.get<std::string>("target");
+    return my->request(ss.str()).get<std::string>("result.target");
     }
 
   bool client::setwork(const work& w)
     {
     std::stringstream ss;
-    ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getwork\", \"params\":[\"";
-    ss << std::string(fc::to_hex( (char*)&w, sizeof(w) ) );
-    ss << "\"]}";
+    ss << "{\"jsonrpc\": \"1.0\", \"id\":\"1\", \"method\": \"getwork\", \"params\":[";
+    ss << json_string(fc::to_hex( (char*)&w, sizeof(w) ) );
+    ss << "]}";
     //   std::cerr << "result?" << std::string( fc::to_hex( (char*)&w, sizeof(w) ) );
-    boost::property_tree::ptree pt = my->request(ss.str());
-    boost::property_tree::json_parser::write_json(std::cerr, pt);
+    const detail::json_doc& pt = my->request(ss.str());
+    std::cerr << pt.text() << "\n";
 
     return pt.get<bool>("result");
     }
@@ -1,13 +1,69 @@
 #ifndef _BITCOIN_HPP_
 #define _BITCOIN_HPP_
 #include <boost/asio.hpp>
+#include <boost/exception/all.hpp>
 #include <boost/filesystem/path.hpp>
 #include <array>
+#include <exception>
+#include <string>
+#include <utility>
+#include <vector>
 #include <fc/array.hpp>
 
 namespace bitcoin {
   namespace detail { class client; }
 
+  typedef boost::error_info<struct bitcoin_msg_, std::string> bitcoin_msg;
+
+  struct exception : public virtual boost::exception, public virtual std::exception
+    {
+    const char* what() const throw()
+      {
+      return "bitcoin::exception";
+      }
+
+    virtual void rethrow() const
+      {
+      BOOST_THROW_EXCEPTION(*this);
+      }
+
+    const std::string& message() const
+      {
+      return *boost::get_error_info<bitcoin_msg>(*this);
+      }
+    };
+
+  /** bitcoind answered with an error, unlike a dropped connection this means the call did nothing */
+  struct rpc_error : public exception
+    {
+    const char* what() const throw()
+      {
+      return "bitcoin::rpc_error";
+      }
+
+    virtual void rethrow() const
+      {
+      BOOST_THROW_EXCEPTION(*this);
+      }
+    };
+
+  /** the request could not be written in full, so bitcoind cannot have run it */
+  struct not_sent_error : public exception
+    {
+    const char* what() const throw()
+      {
+      return "bitcoin::not_sent_error";
+      }
+
+    virtual void rethrow() const
+      {
+      BOOST_THROW_EXCEPTION(*this);
+      }
+    };
+
+  /** an address and an amount in satoshi */
+  typedef std::pair<std::string, uint64_t> payment;
+
   struct address_info
     {
     bool isvalid;
@@ -46,42 +102,57 @@ namespace bitcoin {
     };
 
 
+  /** JSON-RPC client of bitcoind, virtual so mock_client can stand in for it */
   class client
   {
 public:
     client(boost::asio::io_service& ios);
-    ~client();
-
-    bool connect(const std::string& host_port, const std::string& user, const std::string& pass);
-
-    std::string gettarget();
-    work getwork();
-    bool setwork(const work& w);
-    std::string backupwallet(const boost::filesystem::path& destination);
-    std::string getaccount(const std::string& address);
-    std::string getaccountaddress(const std::string& account);
-    std::vector<std::string>  getaddressesbyaccount(const std::string& account);
-    uint64_t getbalance(const std::string& account = "", uint32_t minconf = 1);
-    bool walletpassphrase(const std::string& address, uint64_t amount);
-    std::string sendtoaddress(const std::string& address, uint64_t amount);
+    virtual ~client();
+
+    virtual bool connect(const std::string& host_port, const std::string& user, const std::string& pass);
+
+    virtual std::string gettarget();
+    virtual work getwork();
+    /**
+     *  Path bitcoind announced for long polling with its last getwork reply,
+     *  empty if it does not support long polling.
+     */
+    virtual std::string getwork_longpoll_path();
+    /**
+     *  Blocks until bitcoind has new work (or its long poll times out).  It
+     *  holds the connection, use a client of its own for it.
+     */
+    virtual work getwork_longpoll(const std::string& path);
+    virtual bool setwork(const work& w);
+    virtual std::string backupwallet(const boost::filesystem::path& destination);
+    virtual std::string getaccount(const std::string& address);
+    virtual std::string getaccountaddress(const std::string& account);
+    virtual std::vector<std::string>  getaddressesbyaccount(const std::string& account);
+    virtual uint64_t getbalance(const std::string& account = "", uint32_t minconf = 1);
+    /** balances of several accounts, pipelined in one round trip */
+    virtual std::vector<uint64_t> getbalances(const std::vector<std::string>& accounts, uint32_t minconf = 1);
+    virtual bool walletpassphrase(const std::string& address, uint64_t amount);
+    virtual std::string sendtoaddress(const std::string& address, uint64_t amount);
+    /** pays every address in one transaction and returns its id */
+    virtual std::string sendmany(const std::string& from_account, const std::vector<payment>& payments, uint32_t minconf = 1);
 
     //getblockbycount( uint32_t height );
-    uint32_t getblockcount();
-    uint32_t getblocknumber();
-    uint32_t getconnectioncount();
-    double getdifficulty();
-    bool getgenerate();
-    server_info getinfo();
+    virtual uint32_t getblockcount();
+    virtual uint32_t getblocknumber();
+    virtual uint32_t getconnectioncount();
+    virtual double getdifficulty();
+    virtual bool getgenerate();
+    virtual server_info getinfo();
 
-    uint64_t getreceivedbyaddress(const std::string& address, uint32_t minconf = 1);
-    uint64_t getreceivedbyaccount(const std::string& account, uint32_t minconf = 1);
+    virtual uint64_t getreceivedbyaddress(const std::string& address, uint32_t minconf = 1);
+    virtual uint64_t getreceivedbyaccount(const std::string& account, uint32_t minconf = 1);
 
 
 
 
-    std::string getnewaddress(const std::string& account = "");
-    void setaccount(const std::string& address, const std::string& account);
-    address_info validateaddress(const std::string& address);
+    virtual std::string getnewaddress(const std::string& account = "");
+    virtual void setaccount(const std::string& address, const std::string& account);
+    virtual address_info validateaddress(const std::string& address);
 
 
 private:
@@ -0,0 +1,132 @@
+#include "bitcoin_mock.hpp"
+#include <fc/thread/thread.hpp>
+#include <fc/time.hpp>
+#include <algorithm>
+#include <ctype.h>
+#include <sstream>
+#include <string.h>
+
+#define COIN 100000000ll
+
+namespace bitcoin {
+  static uint64_t mix64(uint64_t x)
+    {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30) ) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27) ) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+    }
+
+  static uint64_t now_us()
+    {
+    return uint64_t(fc::time_point::now().time_since_epoch().count() );
+    }
+
+  mock_client::mock_client(boost::asio::io_service& ios, uint32_t b)
+    : client(ios), block_sec(std::max<uint32_t>(b, 1) ), found(0), paid(0), transactions(0){}
+
+  bool mock_client::connect(const std::string&, const std::string&, const std::string&)
+    {
+    return true;
+    }
+
+  uint64_t mock_client::current_block() const
+    {
+    return now_us() / (uint64_t(block_sec) * 1000000);
+    }
+
+  work mock_client::getwork()
+    {
+    uint64_t block = current_block();
+    work     w;
+    memset(&w, 0, sizeof(w) );
+    w.version = 1;
+    for (int i = 0; i < 4; ++i)
+      {
+      uint64_t prev = mix64(block * 8 + i);
+      uint64_t merk = mix64(block * 8 + 4 + i);
+      memcpy(w.prev.data + 8 * i, &prev, 8);
+      memcpy(w.merk.data + 8 * i, &merk, 8);
+      }
+    w.time = uint32_t(block * block_sec);
+    w.bits = 0x1d00ffff;
+    return w;
+    }
+
+  std::string mock_client::getwork_longpoll_path()
+    {
+    return "/LP";
+    }
+
+  work mock_client::getwork_longpoll(const std::string&)
+    {
+    uint64_t next = (current_block() + 1) * uint64_t(block_sec) * 1000000;
+    uint64_t now = now_us();
+    if (next > now)
+      fc::usleep(fc::microseconds(int64_t(next - now) ) );
+    return getwork();
+    }
+
+  bool mock_client::setwork(const work&)
+    {
+    ++found;
+    return true;
+    }
+
+  std::string mock_client::gettarget()
+    {
+    return "00000000ffff0000000000000000000000000000000000000000000000000000";
+    }
+
+  uint64_t mock_client::getbalance(const std::string&, uint32_t)
+    {
+    // a block reward per found block, mature at once
+    int64_t balance = int64_t(found * 50 * COIN) - int64_t(paid);
+    return uint64_t(std::max<int64_t>(balance, 0) );
+    }
+
+  std::vector<uint64_t> mock_client::getbalances(const std::vector<std::string>& accounts, uint32_t minconf)
+    {
+    std::vector<uint64_t> balances;
+    for (size_t i = 0; i < accounts.size(); ++i)
+      balances.push_back(getbalance(accounts[i], minconf) );
+    return balances;
+    }
+
+  std::string mock_client::sendtoaddress(const std::string& address, uint64_t amount)
+    {
+    paid += amount;
+    return "mock-" + address;
+    }
+
+  std::string mock_client::sendmany(const std::string& from_account, const std::vector<payment>& payments, uint32_t minconf)
+    {
+    uint64_t total = 0;
+    for (size_t i = 0; i < payments.size(); ++i)
+      total += payments[i].second;
+    if (total > getbalance(from_account, minconf) )
+      BOOST_THROW_EXCEPTION(rpc_error() << bitcoin_msg("Insufficient funds") );
+    paid += total;
+
+    std::stringstream ss;
+    ss << "mock-tx-" << ++transactions;
+    return ss.str();
+    }
+
+  uint32_t mock_client::getblockcount()
+    {
+    return uint32_t(current_block() );
+    }
+
+  address_info mock_client::validateaddress(const std::string& address)
+    {
+    address_info ai;
+    ai.isvalid = !address.empty();
+    for (size_t i = 0; i < address.size(); ++i)
+      if (!isalnum( (unsigned char)address[i]) )
+        ai.isvalid = false;
+    ai.address = address;
+    ai.ismine = false;
+    return ai;
+    }
+  }
@@ -0,0 +1,49 @@
+#pragma once
+#include "bitcoin.hpp"
+#include <atomic>
+#include <stdint.h>
+
+namespace bitcoin {
+  /**
+   *  Stands in for bitcoind so pool_server can run without a coin daemon,
+   *  e.g. under pool_loadgen.
+   *
+   *  getwork() serves synthetic work for a new block every `block_sec`
+   *  seconds.  The blocks follow the wall clock, so every mock_client of a
+   *  process (the server has one for long polling) agrees on the current one.
+   *  Found blocks and payments are only counted.
+   */
+  class mock_client : public client
+  {
+public:
+    mock_client(boost::asio::io_service& ios, uint32_t block_sec);
+
+    virtual bool connect(const std::string& host_port, const std::string& user, const std::string& pass);
+    virtual work getwork();
+    virtual std::string getwork_longpoll_path();
+    virtual work getwork_longpoll(const std::string& path);
+    virtual bool setwork(const work& w);
+    virtual std::string gettarget();
+    virtual uint64_t getbalance(const std::string& account = "", uint32_t minconf = 1);
+    virtual std::vector<uint64_t> getbalances(const std::vector<std::string>& accounts, uint32_t minconf = 1);
+    virtual std::string sendtoaddress(const std::string& address, uint64_t amount);
+    /** fails like bitcoind if the mock balance does not cover the payments */
+    virtual std::string sendmany(const std::string& from_account, const std::vector<payment>& payments, uint32_t minconf = 1);
+    virtual uint32_t getblockcount();
+    /** any non empty alphanumeric string is an address of the mock */
+    virtual address_info validateaddress(const std::string& address);
+
+    uint64_t blocks_found() const
+      {
+      return found;
+      }
+
+private:
+    uint64_t current_block() const;
+
+    uint32_t              block_sec;
+    std::atomic<uint64_t> found;
+    std::atomic<uint64_t> paid;
+    std::atomic<uint64_t> transactions;
+  };
+  }
@@ -6,6 +6,8 @@
 #include <fc/crypto/aes.hpp>
 
 #include <unordered_map>
+#include <map>
+#include <mutex>
 #include <fc/reflect/variant.hpp>
 #include <fc/time.hpp>
 #include <algorithm>
@@ -16,17 +18,11 @@
 #include <fc/thread/scoped_lock.hpp>
 #include <fc/thread/mutex.hpp>
 #include <fc/thread/spin_lock.hpp>
-#include <openssl/sha.h>
 #include <boost/thread/thread.hpp>
-#include "sha2.h"
-extern "C" {
-#include "sphlib-3.0/c/sph_sha2.h"
-}
+#include "momentum_sha512.hpp"
+#include "search_pool.hpp"
 
 #include <iostream>
-        #define MAX_MOMENTUM_NONCE  (1 << 26)
-        #define SEARCH_SPACE_BITS 50
-        #define BIRTHDAYS_PER_HASH 8
 
 volatile bool cancel_search = false;
 uint64_t&     get_thread_count()
@@ -35,91 +31,239 @@ uint64_t&     get_thread_count()
   return thread_count;
   }
 
-std::vector< std::pair<uint32_t, uint32_t> > search(uint32_t offset, hashtable& found, fc::sha256 head)
+momentum_engine& get_momentum_engine()
   {
-  std::vector<std::pair<uint32_t, uint32_t> > results;
-  results.reserve(16);
-  for (uint32_t i = offset * 8; !cancel_search && i < MAX_MOMENTUM_NONCE; )
+  static momentum_engine engine = MOMENTUM_HASHTABLE;
+  return engine;
+  }
+
+/**
+ *  The nonce space is handed to the search pool in chunks of
+ *  SEARCH_CHUNK_NONCES, small enough for stealing to even out the threads.
+ */
+#define SEARCH_CHUNK_NONCES (1 << 15)
+#define SEARCH_CHUNKS       (MAX_MOMENTUM_NONCE / SEARCH_CHUNK_NONCES)
+
+typedef std::vector< std::pair<uint32_t, uint32_t> > collisions;
+
+/**
+ *  Hashes the nonces of one chunk and hands every non zero birthday to
+ *  sink(birthday, nonce).  One SHA-512 yields the birthdays of 8 nonces,
+ *  the kernel hashes one such group per SIMD lane.
+ */
+template<typename Sink>
+void hash_birthdays(uint32_t chunk, const momentum_midstate& mid, Sink& sink)
+  {
+  const momentum_sha512_kernel& sha = get_momentum_sha512();
+  const uint32_t                end = (chunk + 1) * SEARCH_CHUNK_NONCES;
+  uint32_t                      nonces[MOMENTUM_SHA512_MAX_LANES];
+  fc::sha512                    result[MOMENTUM_SHA512_MAX_LANES];
+
+  for (uint32_t i = chunk * SEARCH_CHUNK_NONCES; !cancel_search && i < end; )
     {
-    //     fc::sha512::encoder enc;
-    //     enc.write( (char*)&i, sizeof(i) );
-    //     enc.write( (char*)&head, sizeof(head) );
-    sph_sha512_context context;
-    sph_sha512_init(&context);
-    sph_sha512(&context, (char*)&i, sizeof(i) );
-    sph_sha512(&context, (char*)&head, sizeof(head) );
-    fc::sha512 result;
-    sph_sha512_close(&context, (char*)&result);
-    /*
-       sha512_ctx ctx;
-       sha512_init( &ctx );
-       sha512_update(&ctx, (unsigned char*)&i, sizeof(i) );
-       sha512_update(&ctx, (unsigned char*)&head, sizeof(head) );
-       fc::sha512 result;
-       sha512_final(&ctx, (unsigned char*)&result );
-     */
-
-    //     auto result = enc.result();
-
-    for (uint32_t x = 0; x < 8; ++x)
+    uint32_t lanes = 0;
+    for (; lanes < sha.lanes && i < end; ++lanes, i += BIRTHDAYS_PER_HASH)
+      nonces[lanes] = i;
+    for (uint32_t l = lanes; l < sha.lanes; ++l)
+      nonces[l] = nonces[0];
+
+    sha.hash(mid, nonces, (uint64_t (*)[8])result);
+
+    for (uint32_t l = 0; l < lanes; ++l)
       {
-      uint64_t birthday = result._hash[x] >> 14;
-      if (birthday != 0)
+      for (uint32_t x = 0; x < 8; ++x)
         {
-        uint32_t nonce = i + x;
-        uint32_t cur = found.store(birthday, nonce);
-        if (cur != uint32_t(-1) )
-          {
-          results.push_back(std::make_pair(cur, nonce) );
-          results.push_back(std::make_pair(nonce, cur) );
-          }
+        uint64_t birthday = result[l]._hash[x] >> 14;
+        if (birthday != 0)
+          sink(birthday, nonces[l] + x);
         }
       }
-    i += 8 * get_thread_count();
     }
-  return results;
   }
 
-std::vector< std::pair<uint32_t, uint32_t> > momentum_search(pow_seed_type head, int instance)
+void search(uint32_t chunk, hashtable& found, const momentum_midstate& mid, collisions& results)
   {
-  static hashtable                                         found[1];
-  found[instance].reset();
-  std::vector< std::pair<uint32_t, uint32_t> >             results;
-  results.reserve(16);
-  fc::spin_lock                                            m;
+  auto store = [&](uint64_t birthday, uint32_t nonce)
+    {
+    uint32_t cur = found.store(birthday, nonce);
+    if (cur != uint32_t(-1) )
+      {
+      results.push_back(std::make_pair(cur, nonce) );
+      results.push_back(std::make_pair(nonce, cur) );
+      }
+    };
+  hash_birthdays(chunk, mid, store);
+  }
+
+/**
+ *  Sort based engine: every worker first appends its birthdays to its own
+ *  partitions (selected by the top SORT_PARTITION_BITS of the birthday), then
+ *  each partition is gathered from all workers, sorted and scanned for equal
+ *  neighbours.  Both phases only stream through memory.
+ */
 
-  static fc::thread                                        mothreads[32];
-  fc::future<std::vector<std::pair<uint32_t, uint32_t> > > done[32];
+struct sort_partitions
+  {
+  /** [worker][partition] -> (birthday low bits << 26) | nonce */
+  std::vector< std::vector< std::vector<uint64_t> > > entries;
+  std::vector< std::vector<uint64_t> >                scratch;
 
-  for (uint32_t i = 0; i < get_thread_count(); ++i)
+  void reset(uint32_t workers)
     {
-    done[i] = mothreads[i].async( [&, i](){ return search(i, found[instance], head); }
-                                  );
+    // keep the capacity of the previous search
+    entries.resize(workers);
+    scratch.resize(workers);
+    size_t expected = MAX_MOMENTUM_NONCE / (size_t(workers) * SORT_PARTITIONS);
+    for (uint32_t w = 0; w < workers; ++w)
+      {
+      entries[w].resize(SORT_PARTITIONS);
+      for (uint32_t p = 0; p < SORT_PARTITIONS; ++p)
+        {
+        entries[w][p].clear();
+        entries[w][p].reserve(expected + expected / 8 + 16);
+        }
+      }
     }
+  };
+
+void partition(uint32_t chunk, std::vector< std::vector<uint64_t> >& mine, const momentum_midstate& mid)
+  {
+  const uint64_t key_mask = (uint64_t(1) << SORT_KEY_BITS) - 1;
+
+  auto           append = [&](uint64_t birthday, uint32_t nonce)
+    {
+    mine[birthday >> SORT_KEY_BITS].push_back( ( (birthday & key_mask) << 26) | nonce);
+    };
+  hash_birthdays(chunk, mid, append);
+  }
+
+void collide(uint32_t p, sort_partitions& parts, std::vector<uint64_t>& sorted, collisions& results)
+  {
+  const uint64_t nonce_mask = (1 << 26) - 1;
+
+  sorted.clear();
+  for (size_t w = 0; w < parts.entries.size(); ++w)
+    sorted.insert(sorted.end(), parts.entries[w][p].begin(), parts.entries[w][p].end() );
+  std::sort(sorted.begin(), sorted.end() );
 
-  for (uint32_t t = 0; t < get_thread_count(); ++t)
+  for (size_t i = 1; i < sorted.size(); ++i)
     {
-    auto r = done[t].wait();
-    results.insert(results.end(), r.begin(), r.end() );
+    size_t first = i - 1;
+    while (i < sorted.size() && (sorted[i] >> 26) == (sorted[first] >> 26) )
+      {
+      uint32_t a = uint32_t(sorted[first] & nonce_mask);
+      uint32_t b = uint32_t(sorted[i] & nonce_mask);
+      if (a != 0 && b != 0)
+        {
+        results.push_back(std::make_pair(a, b) );
+        results.push_back(std::make_pair(b, a) );
+        }
+      ++i;
+      }
     }
+  }
 
-  return results;
+/**
+ *  Per instance storage (birthday table or sort partitions), so searches of
+ *  different instances can be in flight at the same time.  Created by `make`
+ *  on first use to not map tables nobody searches with.
+ */
+template<typename T, typename Make>
+T& instance_storage(int instance, Make make)
+  {
+  static std::mutex                            m;
+  static std::map<int, std::shared_ptr<T> >    all;
+  std::unique_lock<std::mutex>                 lock(m);
+  std::shared_ptr<T>&                          storage = all[instance];
+  if (!storage)
+    storage = make();
+  return *storage;
   }
 
-uint64_t getBirthdayHash(pow_seed_type midHash, uint32_t a)
+struct momentum_pending_search
   {
-  uint32_t index = a - a % BIRTHDAYS_PER_HASH;
-  char     hash_tmp[sizeof(midHash) + 4];
-  memcpy( (char*)&hash_tmp[4], (char*)&midHash, sizeof(midHash) );
-  memcpy( (char*)&hash_tmp[0], (char*)&index, sizeof(index) );
+  momentum_pending_search()
+    : done(new fc::promise<void>("momentum_search") ), finished(done){}
 
-  uint64_t result_hash[8];
-  SHA512((unsigned char*)hash_tmp, sizeof(hash_tmp), (unsigned char*)&result_hash);
+  momentum_midstate       mid;
+  std::vector<collisions> found;   ///< per pool worker
+  fc::promise<void>::ptr  done;    ///< set by the pool worker finishing the last chunk
+  fc::future<void>        finished;
+  };
 
-  return result_hash[a % BIRTHDAYS_PER_HASH] >> (64 - SEARCH_SPACE_BITS);
+momentum_search_ptr momentum_search_async(pow_seed_type head, int instance)
+  {
+  return momentum_search_async(head, instance, get_search_pool() );
   }
 
-bool momentum_verify(pow_seed_type head, uint32_t a, uint32_t b)
+momentum_search_ptr momentum_search_async(pow_seed_type head, int instance, search_pool& pool)
+  {
+  momentum_search_ptr s = std::make_shared<momentum_pending_search>();
+  momentum_sha512_prepare( (const unsigned char*)&head, s->mid);
+  s->found.resize(pool.size() );
+
+  if (get_momentum_engine() == MOMENTUM_SORT)
+    {
+    // filled by the workers of the pool, so first touch puts them next to its cpus
+    sort_partitions& parts = instance_storage<sort_partitions>(instance, [](){ return std::make_shared<sort_partitions>(); }
+                                                               );
+    parts.reset(pool.size() );
+    pool.submit(SEARCH_CHUNKS,
+                [ =, &parts ](uint32_t chunk, uint32_t worker){ partition(chunk, parts.entries[worker], s->mid); },
+                [ =, &parts, &pool ](){
+                  if (cancel_search)
+                    {
+                    s->done->set_value();
+                    return;
+                    }
+                  pool.submit(SORT_PARTITIONS,
+                              [ =, &parts ](uint32_t p, uint32_t worker){ collide(p, parts, parts.scratch[worker], s->found[worker]); },
+                              [ = ](){ s->done->set_value(); }
+                              );
+                  }
+                );
+    }
+  else
+    {
+    hashtable& found = instance_storage<hashtable>(instance, [&pool](){
+                                                     return std::make_shared<hashtable>(HASHTABLE_DEFAULT_BUCKET_BITS, pool.get_table_memory() );
+                                                   }
+                                                   );
+    found.reset();
+    pool.submit(SEARCH_CHUNKS,
+                [ =, &found ](uint32_t chunk, uint32_t worker){ search(chunk, found, s->mid, s->found[worker]); },
+                [ = ](){ s->done->set_value(); }
+                );
+    }
+  return s;
+  }
+
+collisions momentum_search_wait(const momentum_search_ptr& s)
+  {
+  // yields to the other fc tasks of this thread until the pool is done
+  s->finished.wait();
+
+  collisions results;
+  results.reserve(16);
+  for (size_t w = 0; w < s->found.size(); ++w)
+    results.insert(results.end(), s->found[w].begin(), s->found[w].end() );
+  return results;
+  }
+
+collisions momentum_search(pow_seed_type head, int instance)
+  {
+  return momentum_search_wait(momentum_search_async(head, instance) );
+  }
+
+size_t momentum_instance_bytes()
+  {
+  // the sort engine reserves an eighth more than the expected entries
+  if (get_momentum_engine() == MOMENTUM_SORT)
+    return size_t(MAX_MOMENTUM_NONCE) * sizeof(uint64_t) * 9 / 8;
+  return (size_t(HASHTABLE_BUCKET_SLOTS) << HASHTABLE_DEFAULT_BUCKET_BITS) * sizeof(uint64_t);
+  }
+
+static bool valid_proof_indices(uint32_t a, uint32_t b)
   {
   if (a == b)
     return false;
@@ -131,8 +275,63 @@ bool momentum_verify(pow_seed_type head, uint32_t a, uint32_t b)
     return false;
   if (b > MAX_MOMENTUM_NONCE)
     return false;
+  return true;
+  }
+
+void momentum_verify_batch(const momentum_proof* proofs, bool* valid, size_t count)
+  {
+  const momentum_sha512_kernel& sha = get_momentum_sha512_verify();
+  const size_t                  lanes = sha.lanes;
+
+  // two birthday hashes per proof, each lane hashing with its own head
+  std::vector<momentum_midstate>        mids(count);
+  std::vector<const momentum_midstate*> lane_mids;
+  std::vector<uint32_t>                 lane_nonces;
+  std::vector<size_t>                   checked;
+  lane_mids.reserve(2 * count + lanes);
+  lane_nonces.reserve(2 * count + lanes);
+  for (size_t i = 0; i < count; ++i)
+    {
+    valid[i] = false;
+    if (!valid_proof_indices(proofs[i].a, proofs[i].b) )
+      continue;
+    momentum_sha512_prepare( (const unsigned char*)&proofs[i].head, mids[i]);
+    lane_mids.push_back(&mids[i]);
+    lane_nonces.push_back(proofs[i].a - proofs[i].a % BIRTHDAYS_PER_HASH);
+    lane_mids.push_back(&mids[i]);
+    lane_nonces.push_back(proofs[i].b - proofs[i].b % BIRTHDAYS_PER_HASH);
+    checked.push_back(i);
+    }
+  if (checked.empty() )
+    return;
 
-  auto r = (getBirthdayHash(head, a) == getBirthdayHash(head, b));
-  return r;
+  // pad the last group with copies of the first lane
+  size_t hashes = lane_nonces.size();
+  while (lane_nonces.size() % lanes)
+    {
+    lane_mids.push_back(lane_mids[0]);
+    lane_nonces.push_back(lane_nonces[0]);
+    }
+  std::vector< fc::array<uint64_t, 8> > result(lane_nonces.size() );
+  for (size_t l = 0; l < lane_nonces.size(); l += lanes)
+    sha.hash_multi(&lane_mids[l], &lane_nonces[l], &result[l].data);
+
+  for (size_t h = 0; h < hashes; h += 2)
+    {
+    const momentum_proof& p = proofs[checked[h / 2]];
+    uint64_t birthday_a = result[h].data[p.a % BIRTHDAYS_PER_HASH] >> (64 - SEARCH_SPACE_BITS);
+    uint64_t birthday_b = result[h + 1].data[p.b % BIRTHDAYS_PER_HASH] >> (64 - SEARCH_SPACE_BITS);
+    valid[checked[h / 2]] = birthday_a == birthday_b;
+    }
   }
 
+bool momentum_verify(pow_seed_type head, uint32_t a, uint32_t b)
+  {
+  momentum_proof proof;
+  proof.head = head;
+  proof.a = a;
+  proof.b = b;
+  bool           valid = false;
+  momentum_verify_batch(&proof, &valid, 1);
+  return valid;
+  }
@@ -1,100 +1,117 @@
 #pragma once
-#include <fc/crypto/city.hpp>
-#include <vector>
-#include <array>
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
 #include <string.h>
+#include "table_memory.hpp"
 
+#define HASHTABLE_BIRTHDAY_BITS   50
+#define HASHTABLE_NONCE_BITS      26
+#define HASHTABLE_BUCKET_SLOTS    8   // 8 * 8 bytes = one cache line per bucket
+#define HASHTABLE_MIN_BUCKET_BITS 13  // leaves one bit for the epoch
+#define HASHTABLE_MAX_BUCKET_BITS 30  // 2^33 slots, 64 GB
 
 #ifndef WIN32
-const int TABLE_SIZE = ((1 << 26) * 1.5);
+const int HASHTABLE_DEFAULT_BUCKET_BITS = 23; // 2^26 slots, 512 MB
+#else
+//reduced memory block allocation size version for win32
+const int HASHTABLE_DEFAULT_BUCKET_BITS = 22; // 2^25 slots, 256 MB
+#endif
 
+/**
+ *  Birthday -> nonce table shared by all search threads.
+ *
+ *  The high bits of a birthday select a cache line sized bucket, the entry
+ *  only keeps the remaining birthday bits (the tag) next to the 26 bit nonce
+ *  so a slot is a single 8 byte word that can be claimed with one CAS.
+ *  A full bucket keeps what it has, new birthdays are only compared against
+ *  it and dropped rather than overwriting an entry another thread just wrote.
+ *
+ *  The bits above the tag hold the epoch the entry was written in, bucket
+ *  bits - 12 of them (11 with the default size).  reset() just starts a new
+ *  epoch and entries of older epochs count as empty, the table is only
+ *  cleared for real when the epoch counter wraps.  Sizes outside
+ *  HASHTABLE_MIN_BUCKET_BITS .. HASHTABLE_MAX_BUCKET_BITS are clamped.
+ */
 class hashtable
 {
 public:
-  hashtable() :
-    itable(new std::array< std::pair<uint64_t, uint32_t>, TABLE_SIZE >),
-    table(*itable)
+  hashtable(int bits = HASHTABLE_DEFAULT_BUCKET_BITS,
+            const table_memory_options& memory = get_table_memory_options() ) :
+    bucket_bits(std::min(std::max(bits, HASHTABLE_MIN_BUCKET_BITS), HASHTABLE_MAX_BUCKET_BITS) ),
+    tag_bits(HASHTABLE_BIRTHDAY_BITS - bucket_bits),
+    epoch_shift(HASHTABLE_NONCE_BITS + tag_bits),
+    max_epoch( (uint64_t(1) << (64 - epoch_shift) ) - 1),
+    epoch(1),
+    slots(size_t(HASHTABLE_BUCKET_SLOTS) << bucket_bits)
     {
-    reset();
+    // page aligned and already zero filled (epoch 0), no need to reset()
+    table = static_cast<std::atomic<uint64_t>*>(alloc_table_memory(slots * sizeof(uint64_t), memory, mapped) );
     }
 
-  void reset()
+  ~hashtable()
     {
-    memset( (char*)table.data(), 0, table.size() * sizeof(std::pair<uint64_t, uint32_t>) );
-    }
-
-  uint32_t store(uint64_t key, uint32_t val)
-    {
-    uint64_t next_key = key;
-    auto     index = next_key % table.size();
-    //if matching collision in table, return it
-    if (table[index].first == key)
-      return table[index].second;
-
-    //no collision, add to table
-    table[index].first = key;
-    table[index].second = val;
-    return -1;
-    }
-
-private:
-  std::array< std::pair<uint64_t, uint32_t>, TABLE_SIZE >*  itable;
-  std::array<  std::pair<uint64_t, uint32_t>, TABLE_SIZE >& table;
-};
-
-#else //WIN32
-//reduced memory block allocation size version for win32
-const size_t TABLE_SIZE = (1 << 25);
-
-class hashtable
-{
-public:
-  hashtable() :
-    table(new std::pair<uint64_t, uint32_t>[TABLE_SIZE]),
-    table2(new std::pair<uint64_t, uint32_t>[TABLE_SIZE])
-    {
-    reset();
+    free_table_memory(table, mapped);
     }
 
+  /** forgets all entries, must not run concurrently with store() */
   void reset()
     {
-    memset( (char*)table, 0, TABLE_SIZE * sizeof(std::pair<uint64_t, uint32_t>) );
-    memset( (char*)table, 0, TABLE_SIZE * sizeof(std::pair<uint64_t, uint32_t>) );
+    if (epoch < max_epoch)
+      {
+      ++epoch;
+      return;
+      }
+    memset( (char*)table, 0, slots * sizeof(uint64_t) );
+    epoch = 1;
     }
 
+  /**
+   *  @return the nonce previously stored for key or -1 if there was none
+   */
   uint32_t store(uint64_t key, uint32_t val)
     {
-    uint64_t next_key = key;
-    auto     index = next_key % TABLE_SIZE;
-    //if collision
-    if (table[index].first != 0)
+    uint64_t               tag = key & tag_mask();
+    uint64_t               entry = (epoch << epoch_shift) | (tag << HASHTABLE_NONCE_BITS) | val;
+    std::atomic<uint64_t>* bucket = table + (size_t(key >> tag_bits) * HASHTABLE_BUCKET_SLOTS);
+
+    for (int i = 0; i < HASHTABLE_BUCKET_SLOTS; ++i)
       {
-      //if matching collision in first table, return it
-      if (table[index].first == key)
-        {
-        return table[index].second;
-        //if matching collision in second table, return it
-        }
-      else if (table2[index].first == key)
-        {
-        return table2[index].second;
-        //add to second table
-        }
-      else
+      uint64_t cur = bucket[i].load(std::memory_order_relaxed);
+      // empty or left over from an earlier search
+      while ( (cur >> epoch_shift) != epoch)
         {
-        table2[index].first = key;
-        table2[index].second = val;
-        return -1;
+        if (bucket[i].compare_exchange_weak(cur, entry, std::memory_order_relaxed) )
+          return -1;
         }
+      //if matching collision in table, return it
+      if ( ( (cur >> HASHTABLE_NONCE_BITS) & tag_mask() ) == tag)
+        return uint32_t(cur & ( (1 << HASHTABLE_NONCE_BITS) - 1) );
       }
-    //no collision, add to first table
-    table[index].first = key;
-    table[index].second = val;
+    // bucket full, keep the older entries
     return -1;
     }
 
+  size_t memory_size() const
+    {
+    return slots * sizeof(uint64_t);
+    }
+
 private:
-  std::pair<uint64_t, uint32_t>* table;
-  std::pair<uint64_t, uint32_t>* table2;
+  uint64_t tag_mask() const
+    {
+    return (uint64_t(1) << tag_bits) - 1;
+    }
+
+  int                    bucket_bits;
+  int                    tag_bits;
+  int                    epoch_shift;
+  uint64_t               max_epoch;
+  uint64_t               epoch;
+  size_t                 slots;
+  size_t                 mapped;
+  std::atomic<uint64_t>* table;
+
+  hashtable(const hashtable&);
+  hashtable& operator=(const hashtable&);
 };
-#endif
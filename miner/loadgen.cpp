@@ -0,0 +1,448 @@
+#include "bitcoin.hpp"
+#include "momentum.hpp"
+#include "work_message.hpp"
+#include "options.hpp"
+#include <bts/network/stcp_socket.hpp>
+#include <fc/io/raw.hpp>
+#include <fc/io/datastream.hpp>
+#include <fc/network/resolve.hpp>
+#include <fc/thread/thread.hpp>
+#include <fc/time.hpp>
+#include <fc/variant.hpp>
+#include <fc/log/logger.hpp>
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ *  Load generator for pool_server, best run against a server with
+ *  mock_block_sec set so no coin daemon is needed.
+ *
+ *  Opens --connections stcp connections and submits shares over the old
+ *  192 byte protocol, where every share gets a reply, at --valid-rate,
+ *  --invalid-rate and --stale-rate shares per second in total.  A reply
+ *  carries the user record of the connection (each has an address of its
+ *  own), so whether the pool counted the share valid tells accepted from
+ *  rejected.  The valid shares are real: a search thread mines the current
+ *  block, and once a block is over its leftovers become the stale shares.
+ *  Shares echo share_shift 0 like a miner from before vardiff, which the
+ *  pool holds to get_share_target(vardiff_start); --start-shift has to
+ *  match the vardiff_start of the server.
+ */
+
+extern volatile bool cancel_search;
+uint64_t&            get_thread_count();
+
+fc::sha256 Hash(char* b, size_t len)
+  {
+  auto round1 = fc::sha256::hash(b, len);
+  auto round2 = fc::sha256::hash(round1);
+  return round2;
+  }
+
+enum share_kind
+  {
+  VALID_SHARE,
+  INVALID_SHARE,
+  STALE_SHARE,
+  SHARE_KINDS
+  };
+
+static const char* share_kind_names[SHARE_KINDS] = { "valid", "invalid", "stale" };
+
+struct pending_share
+  {
+  share_kind     kind;
+  fc::time_point sent;
+  };
+
+struct loadgen_stats
+  {
+  loadgen_stats() : valid_shortfall(0), connected(0), failed(0)
+    {
+    for (int i = 0; i < SHARE_KINDS; ++i)
+      sent[i] = accepted[i] = rejected[i] = 0;
+    }
+
+  uint64_t              sent[SHARE_KINDS];
+  uint64_t              accepted[SHARE_KINDS];
+  uint64_t              rejected[SHARE_KINDS];
+  uint64_t              valid_shortfall; ///< valid shares due while none were mined
+  uint32_t              connected;
+  uint32_t              failed;
+  std::vector<uint32_t> latency_us;
+  };
+
+struct mined_share
+  {
+  bitcoin::work header;
+  };
+
+/** block templates and mined shares, shared by the connections and the search thread */
+struct share_source
+  {
+  share_source() : have_work(false), target(get_share_target(4) )
+    {
+    memset(&work, 0, sizeof(work) );
+    memset(&old_work, 0, sizeof(old_work) );
+    }
+
+  std::mutex              lock;
+  bool                    have_work;
+  uint64_t                target;    ///< the pool takes shares of old miners below this
+  bitcoin::work           work;      ///< of the current block
+  bitcoin::work           old_work;  ///< of the block before
+  std::deque<mined_share> valid;     ///< for `work`
+  std::deque<mined_share> stale;     ///< mined for an older block
+
+  /** called for every work packet, notices new blocks */
+  void update(const bitcoin::work& w)
+    {
+    std::unique_lock<std::mutex> l(lock);
+    if (have_work && w.prev == work.prev)
+      return;
+    if (have_work)
+      old_work = work;
+    work = w;
+    have_work = true;
+    stale.insert(stale.end(), valid.begin(), valid.end() );
+    valid.clear();
+    }
+  };
+
+static uint64_t next_random(uint64_t& state)
+  {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+  }
+
+static bool meets_share_target(bitcoin::work& h, uint64_t target)
+  {
+  auto result = Hash( (char*)&h, 88);
+  std::reverse( (char*)&result, ( (char*)&result) + sizeof(result) );
+  const unsigned char* r = (const unsigned char*)&result;
+  uint64_t             prefix = 0;
+  for (int i = 0; i < 8; ++i)
+    prefix = (prefix << 8) | r[i];
+  return prefix < target;
+  }
+
+/** searches the current block for shares until stopped */
+void mine_shares(share_source& source, volatile bool& stop)
+  {
+  uint32_t nonce = 0x80000000; // away from the nonces the pool hands out
+  while (!stop)
+    {
+    bitcoin::work h;
+      {
+      std::unique_lock<std::mutex> l(source.lock);
+      h = source.work;
+      if (!source.have_work || source.valid.size() > 100000)
+        {
+        l.unlock();
+        fc::usleep(fc::microseconds(100 * 1000) );
+        continue;
+        }
+      }
+    h.nonce = nonce++;
+    auto pairs = momentum_search(Hash( (char*)&h, 80), 0);
+
+    std::unique_lock<std::mutex> l(source.lock);
+    for (size_t i = 0; i < pairs.size(); ++i)
+      {
+      h.birthday_a = pairs[i].first;
+      h.birthday_b = pairs[i].second;
+      if (!meets_share_target(h, source.target) )
+        continue;
+      mined_share s;
+      s.header = h;
+      (h.prev == source.work.prev ? source.valid : source.stale).push_back(s);
+      }
+    }
+  }
+
+/**
+ *  Makes the next share of `kind`, invalid ones meet the share target so the
+ *  pool has to check their proof.
+ *
+ *  @return false if no valid share was mined yet
+ */
+static bool make_share(share_source& source, share_kind kind, uint64_t& rng, bitcoin::work& h)
+  {
+  std::unique_lock<std::mutex> l(source.lock);
+  if (kind == VALID_SHARE || kind == STALE_SHARE)
+    {
+    std::deque<mined_share>& shares = kind == VALID_SHARE ? source.valid : source.stale;
+    if (!shares.empty() )
+      {
+      h = shares.front().header;
+      shares.pop_front();
+      return true;
+      }
+    if (kind == VALID_SHARE)
+      return false;
+    }
+  h = kind == STALE_SHARE ? source.old_work : source.work;
+  l.unlock();
+  do
+    {
+    h.nonce = uint32_t(next_random(rng) );
+    h.birthday_a = uint32_t(next_random(rng) % MAX_MOMENTUM_NONCE);
+    h.birthday_b = uint32_t(next_random(rng) % MAX_MOMENTUM_NONCE);
+    }
+  while (h.birthday_a == h.birthday_b || !meets_share_target(h, source.target) );
+  return true;
+  }
+
+/**
+ *  Matches the replies of one connection to its pending shares until the
+ *  connection closes.  A reply is the first packet whose user record counts
+ *  one more share, the new block packets in between count none.
+ */
+void read_replies(const bts::network::stcp_socket_ptr& sock, user_record user,
+                  const std::shared_ptr< std::deque<pending_share> >& pending, share_source& source, loadgen_stats& stats)
+  {
+  fc::array<char, 192> packet;
+  uint64_t             counted = user.valid + user.invalid;
+  try
+    {
+    while (true)
+      {
+      sock->read(packet.data, packet.size() );
+      work_message                reply;
+      fc::datastream<const char*> ds(packet.data, sizeof(packet) );
+      fc::raw::unpack(ds, reply);
+      source.update(reply.header);
+
+      uint64_t now_counted = reply.user.valid + reply.user.invalid;
+      for ( ; counted < now_counted && !pending->empty(); ++counted)
+        {
+        pending_share p = pending->front();
+        pending->pop_front();
+        stats.latency_us.push_back(uint32_t( (fc::time_point::now() - p.sent).count() ) );
+        if (reply.user.valid > user.valid)
+          ++stats.accepted[p.kind];
+        else
+          ++stats.rejected[p.kind];
+        }
+      counted = now_counted;
+      user = reply.user;
+      }
+    }
+  catch (const fc::exception&)
+    {
+    // closed at the end of the run
+    }
+  }
+
+/** one miner: submits shares at `rate` per second and matches the replies */
+void run_connection(uint32_t index, const fc::ip::endpoint& ep, const double (&rates)[SHARE_KINDS],
+                    share_source& source, loadgen_stats& stats, const fc::time_point& end)
+  {
+  bts::network::stcp_socket_ptr sock = std::make_shared<bts::network::stcp_socket>();
+  std::string                   address = "loadgen" + fc::variant(index).as_string();
+  try
+    {
+    sock->connect_to(ep);
+    ++stats.connected;
+
+    fc::array<char, 192> packet;
+    work_message         msg;
+    sock->read(packet.data, packet.size() );
+      {
+      fc::datastream<const char*> ds(packet.data, sizeof(packet) );
+      fc::raw::unpack(ds, msg);
+      }
+    source.update(msg.header);
+
+    std::shared_ptr< std::deque<pending_share> > pending = std::make_shared< std::deque<pending_share> >();
+    fc::async( [ =, &source, &stats ](){ read_replies(sock, msg.user, pending, source, stats); }
+               );
+
+    double total = 0;
+    for (int k = 0; k < SHARE_KINDS; ++k)
+      total += rates[k];
+    if (total <= 0)
+      return;
+
+    uint64_t       rng = 0x9e3779b97f4a7c15ULL * (index + 1);
+    int64_t        interval = int64_t(1000000 / total);
+    fc::time_point next = fc::time_point::now() + fc::microseconds(int64_t(next_random(rng) % uint64_t(interval + 1) ) );
+    while (next < end)
+      {
+      if (next > fc::time_point::now() )
+        fc::usleep(next - fc::time_point::now() );
+      next = next + fc::microseconds(interval);
+
+      double     pick = (next_random(rng) % 1000000) / 1000000.0 * total;
+      share_kind kind = VALID_SHARE;
+      while (kind + 1 < SHARE_KINDS && pick >= rates[kind])
+        {
+        pick -= rates[kind];
+        kind = share_kind(kind + 1);
+        }
+
+      work_message share;
+      if (!make_share(source, kind, rng, share.header) )
+        {
+        ++stats.valid_shortfall;
+        continue;
+        }
+      share.ptsaddr = address;
+      share.share_shift = 0;
+
+      pending_share p;
+      p.kind = kind;
+      p.sent = fc::time_point::now();
+      pending->push_back(p);
+      ++stats.sent[kind];
+
+      auto data = fc::raw::pack(share);
+      data.resize(192);
+      sock->write(data.data(), data.size() );
+      }
+
+    // leave the replies of the last shares some time to come in
+    fc::usleep(fc::seconds(2) );
+    sock->close();
+    }
+  catch (const fc::exception& e)
+    {
+    ++stats.failed;
+    wlog("connection ${i}: ${e}", ("i", index)("e", e.to_string() ) );
+    }
+  }
+
+static uint32_t percentile(std::vector<uint32_t>& sorted, double p)
+  {
+  if (sorted.empty() )
+    return 0;
+  return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size() ) )];
+  }
+
+void print_report(loadgen_stats& stats, double seconds, bool final)
+  {
+  uint64_t sent = 0, accepted = 0, rejected = 0;
+  for (int k = 0; k < SHARE_KINDS; ++k)
+    {
+    sent += stats.sent[k];
+    accepted += stats.accepted[k];
+    rejected += stats.rejected[k];
+    }
+  std::vector<uint32_t> latency(stats.latency_us);
+  std::sort(latency.begin(), latency.end() );
+
+  fprintf(stderr, "%6.1fs  connections: %u (%u failed)  sent: %.1f/s  replies: %.1f/s  latency us p50: %u p90: %u p99: %u max: %u\n",
+          seconds, stats.connected, stats.failed, sent / seconds, (accepted + rejected) / seconds,
+          percentile(latency, 0.5), percentile(latency, 0.9), percentile(latency, 0.99), latency.empty() ? 0 : latency.back() );
+  if (!final)
+    return;
+  for (int k = 0; k < SHARE_KINDS; ++k)
+    {
+    uint64_t replied = stats.accepted[k] + stats.rejected[k];
+    fprintf(stderr, "  %-8s sent: %10llu  accepted: %10llu  rejected: %10llu  rejected ratio: %.4f\n", share_kind_names[k],
+            (unsigned long long)stats.sent[k], (unsigned long long)stats.accepted[k], (unsigned long long)stats.rejected[k],
+            replied ? double(stats.rejected[k]) / replied : 0.0);
+    }
+  fprintf(stderr, "  unanswered: %llu  valid shares due but not mined yet: %llu\n",
+          (unsigned long long)(sent - accepted - rejected), (unsigned long long)stats.valid_shortfall);
+  }
+
+void print_usage(const std::string& name)
+  {
+  std::cerr << "Usage: " << name << " HOST [OPTIONS]\n"
+            << "  --port=N              pool port (default 4444)\n"
+            << "  --connections=N       miners to simulate (default 100)\n"
+            << "  --valid-rate=R        valid shares per second over all connections (default 5)\n"
+            << "  --invalid-rate=R      shares with a wrong momentum proof per second (default 50)\n"
+            << "  --stale-rate=R        shares for the previous block per second (default 1)\n"
+            << "  --duration=S          seconds to run (default 60)\n"
+            << "  --mine-threads=N      threads mining the valid shares (default hardware)\n"
+            << "  --start-shift=N       vardiff_start of the server, sets the share target (default 4)\n";
+  }
+
+int main(int argc, char** argv)
+  {
+  try
+    {
+    std::map<std::string, std::string> options;
+    std::vector<std::string>           args = parse_args(argc, argv, options);
+    if (args.size() < 2)
+      {
+      print_usage(args[0]);
+      return -1;
+      }
+    uint16_t port = options.count("port") ? uint16_t(fc::variant(options["port"]).as_uint64() ) : 4444;
+    uint32_t connections = options.count("connections") ? uint32_t(fc::variant(options["connections"]).as_uint64() ) : 100;
+    uint32_t duration = options.count("duration") ? uint32_t(fc::variant(options["duration"]).as_uint64() ) : 60;
+    double   rates[SHARE_KINDS] = { 5, 50, 1 };
+    if (options.count("valid-rate") )
+      rates[VALID_SHARE] = fc::variant(options["valid-rate"]).as_double();
+    if (options.count("invalid-rate") )
+      rates[INVALID_SHARE] = fc::variant(options["invalid-rate"]).as_double();
+    if (options.count("stale-rate") )
+      rates[STALE_SHARE] = fc::variant(options["stale-rate"]).as_double();
+    if (options.count("mine-threads") )
+      get_thread_count() = fc::variant(options["mine-threads"]).as_uint64();
+
+    // every connection gets its share of the rates
+    double per_connection[SHARE_KINDS];
+    for (int k = 0; k < SHARE_KINDS; ++k)
+      per_connection[k] = rates[k] / std::max<uint32_t>(connections, 1);
+
+    std::vector<fc::ip::endpoint> eps = fc::resolve(args[1], port);
+    if (eps.empty() )
+      {
+      std::cerr << "unable to resolve " << args[1] << "\n";
+      return -1;
+      }
+
+    share_source   source;
+    if (options.count("start-shift") )
+      source.target = get_share_target(uint8_t(std::min<uint64_t>(fc::variant(options["start-shift"]).as_uint64(), MAX_SHARE_SHIFT) ) );
+    loadgen_stats  stats;
+    volatile bool  stop = false;
+    fc::thread     miner_thread("miner");
+    fc::future<void> mining;
+    if (rates[VALID_SHARE] > 0 || rates[STALE_SHARE] > 0)
+      mining = miner_thread.async( [&](){ mine_shares(source, stop); }
+                                   );
+
+    fc::time_point start = fc::time_point::now();
+    fc::time_point end = start + fc::seconds(duration);
+    std::vector< fc::future<void> > miners;
+    for (uint32_t i = 0; i < connections; ++i)
+      {
+      miners.push_back(fc::async( [ =, &source, &stats, &per_connection ](){
+                                    run_connection(i, eps[i % eps.size()], per_connection, source, stats, end);
+                                    }
+                                  ) );
+      }
+
+    while (fc::time_point::now() < end)
+      {
+      fc::usleep(fc::seconds(5) );
+      print_report(stats, (fc::time_point::now() - start).count() / 1000000.0, false);
+      }
+    for (size_t i = 0; i < miners.size(); ++i)
+      miners[i].wait();
+    stop = true;
+    cancel_search = true;
+    print_report(stats, double(duration), true);
+    if (mining.valid() )
+      mining.wait();
+    return 0;
+    }
+  catch (const fc::exception& e)
+    {
+    std::cerr << e.to_detail_string() << "\n";
+    return -1;
+    }
+  }
@@ -0,0 +1,256 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <istream>
+#include <math.h>
+#include <stdio.h>
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+// Visual C++ before 2015 only has _snprintf, the buffers below never fill up
+#define snprintf _snprintf
+#endif
+
+size_t get_metrics_slot()
+  {
+  // thread ids are often aligned addresses, mix them before taking the top bits
+  uint64_t h = std::hash<std::thread::id>()(std::this_thread::get_id() );
+  return size_t( (h * 0x9e3779b97f4a7c15ULL) >> 60) % METRICS_SLOTS;
+  }
+
+uint64_t metrics_counter::value() const
+  {
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < METRICS_SLOTS; ++i)
+    total += slots[i].value.load(std::memory_order_relaxed);
+  return total;
+  }
+
+metrics_histogram::metrics_histogram(const std::vector<uint64_t>& bounds_, double scale_) :
+  bounds(bounds_),
+  scale(scale_)
+  {
+  std::sort(bounds.begin(), bounds.end() );
+  // bucket counts, the overflow bucket and the sum, rounded up to whole cache lines
+  stride = (bounds.size() + 2 + 7) / 8 * 8;
+  cells.reset(new std::atomic<uint64_t>[stride * METRICS_SLOTS]);
+  for (size_t i = 0; i < stride * METRICS_SLOTS; ++i)
+    cells[i].store(0, std::memory_order_relaxed);
+  }
+
+void metrics_histogram::observe(uint64_t v)
+  {
+  size_t                 bucket = std::lower_bound(bounds.begin(), bounds.end(), v) - bounds.begin();
+  std::atomic<uint64_t>* slot = &cells[get_metrics_slot() * stride];
+  slot[bucket].fetch_add(1, std::memory_order_relaxed);
+  slot[bounds.size() + 1].fetch_add(v, std::memory_order_relaxed);
+  }
+
+void metrics_histogram::snapshot(std::vector<uint64_t>& counts, uint64_t& sum) const
+  {
+  counts.assign(bounds.size() + 1, 0);
+  sum = 0;
+  for (uint32_t s = 0; s < METRICS_SLOTS; ++s)
+    {
+    const std::atomic<uint64_t>* slot = &cells[s * stride];
+    for (size_t b = 0; b <= bounds.size(); ++b)
+      counts[b] += slot[b].load(std::memory_order_relaxed);
+    sum += slot[bounds.size() + 1].load(std::memory_order_relaxed);
+    }
+  }
+
+std::vector<uint64_t> exponential_buckets(uint64_t start, double factor, uint32_t count)
+  {
+  std::vector<uint64_t> bounds;
+  double                b = double(start);
+  for (uint32_t i = 0; i < count; ++i, b *= factor)
+    {
+    uint64_t bound = uint64_t(b + 0.5);
+    if (bounds.empty() || bound > bounds.back() )
+      bounds.push_back(bound);
+    }
+  return bounds;
+  }
+
+metrics_registry::metric& metrics_registry::add(const std::string& name, const std::string& help,
+                                                const std::string& type, const std::string& labels)
+  {
+  std::unique_ptr<metric> m(new metric);
+  m->name = name;
+  m->help = help;
+  m->type = type;
+  m->labels = labels;
+
+  std::unique_lock<std::mutex> l(lock);
+  metrics.push_back(std::move(m) );
+  return *metrics.back();
+  }
+
+metrics_counter& metrics_registry::counter(const std::string& name, const std::string& help, const std::string& labels)
+  {
+  metric& m = add(name, help, "counter", labels);
+  m.count.reset(new metrics_counter);
+  return *m.count;
+  }
+
+metrics_histogram& metrics_registry::histogram(const std::string& name, const std::string& help,
+                                               const std::vector<uint64_t>& bounds, double scale, const std::string& labels)
+  {
+  metric& m = add(name, help, "histogram", labels);
+  m.hist.reset(new metrics_histogram(bounds, scale) );
+  return *m.hist;
+  }
+
+void metrics_registry::gauge(const std::string& name, const std::string& help, const std::function<double()>& f)
+  {
+  add(name, help, "gauge", std::string() ).fn = f;
+  }
+
+void metrics_registry::counter_fn(const std::string& name, const std::string& help, const std::function<double()>& f)
+  {
+  add(name, help, "counter", std::string() ).fn = f;
+  }
+
+static void append_sample(std::string& out, const std::string& name, const std::string& labels, double value)
+  {
+  char buf[64];
+  snprintf(buf, sizeof(buf), " %.10g\n", value);
+  out += name;
+  if (labels.size() )
+    out += "{" + labels + "}";
+  out += buf;
+  }
+
+std::string metrics_registry::render() const
+  {
+  std::unique_lock<std::mutex> l(lock);
+  std::string                  out;
+  std::vector<bool>            done(metrics.size(), false);
+  std::vector<uint64_t>        counts;
+
+  // the exposition format wants every sample of a name right after its HELP and TYPE
+  for (size_t i = 0; i < metrics.size(); ++i)
+    {
+    if (done[i])
+      continue;
+    const metric& first = *metrics[i];
+    out += "# HELP " + first.name + " " + first.help + "\n";
+    out += "# TYPE " + first.name + " " + first.type + "\n";
+
+    for (size_t j = i; j < metrics.size(); ++j)
+      {
+      const metric& m = *metrics[j];
+      if (done[j] || m.name != first.name)
+        continue;
+      done[j] = true;
+
+      if (m.fn)
+        append_sample(out, m.name, m.labels, m.fn() );
+      else if (m.count)
+        append_sample(out, m.name, m.labels, double(m.count->value() ) );
+      else if (m.hist)
+        {
+        uint64_t                     sum;
+        const std::vector<uint64_t>& bounds = m.hist->get_bounds();
+        std::string                  prefix = m.labels.size() ? m.labels + "," : std::string();
+        m.hist->snapshot(counts, sum);
+
+        uint64_t cumulative = 0;
+        char     le[64];
+        for (size_t b = 0; b < bounds.size(); ++b)
+          {
+          cumulative += counts[b];
+          snprintf(le, sizeof(le), "le=\"%.10g\"", bounds[b] / m.hist->get_scale() );
+          append_sample(out, m.name + "_bucket", prefix + le, double(cumulative) );
+          }
+        cumulative += counts.back();
+        append_sample(out, m.name + "_bucket", prefix + "le=\"+Inf\"", double(cumulative) );
+        append_sample(out, m.name + "_sum", m.labels, sum / m.hist->get_scale() );
+        append_sample(out, m.name + "_count", m.labels, double(cumulative) );
+        }
+      }
+    }
+  return out;
+  }
+
+metrics_server::metrics_server(const metrics_registry& r, uint16_t port) :
+  registry(r),
+  acceptor(ios, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port) ),
+  sock(ios),
+  request(16 * 1024),
+  deadline(ios)
+  {
+  accept();
+  thread = std::thread([this](){ ios.run(); });
+  }
+
+metrics_server::~metrics_server()
+  {
+  ios.post([this](){
+             boost::system::error_code ec;
+             acceptor.close(ec);
+             sock.close(ec);
+             deadline.cancel(ec);
+           });
+  thread.join();
+  }
+
+void metrics_server::accept()
+  {
+  acceptor.async_accept(sock, [this](const boost::system::error_code& ec){
+                          if (ec == boost::asio::error::operation_aborted)
+                            return;
+                          if (ec)
+                            {
+                            accept();
+                            return;
+                            }
+                          deadline.expires_from_now(boost::posix_time::seconds(5) );
+                          deadline.async_wait([this](const boost::system::error_code& ec){
+                                                // a late handler of an earlier scrape finds a later expiry
+                                                if (!ec && deadline.expires_at() <= boost::asio::deadline_timer::traits_type::now() )
+                                                  sock.close();
+                                              });
+                          boost::asio::async_read_until(sock, request, "\r\n\r\n",
+                                                        [this](const boost::system::error_code& ec, size_t){ respond(ec); });
+                        });
+  }
+
+void metrics_server::respond(const boost::system::error_code& ec)
+  {
+  if (!ec)
+    {
+    std::string line;
+    std::istream in(&request);
+    std::getline(in, line);
+
+    std::string status = "200 OK";
+    std::string body;
+    if (line.compare(0, 13, "GET /metrics ") == 0 || line.compare(0, 13, "GET /metrics?") == 0)
+      body = registry.render();
+    else
+      {
+      status = "404 Not Found";
+      body = "try /metrics\n";
+      }
+
+    char head[160];
+    snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %u\r\nConnection: close\r\n\r\n", status.c_str(), unsigned(body.size() ) );
+    // a scraper that stops reading is closed by the deadline, which aborts the write
+    reply = head + body;
+    boost::asio::async_write(sock, boost::asio::buffer(reply),
+                             [this](const boost::system::error_code&, size_t){ finish(); });
+    return;
+    }
+  finish();
+  }
+
+void metrics_server::finish()
+  {
+  boost::system::error_code ignored;
+  deadline.cancel(ignored);
+  sock.close(ignored);
+  request.consume(request.size() );
+  reply.clear();
+  if (acceptor.is_open() )
+    accept();
+  }
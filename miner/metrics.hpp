@@ -0,0 +1,161 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+// counters are spread over this many cache lines, picked by thread id
+#define METRICS_SLOTS 16
+
+/** one cache line of a counter, so threads on different slots never share one */
+struct metrics_slot
+  {
+  metrics_slot() : value(0){}
+
+  std::atomic<uint64_t> value;
+  char                  pad[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+/** slot of the calling thread */
+size_t get_metrics_slot();
+
+/** a counter that only goes up, adding is one uncontended atomic add */
+class metrics_counter
+{
+public:
+  void     add(uint64_t n = 1)
+    {
+    slots[get_metrics_slot()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+  uint64_t value() const;
+
+private:
+  metrics_slot slots[METRICS_SLOTS];
+};
+
+/**
+ *  Counts observations into fixed buckets.  Values are integers in a unit
+ *  of the caller's choice, e.g. microseconds, and are divided by `scale`
+ *  on export (1000000 to export seconds).
+ */
+class metrics_histogram
+{
+public:
+  metrics_histogram(const std::vector<uint64_t>& bounds, double scale);
+
+  void observe(uint64_t v);
+
+  const std::vector<uint64_t>& get_bounds() const
+    {
+    return bounds;
+    }
+
+  double get_scale() const
+    {
+    return scale;
+    }
+
+  /** @param counts per bucket (not cumulative), the last one above every bound */
+  void snapshot(std::vector<uint64_t>& counts, uint64_t& sum) const;
+
+private:
+  std::vector<uint64_t>                     bounds;
+  double                                    scale;
+  size_t                                    stride; ///< cells per slot: bucket counts, then the sum
+  std::unique_ptr< std::atomic<uint64_t>[] > cells;
+};
+
+/** observes the microseconds from its construction to its destruction */
+class metrics_timer
+{
+public:
+  metrics_timer(metrics_histogram& h)
+    : hist(h), start(std::chrono::steady_clock::now() ){}
+
+  ~metrics_timer()
+    {
+    hist.observe(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() ) );
+    }
+
+private:
+  metrics_histogram&                    hist;
+  std::chrono::steady_clock::time_point start;
+
+  metrics_timer(const metrics_timer&);
+  metrics_timer& operator=(const metrics_timer&);
+};
+
+/** `count` bounds from `start`, each `factor` times the one before */
+std::vector<uint64_t> exponential_buckets(uint64_t start, double factor, uint32_t count);
+
+/**
+ *  The metrics of a process and their export in the Prometheus text format.
+ *  Metrics are registered at startup and live as long as the registry.
+ */
+class metrics_registry
+{
+public:
+  /** @param labels e.g. `method="getwork"`, metrics may share a name if their labels differ */
+  metrics_counter&   counter(const std::string& name, const std::string& help, const std::string& labels = std::string() );
+  metrics_histogram& histogram(const std::string& name, const std::string& help, const std::vector<uint64_t>& bounds,
+                               double scale, const std::string& labels = std::string() );
+  /** exports whatever f returns at scrape time, for values kept elsewhere anyway */
+  void               gauge(const std::string& name, const std::string& help, const std::function<double()>& f);
+  /** like gauge(), for values that only go up */
+  void               counter_fn(const std::string& name, const std::string& help, const std::function<double()>& f);
+
+  std::string        render() const;
+
+private:
+  struct metric
+    {
+    std::string                        name;
+    std::string                        help;
+    std::string                        type;
+    std::string                        labels;
+    std::unique_ptr<metrics_counter>   count;
+    std::unique_ptr<metrics_histogram> hist;
+    std::function<double()>            fn;
+    };
+
+  metric& add(const std::string& name, const std::string& help, const std::string& type, const std::string& labels);
+
+  mutable std::mutex                    lock;
+  std::vector< std::unique_ptr<metric> > metrics;
+};
+
+/**
+ *  Serves GET /metrics over HTTP on a thread of its own, so scrapes never
+ *  wait for (or hold up) the fc threads of the server.
+ */
+class metrics_server
+{
+public:
+  metrics_server(const metrics_registry& registry, uint16_t port);
+  ~metrics_server();
+
+private:
+  void accept();
+  void respond(const boost::system::error_code& ec);
+  /** closes the scrape and waits for the next */
+  void finish();
+
+  const metrics_registry&        registry;
+  boost::asio::io_service        ios;
+  boost::asio::ip::tcp::acceptor acceptor;
+  boost::asio::ip::tcp::socket   sock;     ///< one scrape at a time
+  boost::asio::streambuf         request;
+  std::string                    reply;    ///< being written
+  boost::asio::deadline_timer    deadline; ///< drops scrapers that never finish their request or stop reading the reply
+  std::thread                    thread;
+
+  metrics_server(const metrics_server&);
+  metrics_server& operator=(const metrics_server&);
+};
@@ -3,14 +3,22 @@
 #include <iostream>
 #include <bts/network/stcp_socket.hpp>
 #include <algorithm>
+#include <map>
 #include "momentum.hpp"
 #include "work_message.hpp"
+#include "pool_protocol.hpp"
+#include "table_memory.hpp"
+#include "search_pool.hpp"
+#include "work_units.hpp"
+#include "options.hpp"
+#include "momentum_sha512.hpp"
 #include <fc/io/raw.hpp>
 #include <fc/io/datastream.hpp>
 #include <fc/network/resolve.hpp>
 #include <fc/thread/thread.hpp>
 #include <fc/time.hpp>
 #include <fc/log/logger.hpp>
+#include <fc/exception/exception.hpp>
 #include <fc/variant.hpp>
 #include <boost/thread/thread.hpp>
 
@@ -28,42 +36,254 @@ uint64_t             total_hashes = 0;
 uint64_t&            get_thread_count();
 
 
-void start_work(const bts::network::stcp_socket_ptr& sock, work_message msg, int instance = 0)
+bool                 pipeline_search = false;
+
+/**
+ *  Checks the collisions of one search against the share target and submits
+ *  them.  The target is the one the pool asked for in msg.share_shift, pools
+ *  without vardiff get the first hash byte below 0x03.
+ *
+ *  With protocol version 2 (work_id != 0) every share that meets the target
+ *  goes up in one frame, otherwise only the first one in a 192 byte packet.
+ */
+void submit_shares(const bts::network::stcp_socket_ptr& sock, work_message& msg, uint32_t work_id,
+                   const std::vector< std::pair<uint32_t, uint32_t> >& pairs)
   {
-  while (!cancel_search)
+  uint64_t                target = msg.share_shift ? get_share_target(msg.share_shift) : 0x0300000000000000ull;
+  std::vector<pool_share> shares;
+  total_hashes += pairs.size();
+  for (auto itr = pairs.begin(); itr != pairs.end(); ++itr)
     {
-    auto mid = Hash( (char*)&msg.header, 80);
-    auto pairs = momentum_search(mid, instance);
+    msg.header.birthday_a = itr->first;
+    msg.header.birthday_b = itr->second;
+    auto result = Hash( (char*)&msg.header, 88);
+    std::reverse((char*)&result, ((char*)&result) + sizeof(result) );
 
-    total_hashes += pairs.size();
-    for (auto itr = pairs.begin(); itr != pairs.end(); ++itr)
+    const unsigned char* r = (const unsigned char*)&result;
+    uint64_t             prefix = 0;
+    for (int i = 0; i < 8; ++i)
+      prefix = (prefix << 8) | r[i];
+    if (prefix < target && work_id)
       {
-      msg.header.birthday_a = itr->first;
-      msg.header.birthday_b = itr->second;
-      auto result = Hash( (char*)&msg.header, 88);
-      std::reverse((char*)&result, ((char*)&result) + sizeof(result) );
-
-      if ( (((unsigned char*)&result)[0] < 0x03) )
-        {
-        std::cout << std::string(fc::time_point::now()) << " " << std::string(result) << "\n";
-        auto data = fc::raw::pack(msg);
-        data.resize(192);
-        sock->write(data.data(), data.size() );
+      pool_share share;
+      share.nonce = msg.header.nonce;
+      share.birthday_a = msg.header.birthday_a;
+      share.birthday_b = msg.header.birthday_b;
+      share.reserved = 0;
+      shares.push_back(share);
+      if (shares.size() == POOL_MAX_FRAME_SHARES)
         break;
-        }
       }
-    fc::usleep(fc::microseconds(100) );
-    msg.header.nonce++;
+    else if (prefix < target)
+      {
+      std::cout << std::string(fc::time_point::now()) << " " << std::string(result) << "\n";
+      auto data = fc::raw::pack(msg);
+      data.resize(192);
+      sock->write(data.data(), data.size() );
+      break;
+      }
+    }
+  if (shares.empty() )
+    return;
+
+  pool_frame_header head(FRAME_SHARES, uint32_t(shares.size() * sizeof(pool_share) ) );
+  head.work_id = work_id;
+  head.count = uint32_t(shares.size() );
+  std::vector<char> frame(sizeof(head) + head.size);
+  memcpy(frame.data(), &head, sizeof(head) );
+  memcpy(frame.data() + sizeof(head), shares.data(), head.size);
+  sock->write(frame.data(), frame.size() );
+  std::cout << std::string(fc::time_point::now()) << " " << shares.size() << " shares\n";
+  }
+
+/** asks the pool for a FRAME_WORK with a fresh range of nonces */
+void request_work(const bts::network::stcp_socket_ptr& sock, uint32_t work_id, uint32_t nonce_count)
+  {
+  pool_frame<pool_work_request> frame(FRAME_GET_WORK);
+  frame.head.work_id = work_id;
+  frame.body.nonce_count = nonce_count;
+  sock->write( (const char*)&frame, sizeof(frame) );
+  }
+
+/**
+ *  Searches the nonces msg.header.nonce, + stride, + 2 * stride, ... of one
+ *  work unit on its own tables and pool.
+ *
+ *  @param work_id     of the FRAME_WORK msg came in, 0 for a 192 byte work packet
+ *  @param nonce_count nonces to search, 0 for no bound
+ *  @param instance    the work unit, its tables are instance (or 2 * instance and 2 * instance + 1 pipelined)
+ *  @return true if all nonce_count nonces were searched
+ */
+bool start_work(const bts::network::stcp_socket_ptr& sock, work_message msg, uint32_t work_id, uint32_t nonce_count,
+                uint32_t stride, int instance, search_pool& pool)
+  {
+  uint32_t first = msg.header.nonce;
+  uint32_t queued_count = 0; ///< nonces whose search was started
+  if (!pipeline_search)
+    {
+    for ( ; !cancel_search && (!nonce_count || queued_count < nonce_count); ++queued_count)
+      {
+      msg.header.nonce = first + queued_count * stride;
+      auto mid = Hash( (char*)&msg.header, 80);
+      auto pairs = momentum_search_wait(momentum_search_async(mid, instance, pool) );
+      submit_shares(sock, msg, work_id, pairs);
+      fc::usleep(fc::microseconds(100) );
+      }
+    return nonce_count && !cancel_search;
+    }
+
+  // keep the next nonce queued on the search pool (on table instance
+  // 2 * instance + 1) so the workers go straight from one search to the next
+  // while the collisions of the finished one are checked and submitted
+  work_message        queued[2] = { msg, msg };
+  momentum_search_ptr pending[2];
+  for (int i = 0; i < 2 && (!nonce_count || queued_count < nonce_count); ++i)
+    {
+    queued[i].header.nonce = first + queued_count++ * stride;
+    pending[i] = momentum_search_async(Hash( (char*)&queued[i].header, 80), 2 * instance + i, pool);
+    }
+
+  // a slot stays empty once the range is used up, the other may still be searching
+  for (int slot = 0; pending[slot] && !cancel_search; slot ^= 1)
+    {
+    auto         pairs = momentum_search_wait(pending[slot]);
+    work_message searched = queued[slot];
+    pending[slot].reset();
+    if (cancel_search)
+      break;
+
+    if (!nonce_count || queued_count < nonce_count)
+      {
+      queued[slot].header.nonce = first + queued_count++ * stride;
+      pending[slot] = momentum_search_async(Hash( (char*)&queued[slot].header, 80), 2 * instance + slot, pool);
+      }
+
+    submit_shares(sock, searched, work_id, pairs);
+    }
+
+  // the tables must be idle before the next work message reuses them
+  for (int i = 0; i < 2; ++i)
+    if (pending[i])
+      momentum_search_wait(pending[i]);
+  return nonce_count && !cancel_search;
+  }
+
+/**
+ *  Runs every work unit on its share of the nonces, unit u takes
+ *  msg.header.nonce + u, + u + units, ...  Pools of protocol version 2 bound
+ *  the nonces of the connection; once all units used up theirs this asks for
+ *  more and returns.
+ *
+ *  @param nonce_count nonces of the range from msg.header.nonce on, 0 for no bound
+ */
+void run_work_units(const bts::network::stcp_socket_ptr& sock, const work_message& msg, uint32_t work_id,
+                    uint32_t nonce_count, work_unit_pools& units)
+  {
+  fc::time_point                  started = fc::time_point::now();
+  std::vector< fc::future<bool> > running;
+  uint32_t                        stride = units.size();
+  for (uint32_t u = 0; u < stride && (!nonce_count || u < nonce_count); ++u)
+    {
+    work_message unit_msg = msg;
+    unit_msg.header.nonce += u;
+    uint32_t     count = nonce_count ? uint32_t( (uint64_t(nonce_count) - u + stride - 1) / stride) : 0;
+    search_pool& pool = units.pool(u);
+    running.push_back(fc::async( [ =, &pool ](){ return start_work(sock, unit_msg, work_id, count, stride, u, pool); }
+                                 ) );
+    }
+
+  bool used_up = true;
+  for (size_t i = 0; i < running.size(); ++i)
+    used_up = running[i].wait() && used_up;
+
+  if (used_up && !cancel_search)
+    {
+    // ask for twice as many if these lasted less than a minute
+    uint32_t wanted = nonce_count;
+    if (fc::time_point::now() - started < fc::seconds(60) && nonce_count <= 0x7fffffff)
+      wanted = nonce_count * 2;
+    request_work(sock, work_id, wanted);
     }
   }
 
+/** @param user_spm share rate of the address as seen by the pool, negative if it does not say */
+void print_pool_stats(const work_message& msg, const std::string& ptsaddr, const fc::time_point& start, double user_spm = -1)
+  {
+  std::cout << "  shares: " << (msg.user.valid)
+            << "  invalid: " << msg.user.invalid
+            << "  pool_shares: " << msg.pool_shares
+            << "  pool_balance: " << (msg.pool_earned / double(COIN))
+            << "  pool_mature: " << (msg.mature_balance / double(COIN))
+            << "  pool_spm: " << (msg.pool_spm);
+  if (user_spm >= 0)
+    std::cout << "  your_spm: " << user_spm;
+  std::cout << "  earned(est): " << ((1.0 - msg.pool_fee) * (msg.pool_earned / double(COIN)) * msg.user.valid / double(msg.pool_shares))
+            << "  mature earned(est): " << ((1.0 - msg.pool_fee) * (msg.mature_balance / double(COIN)) * msg.user.valid / double(msg.pool_shares))
+            << "  fee: " << double(msg.pool_fee * 100) << "%"
+            << "  difficulty: " << (uint64_t(1) << msg.share_shift)
+            << "  address: " << ptsaddr
+            << "  hpm: " << total_hashes / ((fc::time_point::now() - start).count() / 60000000.0)
+            << "\n";
+  }
+
+void print_usage(const std::string& name)
+  {
+  std::cerr << "Usage: " << name << " HOST PTS_ADDRESS [THREADS=HARDWARE] [OPTIONS]\n"
+            << "  --engine=table|sort   collision search engine (default table)\n"
+            << "  --hugepages[=2m|1g]   put the birthday table on huge pages\n"
+            << "  --numa-node=N         bind the birthday table to numa node N\n"
+            << "  --numa-interleave     interleave the birthday table over all numa nodes\n"
+            << "  --pin                 pin search threads to cores (of --numa-node if given)\n"
+            << "  --pipeline            queue the next nonce while checking the last search (2 tables)\n"
+            << "  --units=N|auto        concurrent work units, each with its own tables and threads (default auto)\n"
+            << "  --sha512=NAME         SHA-512 kernel, one of:";
+  const std::vector<momentum_sha512_kernel>& kernels = get_momentum_sha512_kernels();
+  for (size_t i = 0; i < kernels.size(); ++i)
+    std::cerr << " " << kernels[i].name;
+  std::cerr << " (default fastest)\n";
+  }
+
 int main(int argc, char** argv)
   {
   try
     {
-    if (argc == 1)
+    std::map<std::string, std::string> options;
+    std::vector<std::string>           args = parse_args(argc, argv, options);
+    if (options.count("engine") )
+      {
+      if (options["engine"] == "sort")
+        get_momentum_engine() = MOMENTUM_SORT;
+      else if (options["engine"] == "table")
+        get_momentum_engine() = MOMENTUM_HASHTABLE;
+      else
+        {
+        print_usage(args[0]);
+        return -1;
+        }
+      }
+
+    table_memory_options& memory = get_table_memory_options();
+    if (options.count("hugepages") )
+      memory.huge_pages = options["hugepages"] == "1g" ? 1024 : 2;
+    if (options.count("numa-node") )
+      memory.numa_node = fc::variant(options["numa-node"]).as_uint64();
+    if (options.count("numa-interleave") )
+      memory.interleave = true;
+    if (options.count("pin") )
+      get_pin_search_threads() = true;
+    if (options.count("pipeline") )
+      pipeline_search = true;
+    if (options.count("sha512") && !select_momentum_sha512(options["sha512"]) )
       {
-      std::cerr << "Usage: " << argv[0] << " HOST PTS_ADDRESS [THREADS=HARDWARE]\n";
+      print_usage(args[0]);
+      return -1;
+      }
+    // select before the search threads first hash
+    std::cerr << "sha512: " << get_momentum_sha512().name << "\n";
+
+    if (args.size() == 1)
+      {
+      print_usage(args[0]);
       std::cerr << "Performing Benchmark...\n";
       fc::sha256 base;
       auto       start = fc::time_point::now();
@@ -79,15 +299,24 @@ int main(int argc, char** argv)
       std::cerr << "HPM: " << total / ((stop - start).count() / 60000000.0) << "\n";
       return -1;
       }
-    if (argc < 3)
+    if (args.size() < 3)
       {
-      std::cerr << "Usage: " << argv[0] << " HOST PTS_ADDRESS\n";
+      print_usage(args[0]);
       return -1;
       }
-    std::string host = argv[1];
-    std::string ptsaddr = argv[2];
-    if (argc == 4)
-      get_thread_count() = fc::variant(std::string(argv[3]) ).as_uint64();
+    std::string host = args[1];
+    std::string ptsaddr = args[2];
+    if (args.size() == 4)
+      get_thread_count() = fc::variant(args[3]).as_uint64();
+
+    uint32_t threads = uint32_t(get_thread_count() );
+    uint32_t unit_count = 0;
+    if (options.count("units") && options["units"] != "auto")
+      unit_count = uint32_t(fc::variant(options["units"]).as_uint64() );
+    if (unit_count == 0)
+      unit_count = choose_work_units(threads, uint64_t(momentum_instance_bytes() ) * (pipeline_search ? 2 : 1) );
+    work_unit_pools units(std::min(unit_count, std::max<uint32_t>(threads, 1) ) );
+    std::cerr << "work units: " << units.size() << " sharing " << threads << " threads\n";
 
     std::vector<fc::ip::endpoint> eps = fc::resolve(host, 4444);
     while (true)
@@ -123,12 +352,29 @@ int main(int argc, char** argv)
 
         fc::array<char, 192> packet;
         fc::future<void>     search_complete;
-        fc::future<void>     search_complete1;
 
-        work_message         msg;
-        msg.ptsaddr = ptsaddr;
-        auto                 data = fc::raw::pack(msg);
-        data.resize(192);
+        // the work sent on connect, a server of protocol version 2 marks it
+        // HELLO; an older one would count a HELLO as an invalid share
+        sock->read(packet.data, sizeof(packet) );
+        bool                 have_packet = true;
+          {
+          work_message                connect_msg;
+          fc::datastream<const char*> ds(packet.data, sizeof(packet) );
+          fc::raw::unpack(ds, connect_msg);
+          if (connect_msg.type == HELLO)
+            {
+            // the work follows as a frame
+            work_message hello;
+            memset(&hello.header, 0, sizeof(hello.header) );
+            hello.type = HELLO;
+            hello.header.version = POOL_PROTOCOL_VERSION;
+            hello.ptsaddr = ptsaddr;
+            auto         data = fc::raw::pack(hello);
+            data.resize(192);
+            sock->write(data.data(), data.size() );
+            have_packet = false;
+            }
+          }
 
         fc::time_point       start = fc::time_point::now();
         std::cout << "\n";
@@ -142,41 +388,79 @@ int main(int argc, char** argv)
                      }
                    );
 
-        int count = 0;
+        int          count = 0;
+        uint32_t     work_id = 0;
+        uint32_t     nonce_count = 0;
+        work_message msg;
         while (true)
           {
-          sock->read(packet.data, sizeof(packet) );
+          pool_frame_header head;
+          if (!have_packet)
+            sock->read(packet.data, sizeof(head) );
+          memcpy(&head, packet.data, sizeof(head) );
+          if (head.magic == POOL_FRAME_MAGIC)
+            {
+            if (head.size > sizeof(packet) - sizeof(head) || head.size % 16)
+              FC_THROW_EXCEPTION(fc::exception, "invalid frame from pool");
+            if (head.size)
+              sock->read(packet.data + sizeof(head), head.size);
+            const char* body = packet.data + sizeof(head);
+
+            if (head.type == FRAME_HELLO_ACK)
+              {
+              pool_hello_ack ack;
+              memcpy(&ack, body, sizeof(ack) );
+              std::cout << "  pool protocol " << ack.version << "\n";
+              continue;
+              }
+            if (head.type == FRAME_STATS)
+              {
+              // older servers send a shorter frame
+              pool_stats stats = pool_stats();
+              memcpy(&stats, body, std::min<size_t>(head.size, sizeof(stats) ) );
+              msg.user = stats.user;
+              msg.mature_balance = stats.mature_balance;
+              msg.pool_shares = stats.pool_shares;
+              msg.pool_earned = stats.pool_earned;
+              msg.pool_spm = stats.pool_spm;
+              msg.pool_fee = stats.pool_fee;
+              print_pool_stats(msg, ptsaddr, start, stats.user_spm);
+              continue;
+              }
+            if (head.type != FRAME_WORK)
+              continue;
+
+            pool_work work;
+            memcpy(&work, body, sizeof(work) );
+            msg.header = work.header;
+            msg.share_shift = work.share_shift;
+            work_id = head.work_id;
+            nonce_count = work.nonce_count;
+            }
+          else
+            {
+            if (!have_packet)
+              sock->read(packet.data + sizeof(head), sizeof(packet) - sizeof(head) );
+            have_packet = false;
+            fc::datastream<const char*> ds(packet.data, sizeof(packet) );
+            fc::raw::unpack(ds, msg);
+            work_id = 0;
+            nonce_count = 0;
+            if (count)
+              print_pool_stats(msg, ptsaddr, start);
+            else
+              std::cout << "  fee: " << double(msg.pool_fee * 100) << "%\n";
+            ++count;
+            }
 
           cancel_search = true;
           if (search_complete.valid() )
             search_complete.wait();
-          //    if( search_complete1.valid() ) search_complete1.wait();
           cancel_search = false;
 
-          work_message                msg;
-          fc::datastream<const char*> ds(packet.data, sizeof(packet) );
-          fc::raw::unpack(ds, msg);
-          if (count)
-            std::cout << "  shares: " << (msg.user.valid)
-                      << "  invalid: " << msg.user.invalid
-                      << "  pool_shares: " << msg.pool_shares
-                      << "  pool_balance: " << (msg.pool_earned / double(COIN))
-                      << "  pool_mature: " << (msg.mature_balance / double(COIN))
-                      << "  pool_spm: " << (msg.pool_spm)
-                      << "  earned(est): " << ((1.0 - msg.pool_fee) * (msg.pool_earned / double(COIN)) * msg.user.valid / double(msg.pool_shares))
-                      << "  mature earned(est): " << ((1.0 - msg.pool_fee) * (msg.mature_balance / double(COIN)) * msg.user.valid / double(msg.pool_shares))
-                      << "  fee: " << double(msg.pool_fee * 100) << "%"
-                      << "  address: " << ptsaddr
-                      << "  hpm: " << total_hashes / ((fc::time_point::now() - start).count() / 60000000.0)
-                      << "\n";
-          else
-            std::cout << "  fee: " << double(msg.pool_fee * 100) << "%\n";
-          ++count;
-
           msg.ptsaddr = ptsaddr;
-          search_complete = fc::async( [ = ](){ start_work(sock, msg, 0); }
+          search_complete = fc::async( [ =, &units ](){ run_work_units(sock, msg, work_id, nonce_count, units); }
                                        );
-          //     search_complete1 = fc::async( [=](){ start_work( sock, msg, 1 ); } );
           }
         }
       catch (fc::exception& e)
@@ -4,15 +4,62 @@
 #include <fc/crypto/sha256.hpp>
 #include <fc/crypto/ripemd160.hpp>
 #include <fc/reflect/reflect.hpp>
+#include <vector>
+#include <memory>
 
 #define MAX_MOMENTUM_NONCE  (1 << 26)
+#define SEARCH_SPACE_BITS   50
+#define BIRTHDAYS_PER_HASH  8
 
 typedef fc::sha256 pow_seed_type;
 
+enum momentum_engine
+  {
+  MOMENTUM_HASHTABLE, ///< random probes into one shared birthday table
+  MOMENTUM_SORT       ///< per thread radix partitions, sorted and scanned
+  };
+
+// the sort engine partitions birthdays by their top bits and keeps the rest
+#define SORT_PARTITION_BITS 12
+#define SORT_PARTITIONS     (1 << SORT_PARTITION_BITS)
+#define SORT_KEY_BITS       (SEARCH_SPACE_BITS - SORT_PARTITION_BITS)
+
+/** engine used by momentum_search(), hashtable unless changed */
+momentum_engine& get_momentum_engine();
+
 /**
  *  @return all collisions found in the nonce search space
  */
 std::vector< std::pair<uint32_t, uint32_t> > momentum_search(pow_seed_type head, int instance = 0);
+
+/**
+ *  Queues a search on the search pool and returns right away.  Searches with
+ *  different instances use their own tables and may overlap; an instance must
+ *  not be reused before momentum_search_wait() returned for it.
+ */
+struct momentum_pending_search;
+typedef std::shared_ptr<momentum_pending_search> momentum_search_ptr;
+class search_pool;
+momentum_search_ptr                          momentum_search_async(pow_seed_type head, int instance);
+/** on `pool` and tables placed as it says, an instance must always be searched on the same pool */
+momentum_search_ptr                          momentum_search_async(pow_seed_type head, int instance, search_pool& pool);
+std::vector< std::pair<uint32_t, uint32_t> > momentum_search_wait(const momentum_search_ptr& s);
 bool momentum_verify(pow_seed_type head, uint32_t a, uint32_t b);
 
+/** memory the tables of one search instance take with the current engine */
+size_t momentum_instance_bytes();
+
+struct momentum_proof
+  {
+  pow_seed_type head;
+  uint32_t      a;
+  uint32_t      b;
+  };
+
+/**
+ *  momentum_verify() for many proofs at once, the birthday hashes of all of
+ *  them are spread over the lanes of the SHA-512 kernel.
+ */
+void momentum_verify_batch(const momentum_proof* proofs, bool* valid, size_t count);
+
 
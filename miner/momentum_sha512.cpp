@@ -0,0 +1,208 @@
+#include "momentum_sha512.hpp"
+#include "momentum_sha512_impl.hpp"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+void add_message_sha512_kernels(std::vector<momentum_sha512_kernel>& kernels);
+
+#ifdef MOMENTUM_SHA512_AVX2
+void momentum_sha512_avx2(const momentum_midstate& mid, const uint32_t* nonces, uint64_t (*out)[8]);
+void momentum_sha512_avx2_multi(const momentum_midstate* const* mids, const uint32_t* nonces, uint64_t (*out)[8]);
+#endif
+#ifdef MOMENTUM_SHA512_AVX512
+void momentum_sha512_avx512(const momentum_midstate& mid, const uint32_t* nonces, uint64_t (*out)[8]);
+void momentum_sha512_avx512_multi(const momentum_midstate* const* mids, const uint32_t* nonces, uint64_t (*out)[8]);
+#endif
+
+void momentum_sha512_prepare(const unsigned char* head, momentum_midstate& mid)
+  {
+  memset(&mid, 0, sizeof(mid) );
+
+  // W0 = nonce || head[0..3], W1..W4 = head[4..31] || 0x80, W15 = bit length
+  mid.w0 = load_be32(head);
+  mid.w[1] = load_be64(head + 4);
+  mid.w[2] = load_be64(head + 12);
+  mid.w[3] = load_be64(head + 20);
+  mid.w[4] = (uint64_t(load_be32(head + 28) ) << 32) | 0x80000000ULL;
+  mid.w[15] = 36 * 8;
+  memcpy(mid.head, head, sizeof(mid.head) );
+  for (int t = 16; t < 32; ++t)
+    {
+    uint64_t pre = 0;
+    if (is_constant_word(t - 2) )
+      pre += ssig1(mid.w[t - 2]);
+    if (is_constant_word(t - 7) )
+      pre += mid.w[t - 7];
+    if (is_constant_word(t - 15) )
+      pre += ssig0(mid.w[t - 15]);
+    if (is_constant_word(t - 16) )
+      pre += mid.w[t - 16];
+    mid.pre[t] = pre;
+    if (is_constant_word(t) )
+      mid.w[t] = pre;
+    }
+  for (int t = 1; t < 16; ++t)
+    mid.kw[t] = sha512_k[t] + mid.w[t];
+
+  // round 0 from the IV, everything but the + W0
+  uint64_t t1 = sha512_iv[7] + bsig1(sha512_iv[4]) + ch(sha512_iv[4], sha512_iv[5], sha512_iv[6]) + sha512_k[0];
+  uint64_t t2 = bsig0(sha512_iv[0]) + maj(sha512_iv[0], sha512_iv[1], sha512_iv[2]);
+  mid.a1 = t1 + t2;
+  mid.e1 = sha512_iv[3] + t1;
+  }
+
+static void momentum_sha512_scalar(const momentum_midstate& mid, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_lanes<uint64_t>(mid, nonces, out);
+  }
+
+static void momentum_sha512_scalar_multi(const momentum_midstate* const* mids, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_lanes_multi<uint64_t>(mids, nonces, out);
+  }
+
+#if defined(__GNUC__) && defined(__SSE2__)
+typedef uint64_t sse2_lanes __attribute__((vector_size(16)));
+
+static void momentum_sha512_sse2(const momentum_midstate& mid, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_lanes<sse2_lanes>(mid, nonces, out);
+  }
+
+static void momentum_sha512_sse2_multi(const momentum_midstate* const* mids, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_lanes_multi<sse2_lanes>(mids, nonces, out);
+  }
+#endif
+
+static std::vector<momentum_sha512_kernel> probe_momentum_sha512()
+  {
+  std::vector<momentum_sha512_kernel> kernels;
+  add_message_sha512_kernels(kernels);
+  momentum_sha512_kernel              scalar = { "scalar", 1, momentum_sha512_scalar, momentum_sha512_scalar_multi };
+  kernels.push_back(scalar);
+#if defined(__GNUC__) && defined(__SSE2__)
+  momentum_sha512_kernel sse2 = { "sse2", 2, momentum_sha512_sse2, momentum_sha512_sse2_multi };
+  kernels.push_back(sse2);
+#endif
+#ifdef MOMENTUM_SHA512_AVX2
+  if (__builtin_cpu_supports("avx2") )
+    {
+    momentum_sha512_kernel avx2 = { "avx2", 4, momentum_sha512_avx2, momentum_sha512_avx2_multi };
+    kernels.push_back(avx2);
+    }
+#endif
+#ifdef MOMENTUM_SHA512_AVX512
+  if (__builtin_cpu_supports("avx512f") )
+    {
+    momentum_sha512_kernel avx512 = { "avx512", 8, momentum_sha512_avx512, momentum_sha512_avx512_multi };
+    kernels.push_back(avx512);
+    }
+#endif
+  return kernels;
+  }
+
+const std::vector<momentum_sha512_kernel>& get_momentum_sha512_kernels()
+  {
+  static std::vector<momentum_sha512_kernel> kernels = probe_momentum_sha512();
+  return kernels;
+  }
+
+double time_momentum_sha512(const momentum_sha512_kernel& k, bool multi, uint32_t hashes)
+  {
+  unsigned char            head[32] = { 0 };
+  momentum_midstate        mid;
+  momentum_sha512_prepare(head, mid);
+  const momentum_midstate* mids[MOMENTUM_SHA512_MAX_LANES];
+  for (int l = 0; l < MOMENTUM_SHA512_MAX_LANES; ++l)
+    mids[l] = &mid;
+
+  uint32_t                 nonces[MOMENTUM_SHA512_MAX_LANES];
+  uint64_t                 out[MOMENTUM_SHA512_MAX_LANES][8];
+  volatile uint64_t        sink = 0;
+  std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+  for (uint32_t i = 0; i < hashes; i += k.lanes)
+    {
+    for (uint32_t l = 0; l < k.lanes; ++l)
+      nonces[l] = i + l;
+    if (multi)
+      k.hash_multi(mids, nonces, out);
+    else
+      k.hash(mid, nonces, out);
+    sink += out[0][0];
+    }
+  return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+  }
+
+/** 16k messages, a few milliseconds per kernel */
+#define MOMENTUM_SHA512_PROBE_HASHES (1 << 14)
+
+static const momentum_sha512_kernel* fastest_momentum_sha512(bool multi)
+  {
+  const std::vector<momentum_sha512_kernel>& kernels = get_momentum_sha512_kernels();
+  const momentum_sha512_kernel*              best = &kernels.back();
+  double                                     best_time = 0;
+  for (size_t i = 0; i < kernels.size(); ++i)
+    {
+    double t = time_momentum_sha512(kernels[i], multi, MOMENTUM_SHA512_PROBE_HASHES);
+    if (best_time == 0 || t < best_time)
+      {
+      best = &kernels[i];
+      best_time = t;
+      }
+    }
+  return best;
+  }
+
+/** the kernels in use, the first threads to hash may ask for them at the same time */
+struct momentum_sha512_selection
+  {
+  momentum_sha512_selection() : search(nullptr), verify(nullptr){}
+
+  std::atomic<const momentum_sha512_kernel*> search;
+  std::atomic<const momentum_sha512_kernel*> verify;
+  std::once_flag                             search_once; ///< the self-benchmark runs once
+  std::once_flag                             verify_once;
+  };
+
+static momentum_sha512_selection& get_momentum_sha512_selection()
+  {
+  static momentum_sha512_selection selection;
+  return selection;
+  }
+
+bool select_momentum_sha512(const std::string& name)
+  {
+  const std::vector<momentum_sha512_kernel>& kernels = get_momentum_sha512_kernels();
+  for (size_t i = 0; i < kernels.size(); ++i)
+    {
+    if (name == kernels[i].name)
+      {
+      get_momentum_sha512_selection().search = &kernels[i];
+      get_momentum_sha512_selection().verify = &kernels[i];
+      return true;
+      }
+    }
+  return false;
+  }
+
+const momentum_sha512_kernel& get_momentum_sha512()
+  {
+  momentum_sha512_selection& s = get_momentum_sha512_selection();
+  std::call_once(s.search_once, [&s](){
+                   if (!s.search.load() )
+                     s.search = fastest_momentum_sha512(false);
+                 });
+  return *s.search.load();
+  }
+
+const momentum_sha512_kernel& get_momentum_sha512_verify()
+  {
+  momentum_sha512_selection& s = get_momentum_sha512_selection();
+  std::call_once(s.verify_once, [&s](){
+                   if (!s.verify.load() )
+                     s.verify = fastest_momentum_sha512(true);
+                 });
+  return *s.verify.load();
+  }
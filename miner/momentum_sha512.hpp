@@ -0,0 +1,72 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** widest kernel we build, callers size their nonce/digest buffers with it */
+#define MOMENTUM_SHA512_MAX_LANES 8
+
+/**
+ *  Everything about SHA-512( nonce || head ) that only depends on the 32 byte
+ *  head, computed once per work unit by momentum_sha512_prepare().
+ */
+struct momentum_midstate
+  {
+  uint64_t w0;       ///< low half of message word 0, the nonce fills the high half
+  uint64_t w[32];    ///< message / schedule words that are independent of the nonce
+  uint64_t pre[32];  ///< nonce independent part of schedule words 16..31
+  uint64_t kw[16];   ///< K[t] + W[t] of rounds 1..15
+  uint64_t a1;       ///< a after round 0, minus W0
+  uint64_t e1;       ///< e after round 0, minus W0
+  unsigned char head[32]; ///< for the kernels that hash the plain message
+  };
+
+void momentum_sha512_prepare(const unsigned char* head, momentum_midstate& mid);
+
+/**
+ *  Hashes SHA-512( nonces[l] || head ) for every lane l of the kernel and
+ *  stores the digests as 8 host order words each (the layout of
+ *  fc::sha512::_hash).
+ */
+typedef void (*momentum_sha512_func)(const momentum_midstate& mid, const uint32_t* nonces, uint64_t (*out)[8]);
+
+/** same as momentum_sha512_func but lane l hashes with its own head, mids[l] */
+typedef void (*momentum_sha512_multi_func)(const momentum_midstate* const* mids, const uint32_t* nonces, uint64_t (*out)[8]);
+
+struct momentum_sha512_kernel
+  {
+  const char*                name;
+  uint32_t                   lanes;
+  momentum_sha512_func       hash;
+  momentum_sha512_multi_func hash_multi;
+  };
+
+/**
+ *  Every kernel this CPU can run, probed once: the lane kernels the CPU
+ *  supports and single lane wrappers around the other SHA-512
+ *  implementations linked in (sphlib, sha2.cpp, OpenSSL, fc).
+ */
+const std::vector<momentum_sha512_kernel>& get_momentum_sha512_kernels();
+
+/**
+ *  @return seconds `k` takes for `hashes` messages (a multiple of
+ *          MOMENTUM_SHA512_MAX_LANES), through hash_multi if `multi`
+ */
+double time_momentum_sha512(const momentum_sha512_kernel& k, bool multi, uint32_t hashes);
+
+/**
+ *  Forces the kernel of both the search and the verify path.
+ *
+ *  @return false if no kernel of get_momentum_sha512_kernels() has that name
+ */
+bool select_momentum_sha512(const std::string& name);
+
+/**
+ *  @return the kernel for searches (one head, many nonces), unless selected
+ *          the fastest of get_momentum_sha512_kernels() in a short
+ *          self-benchmark on first use
+ */
+const momentum_sha512_kernel& get_momentum_sha512();
+
+/** same as get_momentum_sha512() for hash_multi, which proof verification uses */
+const momentum_sha512_kernel& get_momentum_sha512_verify();
@@ -0,0 +1,17 @@
+// compiled with -mavx2, see CMakeLists.txt
+#include "momentum_sha512.hpp"
+#include "momentum_sha512_impl.hpp"
+
+#ifdef MOMENTUM_SHA512_AVX2
+typedef uint64_t avx2_lanes __attribute__((vector_size(32)));
+
+void momentum_sha512_avx2(const momentum_midstate& mid, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_lanes<avx2_lanes>(mid, nonces, out);
+  }
+
+void momentum_sha512_avx2_multi(const momentum_midstate* const* mids, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_lanes_multi<avx2_lanes>(mids, nonces, out);
+  }
+#endif
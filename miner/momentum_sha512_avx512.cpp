@@ -0,0 +1,17 @@
+// compiled with -mavx512f, see CMakeLists.txt
+#include "momentum_sha512.hpp"
+#include "momentum_sha512_impl.hpp"
+
+#ifdef MOMENTUM_SHA512_AVX512
+typedef uint64_t avx512_lanes __attribute__((vector_size(64)));
+
+void momentum_sha512_avx512(const momentum_midstate& mid, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_lanes<avx512_lanes>(mid, nonces, out);
+  }
+
+void momentum_sha512_avx512_multi(const momentum_midstate* const* mids, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_lanes_multi<avx512_lanes>(mids, nonces, out);
+  }
+#endif
@@ -0,0 +1,236 @@
+#pragma once
+/**
+ *  Lane generic SHA-512 compression used by the momentum_sha512 kernels.
+ *
+ *  Every kernel translation unit includes this file and instantiates the
+ *  templates with its own lane type (uint64_t, or a GCC vector of 2/4/8
+ *  uint64_t).  Everything lives in an anonymous namespace so that the copies
+ *  compiled with -mavx2 / -mavx512f never get merged by the linker with the
+ *  baseline copies.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "momentum_sha512.hpp"
+
+namespace {
+
+const uint64_t sha512_k[80] =
+  {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+  0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+  0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+  0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+  0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+  0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+  0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+  0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+  0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+  0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+  0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+  0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+  0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+  0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+  };
+
+const uint64_t sha512_iv[8] =
+  {
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+  };
+
+inline uint64_t load_be64(const unsigned char* p)
+  {
+  return (uint64_t(p[0]) << 56) | (uint64_t(p[1]) << 48) | (uint64_t(p[2]) << 40) | (uint64_t(p[3]) << 32) |
+         (uint64_t(p[4]) << 24) | (uint64_t(p[5]) << 16) | (uint64_t(p[6]) << 8) | uint64_t(p[7]);
+  }
+
+inline uint32_t load_be32(const unsigned char* p)
+  {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+  }
+
+/** digest words are returned in host order the way fc::sha512::_hash sees them */
+inline uint64_t digest_word(uint64_t h)
+  {
+  unsigned char be[8];
+  for (int i = 0; i < 8; ++i)
+    be[i] = (unsigned char)(h >> (56 - 8 * i));
+  uint64_t r;
+  memcpy(&r, be, sizeof(r));
+  return r;
+  }
+
+/**
+ *  Operations on a "lane" type: either a plain uint64_t or a GCC vector of
+ *  uint64_t.  Both support the arithmetic operators used by the rounds, only
+ *  broadcasting and moving data in and out of the lanes differ.
+ */
+template<typename V>
+struct lanes
+  {
+  enum { count = sizeof(V) / sizeof(uint64_t) };
+
+  static V splat(uint64_t x)
+    {
+    V v;
+    for (int i = 0; i < count; ++i)
+      ((uint64_t*)&v)[i] = x;
+    return v;
+    }
+
+  static V load(const uint64_t* x)
+    {
+    V v;
+    memcpy(&v, x, sizeof(v) );
+    return v;
+    }
+
+  static void store(uint64_t* x, V v)
+    {
+    memcpy(x, &v, sizeof(v) );
+    }
+  };
+
+template<typename V> inline V rotr(V x, int n)   { return (x >> n) | (x << (64 - n) ); }
+template<typename V> inline V bsig0(V x)         { return rotr(x, 28) ^ rotr(x, 34) ^ rotr(x, 39); }
+template<typename V> inline V bsig1(V x)         { return rotr(x, 14) ^ rotr(x, 18) ^ rotr(x, 41); }
+template<typename V> inline V ssig0(V x)         { return rotr(x, 1) ^ rotr(x, 8) ^ (x >> 7); }
+template<typename V> inline V ssig1(V x)         { return rotr(x, 19) ^ rotr(x, 61) ^ (x >> 6); }
+template<typename V> inline V ch(V x, V y, V z)  { return z ^ (x & (y ^ z) ); }
+template<typename V> inline V maj(V x, V y, V z) { return (x & y) | (z & (x | y) ); }
+
+template<typename V>
+inline void sha512_round(V& a, V& b, V& c, V& d, V& e, V& f, V& g, V& h, V kw)
+  {
+  V t1 = h + bsig1(e) + ch(e, f, g) + kw;
+  V t2 = bsig0(a) + maj(a, b, c);
+  h = g; g = f; f = e;
+  e = d + t1;
+  d = c; c = b; b = a;
+  a = t1 + t2;
+  }
+
+/** schedule words 1..15, 17, 19 and 21 of a nonce || head block do not depend on the nonce */
+inline bool is_constant_word(int t)
+  {
+  return (t >= 1 && t <= 15) || t == 17 || t == 19 || t == 21;
+  }
+
+/** position of a midstate field when the midstate is viewed as an array of words */
+#define MIDSTATE_WORD(field) (offsetof(momentum_midstate, field) / sizeof(uint64_t) )
+
+/** every lane hashes with the same midstate */
+template<typename V>
+struct shared_midstate
+  {
+  explicit shared_midstate(const momentum_midstate& mid)
+    : words( (const uint64_t*)&mid){}
+
+  V        operator[](size_t i) const      { return lanes<V>::splat(words[i]); }
+  uint64_t lane(int, size_t i) const       { return words[i]; }
+
+  const uint64_t* words;
+  };
+
+/** lane l hashes with mids[l] */
+template<typename V>
+struct lane_midstates
+  {
+  explicit lane_midstates(const momentum_midstate* const* mids)
+    : mids(mids){}
+
+  V operator[](size_t i) const
+    {
+    uint64_t x[lanes<V>::count];
+    for (int l = 0; l < lanes<V>::count; ++l)
+      x[l] = lane(l, i);
+    return lanes<V>::load(x);
+    }
+
+  uint64_t lane(int l, size_t i) const     { return ( (const uint64_t*)mids[l])[i]; }
+
+  const momentum_midstate* const* mids;
+  };
+
+/**
+ *  SHA-512( nonce || head ) for lanes<V>::count nonces.
+ *
+ *  Only W0 carries the nonce, so round 0 collapses to two adds and schedule
+ *  words 16..31 only recompute the terms that (transitively) depend on W0;
+ *  everything else was folded into the midstate by momentum_sha512_prepare().
+ */
+template<typename V, typename Mid>
+inline void momentum_sha512_core(const Mid& mid, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  typedef lanes<V> L;
+  enum { N = L::count };
+  const size_t pre = MIDSTATE_WORD(pre);
+  const size_t w = MIDSTATE_WORD(w);
+  const size_t kw = MIDSTATE_WORD(kw);
+
+  uint64_t w0[N];
+  for (int l = 0; l < N; ++l)
+    {
+    unsigned char nonce[4];
+    memcpy(nonce, &nonces[l], sizeof(nonce) );
+    w0[l] = (uint64_t(load_be32(nonce) ) << 32) | mid.lane(l, MIDSTATE_WORD(w0) );
+    }
+
+  V W[80];
+  W[0]  = L::load(w0);
+  W[16] = mid[pre + 16] + W[0];
+  W[17] = mid[w + 17];
+  W[18] = mid[pre + 18] + ssig1(W[16]);
+  W[19] = mid[w + 19];
+  W[20] = mid[pre + 20] + ssig1(W[18]);
+  W[21] = mid[w + 21];
+  W[22] = mid[pre + 22] + ssig1(W[20]);
+  W[23] = mid[pre + 23] + W[16];
+  W[24] = mid[pre + 24] + ssig1(W[22]);
+  W[25] = mid[pre + 25] + ssig1(W[23]) + W[18];
+  W[26] = mid[pre + 26] + ssig1(W[24]);
+  W[27] = mid[pre + 27] + ssig1(W[25]) + W[20];
+  W[28] = mid[pre + 28] + ssig1(W[26]);
+  W[29] = mid[pre + 29] + ssig1(W[27]) + W[22];
+  W[30] = mid[pre + 30] + ssig1(W[28]) + W[23];
+  W[31] = mid[pre + 31] + ssig1(W[29]) + W[24] + ssig0(W[16]);
+  for (int t = 32; t < 80; ++t)
+    W[t] = ssig1(W[t - 2]) + W[t - 7] + ssig0(W[t - 15]) + W[t - 16];
+
+  V a = mid[MIDSTATE_WORD(a1)] + W[0], b = L::splat(sha512_iv[0]), c = L::splat(sha512_iv[1]), d = L::splat(sha512_iv[2]);
+  V e = mid[MIDSTATE_WORD(e1)] + W[0], f = L::splat(sha512_iv[4]), g = L::splat(sha512_iv[5]), h = L::splat(sha512_iv[6]);
+
+  for (int t = 1; t < 16; ++t)
+    sha512_round(a, b, c, d, e, f, g, h, mid[kw + t]);
+  for (int t = 16; t < 80; ++t)
+    sha512_round(a, b, c, d, e, f, g, h, W[t] + L::splat(sha512_k[t]) );
+
+  V state[8] = { a, b, c, d, e, f, g, h };
+  uint64_t words[8][N];
+  for (int x = 0; x < 8; ++x)
+    L::store(words[x], state[x] + L::splat(sha512_iv[x]) );
+  for (int l = 0; l < N; ++l)
+    for (int x = 0; x < 8; ++x)
+      out[l][x] = digest_word(words[x][l]);
+  }
+
+template<typename V>
+inline void momentum_sha512_lanes(const momentum_midstate& mid, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_core<V>(shared_midstate<V>(mid), nonces, out);
+  }
+
+template<typename V>
+inline void momentum_sha512_lanes_multi(const momentum_midstate* const* mids, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  momentum_sha512_core<V>(lane_midstates<V>(mids), nonces, out);
+  }
+
+} // anonymous namespace
@@ -0,0 +1,63 @@
+// kernels wrapping the single message SHA-512 implementations linked into the miner
+#include "momentum_sha512.hpp"
+#include "sha2.h"
+#include <fc/crypto/sha512.hpp>
+#include <openssl/sha.h>
+#include <string.h>
+extern "C" {
+#include "sphlib-3.0/c/sph_sha2.h"
+}
+
+typedef void (*message_sha512)(const unsigned char* msg, unsigned char* digest);
+
+static void sph_message(const unsigned char* msg, unsigned char* digest)
+  {
+  sph_sha512_context ctx;
+  sph_sha512_init(&ctx);
+  sph_sha512(&ctx, msg, 36);
+  sph_sha512_close(&ctx, digest);
+  }
+
+static void sha2_message(const unsigned char* msg, unsigned char* digest)
+  {
+  sha512(msg, 36, digest);
+  }
+
+static void openssl_message(const unsigned char* msg, unsigned char* digest)
+  {
+  SHA512(msg, 36, digest);
+  }
+
+static void fc_message(const unsigned char* msg, unsigned char* digest)
+  {
+  fc::sha512 h = fc::sha512::hash( (const char*)msg, 36);
+  memcpy(digest, &h, sizeof(h) );
+  }
+
+/** one lane, the digest bytes already are the fc::sha512::_hash layout */
+template<message_sha512 H>
+static void message_kernel(const momentum_midstate& mid, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  unsigned char msg[36];
+  memcpy(msg, nonces, 4);
+  memcpy(msg + 4, mid.head, sizeof(mid.head) );
+  H(msg, (unsigned char*)out[0]);
+  }
+
+template<message_sha512 H>
+static void message_kernel_multi(const momentum_midstate* const* mids, const uint32_t* nonces, uint64_t (*out)[8])
+  {
+  message_kernel<H>(*mids[0], nonces, out);
+  }
+
+void add_message_sha512_kernels(std::vector<momentum_sha512_kernel>& kernels)
+  {
+  momentum_sha512_kernel sph = { "sph", 1, message_kernel<sph_message>, message_kernel_multi<sph_message> };
+  momentum_sha512_kernel sha2 = { "sha2", 1, message_kernel<sha2_message>, message_kernel_multi<sha2_message> };
+  momentum_sha512_kernel openssl = { "openssl", 1, message_kernel<openssl_message>, message_kernel_multi<openssl_message> };
+  momentum_sha512_kernel fc = { "fc", 1, message_kernel<fc_message>, message_kernel_multi<fc_message> };
+  kernels.push_back(sph);
+  kernels.push_back(sha2);
+  kernels.push_back(openssl);
+  kernels.push_back(fc);
+  }
@@ -0,0 +1,29 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ *  Splits argv into positional arguments and --name=value options.
+ */
+inline std::vector<std::string> parse_args(int argc, char** argv, std::map<std::string, std::string>& options)
+  {
+  std::vector<std::string> args;
+  for (int i = 0; i < argc; ++i)
+    {
+    std::string arg = argv[i];
+    if (i > 0 && arg.size() > 2 && arg.substr(0, 2) == "--")
+      {
+      size_t eq = arg.find('=');
+      if (eq == std::string::npos)
+        options[arg.substr(2)] = "";
+      else
+        options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+      }
+    else
+      {
+      args.push_back(arg);
+      }
+    }
+  return args;
+  }
@@ -0,0 +1,279 @@
+#include "payout.hpp"
+#include <fc/exception/exception.hpp>
+#include <fc/log/logger.hpp>
+#include <boost/exception/diagnostic_information.hpp>
+#include <algorithm>
+#include <sstream>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+payout_journal::payout_journal() :
+  file(nullptr),
+  last_id(0){}
+
+payout_journal::~payout_journal()
+  {
+  if (file)
+    fclose(file);
+  }
+
+void payout_journal::open(const std::string& path, uint64_t settled_after)
+  {
+  std::string contents;
+  FILE*       in = fopen(path.c_str(), "rb");
+  if (in)
+    {
+    char   buf[4096];
+    size_t n;
+    while ( (n = fread(buf, 1, sizeof(buf), in) ) > 0)
+      contents.append(buf, n);
+    fclose(in);
+    }
+
+  // only whole lines count, a crash may have cut the last one short
+  size_t pos = 0;
+  for (size_t end; (end = contents.find('\n', pos) ) != std::string::npos; pos = end + 1)
+    {
+    std::istringstream line(contents.substr(pos, end - pos) );
+    std::string        state;
+    payout_batch       batch;
+    if (!(line >> state >> batch.id) )
+      continue;
+    last_id = std::max(last_id, batch.id);
+
+    if (state == "begin")
+      {
+      std::string payment;
+      while (line >> payment)
+        {
+        size_t colon = payment.rfind(':');
+        if (colon == std::string::npos)
+          continue;
+        uint64_t           amount = 0;
+        std::istringstream digits(payment.substr(colon + 1) );
+        digits >> amount;
+        batch.payments.push_back(bitcoin::payment(payment.substr(0, colon), amount) );
+        }
+      unfinished.push_back(batch);
+      }
+    else
+      {
+      for (size_t i = 0; i < unfinished.size(); ++i)
+        if (unfinished[i].id == batch.id)
+          {
+          if ( (state == "sent" || state == "doubt") && batch.id > settled_after)
+            settled.push_back(unfinished[i]);
+          unfinished.erase(unfinished.begin() + i--);
+          }
+      }
+    }
+
+  file = fopen(path.c_str(), "ab");
+  if (!file)
+    FC_THROW_EXCEPTION(fc::exception, "unable to open payout journal ${j}", ("j", path) );
+  if (pos < contents.size() )
+    append(std::string() );
+  }
+
+void payout_journal::append(const std::string& line)
+  {
+  if (fputs( (line + "\n").c_str(), file) < 0 || fflush(file) != 0)
+    FC_THROW_EXCEPTION(fc::exception, "unable to write the payout journal");
+#ifdef WIN32
+  _commit(_fileno(file) );
+#else
+  fsync(fileno(file) );
+#endif
+  }
+
+void payout_journal::begin(const payout_batch& batch)
+  {
+  std::stringstream ss;
+  ss << "begin " << batch.id;
+  for (size_t i = 0; i < batch.payments.size(); ++i)
+    ss << " " << batch.payments[i].first << ":" << batch.payments[i].second;
+  append(ss.str() );
+  last_id = std::max(last_id, batch.id);
+  }
+
+void payout_journal::finish(uint64_t id, const std::string& state, const std::string& detail)
+  {
+  std::stringstream ss;
+  ss << state << " " << id << " " << detail;
+  std::string line = ss.str();
+  std::replace(line.begin(), line.end(), '\n', ' ');
+  append(line);
+  }
+
+payout_engine::payout_engine(user_database& u, const send_function& s, const check_function& c,
+                             const std::string& journal_path, const std::string& log_path) :
+  users(u),
+  send(s),
+  check(c),
+  thread("payout"),
+  next_id(1)
+  {
+  journal.open(journal_path, users.get_totals().last_payout);
+  payment_log.open(log_path.c_str(), std::fstream::out | std::fstream::app);
+  }
+
+void payout_engine::recover()
+  {
+  if (!thread.is_current() )
+    {
+    thread.async( [ = ](){ recover(); }
+                  ).wait();
+    return;
+    }
+  pool_totals totals = users.get_totals();
+  for (size_t i = 0; i < journal.get_settled().size(); ++i)
+    {
+    // the journal line reached the disk but the debit did not, without it the users would be paid again
+    const payout_batch& batch = journal.get_settled()[i];
+    if (batch.id <= users.get_totals().last_payout)
+      continue;
+    wlog("payout batch ${id} was sent or is in doubt but missing from the balances, taking it again", ("id", batch.id) );
+    if (!users.apply_payout(batch.id, batch.payments, false) )
+      FC_THROW_EXCEPTION(fc::exception, "unable to write payout batch ${id}", ("id", batch.id) );
+    }
+  for (size_t i = 0; i < journal.get_unfinished().size(); ++i)
+    {
+    const payout_batch& batch = journal.get_unfinished()[i];
+    if (totals.last_payout < batch.id)
+      journal.finish(batch.id, "failed", "not taken from the balances before the restart");
+    else if (totals.last_refund >= batch.id)
+      journal.finish(batch.id, "failed", "given back before the restart");
+    else
+      {
+      elog("payout batch ${id} was taken from the balances but may not have been sent, check the wallet",
+           ("id", batch.id) );
+      journal.finish(batch.id, "doubt", "interrupted after it was taken from the balances");
+      }
+    }
+  next_id = std::max(journal.get_last_id(), std::max(totals.last_payout, totals.last_refund) ) + 1;
+  }
+
+uint64_t payout_engine::run_round(int64_t min_balance, uint32_t max_outputs)
+  {
+  if (!thread.is_current() )
+    return thread.async( [ = ](){ return run_round(min_balance, max_outputs); }
+                         ).wait();
+
+  std::vector<bitcoin::payment> candidates;
+  users.for_each_payout(min_balance, [&](const std::string& key, const user_record& user){
+                          candidates.push_back(bitcoin::payment(key, uint64_t(user.get_balance() ) ) );
+                          }
+                        );
+
+  // one bad address would get every batch it lands in refused, round after round
+  std::vector<bitcoin::payment> due;
+  for (size_t i = 0; i < candidates.size(); ++i)
+    {
+    try
+      {
+      if (is_valid_payee(candidates[i].first) )
+        due.push_back(candidates[i]);
+      else
+        wlog("not paying ${n} to ${a}, bitcoind does not take the address", ("n", candidates[i].second)("a", candidates[i].first) );
+      }
+    catch (...)
+      {
+      // nothing was taken from the balances yet, the next round tries again
+      elog("unable to check payout addresses, round skipped: ${e}", ("e", boost::current_exception_diagnostic_information() ) );
+      return 0;
+      }
+    }
+
+  uint64_t sent = 0;
+  for (size_t first = 0; first < due.size(); first += std::max<uint32_t>(max_outputs, 1) )
+    {
+    payout_batch batch;
+    batch.id = next_id++;
+    batch.payments.assign(due.begin() + first, due.begin() + std::min(due.size(), first + std::max<uint32_t>(max_outputs, 1) ) );
+    // a refused batch was given back, the others may still go through
+    if (!pay_batch(batch) )
+      continue;
+    for (size_t i = 0; i < batch.payments.size(); ++i)
+      sent += batch.payments[i].second;
+    }
+  return sent;
+  }
+
+bool payout_engine::is_valid_payee(const std::string& address)
+  {
+  if (valid_payees.count(address) )
+    return true;
+  if (!check(address) )
+    return false;
+  valid_payees.insert(address);
+  return true;
+  }
+
+bool payout_engine::pay_batch(const payout_batch& batch)
+  {
+  journal.begin(batch);
+  if (!users.apply_payout(batch.id, batch.payments, false) )
+    {
+    // still in the cache, the next flush writes it and recover() sorts it out
+    elog("unable to write payout batch ${id}, payouts stop until a restart", ("id", batch.id) );
+    FC_THROW_EXCEPTION(fc::exception, "unable to write payout batch ${id}", ("id", batch.id) );
+    }
+
+  payout_result result;
+  try
+    {
+    result = send(batch.payments);
+    }
+  catch (...)
+    {
+    std::string why = boost::current_exception_diagnostic_information();
+    elog("payout batch ${id} may or may not have been sent, check the wallet: ${e}", ("id", batch.id)("e", why) );
+    journal.finish(batch.id, "doubt", why);
+    // bitcoind is likely gone, another round would only add batches in doubt
+    FC_THROW_EXCEPTION(fc::exception, "payout batch ${id} is in doubt", ("id", batch.id) );
+    }
+
+  if (!result.sent)
+    {
+    wlog("bitcoind refused payout batch ${id}: ${e}", ("id", batch.id)("e", result.detail) );
+    if (!users.apply_payout(batch.id, batch.payments, true) )
+      FC_THROW_EXCEPTION(fc::exception, "unable to give back payout batch ${id}", ("id", batch.id) );
+    journal.finish(batch.id, "failed", result.detail);
+    return false;
+    }
+
+  journal.finish(batch.id, "sent", result.detail);
+  std::string now = fc::time_point::now();
+  for (size_t i = 0; i < batch.payments.size(); ++i)
+    payment_log << now << ", " << batch.payments[i].first << ", " << batch.payments[i].second << ", " << result.detail << "\n";
+  payment_log.flush();
+  ilog("sent payout batch ${id} to ${n} users: ${trx}", ("id", batch.id)("n", batch.payments.size() )("trx", result.detail) );
+  return true;
+  }
+
+void payout_engine::start(int64_t min_balance, uint32_t max_outputs, fc::microseconds interval)
+  {
+  rounds = thread.async( [ = ](){ round_loop(min_balance, max_outputs, interval); }
+                         );
+  }
+
+void payout_engine::round_loop(int64_t min_balance, uint32_t max_outputs, fc::microseconds interval)
+  {
+  while (true)
+    {
+    fc::usleep(interval);
+    try
+      {
+      run_round(min_balance, max_outputs);
+      }
+    catch (const fc::exception& e)
+      {
+      elog("payout round failed: ${e}", ("e", e.to_detail_string() ) );
+      return;
+      }
+    }
+  }
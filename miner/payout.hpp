@@ -0,0 +1,149 @@
+#pragma once
+#include "bitcoin.hpp"
+#include "user_database.hpp"
+#include <fc/thread/thread.hpp>
+#include <fc/time.hpp>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+/** a payout batch as journaled, one transaction */
+struct payout_batch
+  {
+  payout_batch() : id(0){}
+
+  uint64_t                      id;
+  std::vector<bitcoin::payment> payments;
+  };
+
+/**
+ *  Append-only log of payout batches, every line is synced to disk before
+ *  the step after it is taken:
+ *
+ *    begin <id> <address>:<satoshi> ...
+ *    sent <id> <transaction id>
+ *    failed <id> <why>
+ *    doubt <id> <why>
+ *
+ *  A batch with a begin line and nothing after it was interrupted, one
+ *  sent or in doubt may have lost its place in the balances, see
+ *  payout_engine::recover().
+ */
+class payout_journal
+{
+public:
+  payout_journal();
+  ~payout_journal();
+
+  /**
+   *  Reads the batches of an existing journal, then opens it for appending.
+   *  Batches sent or in doubt are kept if their id is above `settled_after`.
+   */
+  void open(const std::string& path, uint64_t settled_after);
+
+  void begin(const payout_batch& batch);
+  /** @param state sent, failed or doubt */
+  void finish(uint64_t id, const std::string& state, const std::string& detail);
+
+  /** batches with a begin line and nothing after it, as found by open() */
+  const std::vector<payout_batch>& get_unfinished() const
+    {
+    return unfinished;
+    }
+
+  /** batches sent or in doubt after `settled_after`, as found by open() */
+  const std::vector<payout_batch>& get_settled() const
+    {
+    return settled;
+    }
+
+  /** highest batch id in the journal */
+  uint64_t get_last_id() const
+    {
+    return last_id;
+    }
+
+private:
+  void append(const std::string& line);
+
+  FILE*                     file;
+  std::vector<payout_batch> unfinished;
+  std::vector<payout_batch> settled;
+  uint64_t                  last_id;
+
+  payout_journal(const payout_journal&);
+  payout_journal& operator=(const payout_journal&);
+};
+
+/**
+ *  What became of a batch.  Not sent also covers requests that never fully
+ *  went out, an exception means bitcoind may have run it without answering.
+ */
+struct payout_result
+  {
+  payout_result(bool s = false, const std::string& d = std::string() )
+    : sent(s), detail(d){}
+
+  bool        sent;
+  std::string detail; ///< the transaction id, or why bitcoind refused
+  };
+
+/**
+ *  Pays the users whose balance reached a threshold, up to `max_outputs`
+ *  of them per transaction.  Rounds run on a thread of their own and the
+ *  send function does the RPC wherever the bitcoind client lives, so a
+ *  payout round never holds up share processing.
+ *
+ *  Addresses come from miners, so every payee is checked with the check
+ *  function first and users whose address bitcoind does not take are left
+ *  out of the round.  A batch is journaled, then taken from the balances in
+ *  the user database together with its id, then sent.  If bitcoind refuses
+ *  it the balances are given back and the round goes on with the next batch.
+ *  If bitcoind does not answer the batch may or may not have been paid; it
+ *  is marked doubt and left to the operator, the users are not paid twice.
+ */
+class payout_engine
+{
+public:
+  typedef std::function<payout_result (const std::vector<bitcoin::payment>&)> send_function;
+  /** true if bitcoind takes the address, throws if it cannot be asked */
+  typedef std::function<bool (const std::string&)>                            check_function;
+
+  payout_engine(user_database& users, const send_function& send, const check_function& check,
+                const std::string& journal_path, const std::string& log_path);
+
+  /** finishes the batches a crash interrupted, runs before the first round */
+  void     recover();
+
+  /**
+   *  Pays every user with at least min_balance and a valid address, throws
+   *  if a batch is in doubt.  Runs on the payout thread, other threads wait
+   *  for it.
+   *
+   *  @return the amount sent
+   */
+  uint64_t run_round(int64_t min_balance, uint32_t max_outputs);
+
+  /** runs a round every `interval` on the payout thread, until one throws */
+  void     start(int64_t min_balance, uint32_t max_outputs, fc::microseconds interval);
+
+private:
+  void     round_loop(int64_t min_balance, uint32_t max_outputs, fc::microseconds interval);
+  /** @return true if the batch was sent */
+  bool     pay_batch(const payout_batch& batch);
+  bool     is_valid_payee(const std::string& address);
+
+  user_database&   users;
+  send_function    send;
+  check_function   check;
+  std::unordered_set<std::string> valid_payees; ///< checked before, addresses do not turn invalid
+  payout_journal   journal;
+  std::ofstream    payment_log;
+  fc::thread       thread;
+  fc::future<void> rounds;
+  uint64_t         next_id;
+};
@@ -0,0 +1,114 @@
+#pragma once
+#include "work_message.hpp"
+#include <stdint.h>
+
+/**
+ *  Pool protocol version 2.
+ *
+ *  A server that speaks it sends its work packet on connect with type HELLO,
+ *  older ones send SET_WORK and would take a HELLO for an invalid share.
+ *  Only then a miner answers with a 192 byte work_message of type HELLO
+ *  carrying its address and the protocol version in header.version.  The
+ *  server answers with a FRAME_HELLO_ACK and from then on both sides send
+ *  frames: a pool_frame_header followed by `size` bytes of payload.  Frames
+ *  are multiples of 16 bytes like everything written to an stcp_socket.
+ *
+ *  The first two bytes of a frame are POOL_FRAME_MAGIC, which no work_message
+ *  type starts with, so a miner can tell a frame from a 192 byte packet of a
+ *  server that ignored the HELLO and keep going with the old protocol.
+ *
+ *  Shares go up as (nonce, birthday_a, birthday_b) of a work id, many in one
+ *  frame, and get no reply.  The server sends FRAME_WORK on new blocks and
+ *  difficulty changes and FRAME_STATS on a timer.
+ *
+ *  A FRAME_WORK hands the connection `nonce_count` nonces from header.nonce
+ *  on that no other connection searches for the block; shares outside them
+ *  are invalid.  A miner that used them up sends FRAME_GET_WORK with the
+ *  count it would like next and gets a FRAME_WORK with a fresh range.
+ */
+#define POOL_PROTOCOL_VERSION 2
+#define POOL_FRAME_MAGIC      0x5032
+#define POOL_MAX_FRAME_SHARES 256
+
+enum pool_frame_type
+  {
+  FRAME_HELLO_ACK = 1,
+  FRAME_WORK      = 2,
+  FRAME_SHARES    = 3,
+  FRAME_STATS     = 4,
+  FRAME_GET_WORK  = 5
+  };
+
+struct pool_frame_header
+  {
+  pool_frame_header(uint8_t t = 0, uint32_t s = 0)
+    : magic(POOL_FRAME_MAGIC), type(t), reserved(0), size(s), work_id(0), count(0){}
+
+  uint16_t magic;
+  uint8_t  type;
+  uint8_t  reserved;
+  uint32_t size;     ///< payload bytes after the header, a multiple of 16
+  uint32_t work_id;  ///< FRAME_WORK, FRAME_SHARES, FRAME_GET_WORK (the used up one)
+  uint32_t count;    ///< shares in a FRAME_SHARES
+  };
+
+struct pool_hello_ack
+  {
+  uint32_t version;
+  uint32_t stats_interval_ms;
+  uint32_t max_shares;  ///< per FRAME_SHARES
+  uint32_t reserved;
+  };
+
+struct pool_work
+  {
+  bitcoin::work header;      ///< nonce is the first of the connection's nonces
+  uint8_t       share_shift; ///< see work_message::share_shift
+  uint8_t       reserved[3];
+  uint32_t      nonce_count; ///< nonces from header.nonce on (wrapping) that are the connection's, 0 for no bound
+  };
+
+struct pool_work_request
+  {
+  uint32_t nonce_count; ///< wanted, the server may hand out fewer
+  uint32_t reserved[3];
+  };
+
+struct pool_share
+  {
+  uint32_t nonce;
+  uint32_t birthday_a;
+  uint32_t birthday_b;
+  uint32_t reserved;
+  };
+
+struct pool_stats
+  {
+  user_record user;
+  uint64_t    mature_balance;
+  uint64_t    pool_shares;
+  uint64_t    pool_earned;
+  float       pool_spm;
+  float       pool_fee;
+  float       user_spm;       ///< valid shares per minute of the address on all its connections, at difficulty 1
+  float       connection_spm; ///< shares per minute sent on this connection, at difficulty 1
+  uint64_t    reserved;
+  };
+
+/** a header and its fixed size payload, written with one call */
+template<typename T>
+struct pool_frame
+  {
+  pool_frame(uint8_t type)
+    : head(type, sizeof(T) ), body(){}
+
+  pool_frame_header head;
+  T                 body;
+  };
+
+static_assert(sizeof(pool_frame_header) == 16, "frames must stay 16 byte aligned");
+static_assert(sizeof(pool_hello_ack) % 16 == 0, "frames must stay 16 byte aligned");
+static_assert(sizeof(pool_work) % 16 == 0, "frames must stay 16 byte aligned");
+static_assert(sizeof(pool_work_request) == 16, "frames must stay 16 byte aligned");
+static_assert(sizeof(pool_share) == 16, "frames must stay 16 byte aligned");
+static_assert(sizeof(pool_stats) % 16 == 0, "frames must stay 16 byte aligned");
@@ -0,0 +1,76 @@
+#include "rate_meter.hpp"
+#include <algorithm>
+#include <chrono>
+
+#define RATE_METER_STAMP_BITS 22
+#define RATE_METER_COUNT_BITS (64 - RATE_METER_STAMP_BITS)
+#define RATE_METER_COUNT_MASK ( (uint64_t(1) << RATE_METER_COUNT_BITS) - 1)
+#define RATE_METER_STAMP_MASK ( (uint64_t(1) << RATE_METER_STAMP_BITS) - 1)
+
+static uint64_t stamp_of(uint64_t bucket)
+  {
+  return bucket >> RATE_METER_COUNT_BITS;
+  }
+
+rate_meter::rate_meter()
+  {
+  for (uint32_t i = 0; i < RATE_METER_SECONDS; ++i)
+    buckets[i].store(0, std::memory_order_relaxed);
+  last.store(0, std::memory_order_relaxed);
+  }
+
+rate_meter::rate_meter(const rate_meter& other)
+  {
+  *this = other;
+  }
+
+rate_meter& rate_meter::operator=(const rate_meter& other)
+  {
+  for (uint32_t i = 0; i < RATE_METER_SECONDS; ++i)
+    buckets[i].store(other.buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  last.store(other.last.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  return *this;
+  }
+
+uint64_t rate_meter::now()
+  {
+  // steady clocks may start at boot, keep `now - RATE_METER_SECONDS` positive
+  return RATE_METER_SECONDS + uint64_t(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch() ).count() );
+  }
+
+void rate_meter::add(uint64_t n)
+  {
+  uint64_t               sec = now();
+  uint64_t               stamp = sec & RATE_METER_STAMP_MASK;
+  std::atomic<uint64_t>& bucket = buckets[sec % RATE_METER_SECONDS];
+
+  // the first add of a second restarts the bucket it last used RATE_METER_SECONDS ago
+  uint64_t cur = bucket.load(std::memory_order_relaxed);
+  uint64_t next;
+  do
+    {
+    uint64_t count = stamp_of(cur) == stamp ? cur & RATE_METER_COUNT_MASK : 0;
+    next = (stamp << RATE_METER_COUNT_BITS) | std::min(count + n, RATE_METER_COUNT_MASK);
+    }
+  while (!bucket.compare_exchange_weak(cur, next, std::memory_order_relaxed) );
+
+  if (last.load(std::memory_order_relaxed) != sec)
+    last.store(sec, std::memory_order_relaxed);
+  }
+
+double rate_meter::rate(uint32_t seconds) const
+  {
+  seconds = std::min<uint32_t>(std::max<uint32_t>(seconds, 1), RATE_METER_SECONDS - 1);
+  uint64_t sec = now();
+  if (sec - last.load(std::memory_order_relaxed) > RATE_METER_SECONDS)
+    return 0;
+
+  uint64_t total = 0;
+  for (uint32_t age = 1; age <= seconds; ++age)
+    {
+    uint64_t bucket = buckets[(sec - age) % RATE_METER_SECONDS].load(std::memory_order_relaxed);
+    if (stamp_of(bucket) == ( (sec - age) & RATE_METER_STAMP_MASK) )
+      total += bucket & RATE_METER_COUNT_MASK;
+    }
+  return total / double(seconds);
+  }
@@ -0,0 +1,39 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+// seconds of history a rate_meter keeps
+#define RATE_METER_SECONDS 128
+
+/**
+ *  Events per second over a sliding window, from a ring of per-second
+ *  buckets.  A bucket packs its second (the low 22 bits) and its count into
+ *  one word, so add() and rate() take no lock and may be
+ *  called from any thread.  Counts saturate at 2^42 - 1 per second.
+ *
+ *  rate() leaves out the second in progress, it is still filling.
+ */
+class rate_meter
+{
+public:
+  rate_meter();
+  rate_meter(const rate_meter& other);
+  rate_meter& operator=(const rate_meter& other);
+
+  void   add(uint64_t n = 1);
+
+  /** per second over the last `seconds` whole seconds, at most RATE_METER_SECONDS - 1 */
+  double rate(uint32_t seconds) const;
+
+  double per_minute(uint32_t seconds) const
+    {
+    return rate(seconds) * 60;
+    }
+
+  /** the clock of the meters, in seconds */
+  static uint64_t now();
+
+private:
+  std::atomic<uint64_t> buckets[RATE_METER_SECONDS];
+  std::atomic<uint64_t> last; ///< second of the latest add(), so long idle meters read 0
+};
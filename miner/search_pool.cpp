@@ -0,0 +1,243 @@
+#include "search_pool.hpp"
+#include "table_memory.hpp"
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+uint64_t& get_thread_count();
+
+/** one worker's share of a job, padded so claiming never shares a cache line */
+struct chunk_range
+  {
+  std::atomic<uint32_t> next;
+  uint32_t              end;
+  char                  pad[64 - sizeof(std::atomic<uint32_t>) - sizeof(uint32_t)];
+  };
+
+class search_pool::job
+{
+public:
+  job(uint32_t chunks, uint32_t workers, const task& t, const completion& done) :
+    run(t),
+    on_done(done),
+    ranges(new chunk_range[workers]),
+    range_count(workers),
+    remaining(chunks),
+    exhausted(false)
+    {
+    for (uint32_t w = 0; w < workers; ++w)
+      {
+      ranges[w].next = uint32_t(uint64_t(chunks) * w / workers);
+      ranges[w].end = uint32_t(uint64_t(chunks) * (w + 1) / workers);
+      }
+    }
+
+  /** @return false once every chunk has been handed out */
+  bool claim(uint32_t worker, uint32_t& chunk)
+    {
+    for (uint32_t i = 0; i < range_count; ++i)
+      {
+      chunk_range& r = ranges[(worker + i) % range_count];
+      if (r.next.load(std::memory_order_relaxed) >= r.end)
+        continue;
+      chunk = r.next.fetch_add(1);
+      if (chunk < r.end)
+        return true;
+      }
+    return false;
+    }
+
+  task                           run;
+  completion                     on_done;
+  std::unique_ptr<chunk_range[]> ranges;
+  uint32_t                       range_count;
+  std::atomic<uint32_t>          remaining;
+  bool                           exhausted; ///< protected by queue_mutex
+  std::mutex                     done_mutex;
+  std::condition_variable        done;
+};
+
+search_pool::search_pool(uint32_t threads, const std::vector<int>& cpus, const table_memory_options& m) :
+  stopping(false),
+  memory(m)
+  {
+  if (threads == 0)
+    threads = 1;
+  for (uint32_t i = 0; i < threads; ++i)
+    {
+    int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+    workers.push_back(std::thread( [ = ](){ run(i, cpu); }
+                                   ) );
+    }
+  }
+
+search_pool::~search_pool()
+  {
+    {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    stopping = true;
+    }
+  queue_changed.notify_all();
+  for (size_t i = 0; i < workers.size(); ++i)
+    workers[i].join();
+  }
+
+search_pool::job_ptr search_pool::submit(uint32_t chunks, const task& t, const completion& done)
+  {
+  job_ptr j = std::make_shared<job>(chunks, size(), t, done);
+  if (chunks == 0)
+    {
+    if (done)
+      done();
+    return j;
+    }
+
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  jobs.push_back(j);
+  lock.unlock();
+  queue_changed.notify_all();
+  return j;
+  }
+
+void search_pool::wait(const job_ptr& j)
+  {
+  std::unique_lock<std::mutex> lock(j->done_mutex);
+  while (j->remaining.load() != 0)
+    j->done.wait(lock);
+  }
+
+search_pool::job_ptr search_pool::next_job()
+  {
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  while (!stopping)
+    {
+    for (size_t i = 0; i < jobs.size(); ++i)
+      {
+      if (!jobs[i]->exhausted)
+        return jobs[i];
+      }
+    queue_changed.wait(lock);
+    }
+  return job_ptr();
+  }
+
+/** cpus past what an affinity mask holds (other processor groups on Windows) are left unpinned */
+static void pin_to_cpu(int cpu)
+  {
+#ifdef WIN32
+  if (cpu >= int(sizeof(DWORD_PTR) * 8) )
+    return;
+  SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#elif defined(__linux__)
+  if (cpu >= CPU_SETSIZE)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+  }
+
+void search_pool::run(uint32_t worker, int cpu)
+  {
+  if (cpu >= 0)
+    pin_to_cpu(cpu);
+
+  while (job_ptr j = next_job() )
+    {
+    uint32_t chunk;
+    while (j->claim(worker, chunk) )
+      {
+      j->run(chunk, worker);
+      if (j->remaining.fetch_sub(1) == 1)
+        {
+        if (j->on_done)
+          j->on_done();
+        std::unique_lock<std::mutex> lock(j->done_mutex);
+        j->done.notify_all();
+        }
+      }
+
+    // nothing left to hand out, later jobs get the workers from now on
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    if (!j->exhausted)
+      {
+      j->exhausted = true;
+      for (size_t i = 0; i < jobs.size(); ++i)
+        {
+        if (jobs[i] == j)
+          {
+          jobs.erase(jobs.begin() + i);
+          break;
+          }
+        }
+      }
+    }
+  }
+
+std::vector<int> read_cpu_list(const std::string& path)
+  {
+  std::vector<int>  cpus;
+  std::ifstream     in(path.c_str() );
+  std::string       range;
+  // "0-7,16-23"
+  while (std::getline(in, range, ',') )
+    {
+    int first = 0, last = 0;
+    char dash = 0;
+    std::stringstream ss(range);
+    ss >> first;
+    if (ss >> dash >> last)
+      {
+      for (int c = first; c <= last; ++c)
+        cpus.push_back(c);
+      }
+    else
+      {
+      cpus.push_back(first);
+      }
+    }
+  return cpus;
+  }
+
+std::vector<int> cpus_of_numa_node(int node)
+  {
+  std::stringstream path;
+  path << "/sys/devices/system/node/node" << node << "/cpulist";
+  return read_cpu_list(path.str() );
+  }
+
+bool& get_pin_search_threads()
+  {
+  static bool pin = false;
+  return pin;
+  }
+
+std::vector<int> get_search_cpus()
+  {
+  std::vector<int> cpus;
+  if (!get_pin_search_threads() )
+    return cpus;
+  int node = get_table_memory_options().numa_node;
+  if (node >= 0)
+    cpus = cpus_of_numa_node(node);
+  if (cpus.empty() )
+    {
+    for (uint32_t c = 0; c < std::thread::hardware_concurrency(); ++c)
+      cpus.push_back(c);
+    }
+  return cpus;
+  }
+
+search_pool& get_search_pool()
+  {
+  static search_pool pool(uint32_t(get_thread_count() ), get_search_cpus() );
+  return pool;
+  }
@@ -0,0 +1,77 @@
+#pragma once
+#include "table_memory.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+/**
+ *  Persistent pool of search threads with chunked work stealing.
+ *
+ *  A job is split into `chunks`.  Every worker starts on its own contiguous
+ *  share of the chunks and, once that runs dry, steals chunks from the shares
+ *  of the other workers, so threads that finish early never sit idle while
+ *  others still have work.  Jobs queue up: workers that ran out of chunks of
+ *  one job immediately start on the next, which lets consecutive work units
+ *  overlap instead of draining the pool between them.
+ */
+class search_pool
+{
+public:
+  /** runs one chunk, `worker` is unique among concurrently running tasks */
+  typedef std::function<void (uint32_t chunk, uint32_t worker)> task;
+  /** called by the worker that finished the last chunk of a job */
+  typedef std::function<void ()>                                completion;
+
+  class job;
+  typedef std::shared_ptr<job> job_ptr;
+
+  /**
+   *  @param cpus if not empty worker i is pinned to cpus[i % cpus.size()]
+   *  @param memory placement of the tables searched on this pool
+   */
+  search_pool(uint32_t threads, const std::vector<int>& cpus = std::vector<int>(),
+              const table_memory_options& memory = get_table_memory_options() );
+  ~search_pool();
+
+  job_ptr  submit(uint32_t chunks, const task& t, const completion& done = completion() );
+  /** blocks the calling thread, fc tasks should wait on a promise set from `done` instead */
+  void     wait(const job_ptr& j);
+  uint32_t size() const { return uint32_t(workers.size() ); }
+  const table_memory_options& get_table_memory() const { return memory; }
+
+private:
+  void     run(uint32_t worker, int cpu);
+  job_ptr  next_job();
+
+  std::vector<std::thread> workers;
+  std::mutex               queue_mutex;
+  std::condition_variable  queue_changed;
+  std::deque<job_ptr>      jobs;
+  bool                     stopping;
+  table_memory_options     memory;
+
+  search_pool(const search_pool&);
+  search_pool& operator=(const search_pool&);
+};
+
+/** cpus of a sysfs cpu list file ("0-7,16-23"), empty if unknown */
+std::vector<int> read_cpu_list(const std::string& path);
+
+/** cpus listed in /sys/devices/system/node/nodeN/cpulist, empty if unknown */
+std::vector<int> cpus_of_numa_node(int node);
+
+/** cpus the search threads are pinned to, empty if they are not pinned */
+std::vector<int> get_search_cpus();
+
+/** pool sized by get_thread_count(), created on first use */
+search_pool&     get_search_pool();
+
+/** pin the pool created by get_search_pool() to cores */
+bool&            get_pin_search_threads();
@@ -2,24 +2,35 @@
 #include <fc/reflect/reflect.hpp>
 #include <bts/network/stcp_socket.hpp>
 #include "bitcoin.hpp"
+#include "bitcoin_mock.hpp"
 #include <fc/thread/thread.hpp>
 #include <fc/network/ip.hpp>
 #include <unordered_map>
 #include <fc/log/logger.hpp>
 #include <fc/asio.hpp>
 #include <fc/crypto/city.hpp>
+#include <fc/exception/exception.hpp>
 #include <fc/reflect/variant.hpp>
 #include "user_database.hpp"
 #include <fc/io/json.hpp>
 
 #include "work_message.hpp"
-#include <bts/db/level_map.hpp>
+#include "pool_protocol.hpp"
 #include <iostream>
 #include <fc/crypto/hex.hpp>
 #include "momentum.hpp"
+#include "share_verifier.hpp"
+#include "share_filter.hpp"
+#include "metrics.hpp"
+#include "payout.hpp"
+#include "rate_meter.hpp"
+#include "momentum_sha512.hpp"
 
 #include <boost/exception/all.hpp>
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <mutex>
 #include <stdint.h>
 
 using namespace bts::network;
@@ -50,142 +61,339 @@ uint64_t get_reward(uint64_t block_num)
   return init_reward;
   }
 
-uint64_t       total_paid = 0;
-uint64_t       total_earned = 0;
-uint64_t       all_shares = 0;
-uint64_t       submited = 0;
-uint64_t       stale = 0;
-uint64_t       total_invalid = 0;
-fc::time_point last_window_start = fc::time_point::now();
-uint64_t       last_window_start_shares = 0;
-double         share_per_min = 0;
-bool           server_ok = false;
+uint64_t              total_paid = 0;
+uint64_t              total_earned = 0;
+std::atomic<uint64_t> all_shares(0);
+uint64_t              submited = 0;
+std::atomic<uint64_t> stale(0);
+std::atomic<uint64_t> total_invalid(0);
+std::atomic<bool>     server_ok(false);
+
+/**
+ *  Share difficulty of one connection, see work_message::share_shift.  The
+ *  shift moves by whole powers of two toward the configured shares per
+ *  minute.  The rate comes from the shares of the last window weighted by
+ *  their difficulty, so it carries over retargets.
+ */
+struct vardiff
+  {
+  vardiff()
+    : shift(0), prev_shift(0), legacy(false), window_shares(0), window_start(fc::time_point::now() ),
+    connected(window_start), spm(0){}
+
+  uint8_t        shift;
+  uint8_t        prev_shift;    ///< shares mined before the last retarget are still accepted
+  bool           legacy;        ///< the miner does not know share_shift, keep the starting shift
+  uint32_t       window_shares; ///< since the last retarget
+  fc::time_point window_start;  ///< of the last retarget
+  fc::time_point connected;
+  rate_meter     work;          ///< shares sent, weighted by their difficulty
+  double         spm;           ///< shares per minute at the current shift, as of the last retarget
+
+  void add_share(uint8_t share_shift)
+    {
+    ++window_shares;
+    work.add(uint64_t(1) << share_shift);
+    }
+
+  /** shares per minute at difficulty 1 over the last `seconds`, or since the connection opened */
+  double work_per_minute(uint32_t seconds) const
+    {
+    uint32_t age = uint32_t( (fc::time_point::now() - connected).count() / 1000000);
+    return age ? work.per_minute(std::min(seconds, age) ) : 0;
+    }
+
+  /** lowest shift a share of this connection may have been mined against */
+  uint8_t min_shift() const
+    {
+    return std::min(shift, prev_shift);
+    }
+
+  /**
+   *  Retargets once the window has passed, or early once it holds four
+   *  times the wanted shares so fast miners ramp up quickly.  Legacy
+   *  connections get their rate measured but keep their target.
+   *
+   *  @return true if the shift changed and new work should be sent
+   */
+  bool retarget(double target_spm, fc::microseconds window)
+    {
+    fc::time_point now = fc::time_point::now();
+    if (now - window_start < window && window_shares < 4 * target_spm * window.count() / 60000000.0)
+      return false;
+    if (now - connected < fc::seconds(1) )
+      return false;
+
+    spm = work_per_minute(uint32_t(window.count() / 1000000) ) / double(uint64_t(1) << shift);
+    window_shares = 0;
+    window_start = now;
+    if (legacy)
+      return false;
+
+    int step = 0;
+    if (spm == 0)
+      step = -2;
+    else if (spm > 2 * target_spm || spm < target_spm / 2)
+      step = int(floor(log(spm / target_spm) / log(2.0) + 0.5) );
+
+    int next = std::min(std::max(int(shift) + step, 1), MAX_SHARE_SHIFT);
+    if (next == shift)
+      return false;
+    prev_shift = shift;
+    shift = uint8_t(next);
+    return true;
+    }
+  };
+
+/** a FRAME_WORK as sent, shares of protocol version 2 name it by id */
+struct sent_work
+  {
+  sent_work() : id(0), shift(0), nonce_count(0){}
+
+  uint32_t      id;
+  bitcoin::work header;      ///< nonce is the first of the range
+  uint8_t       shift;
+  uint32_t      nonce_count; ///< nonces of the range
+  };
+
+// shares of this many recent FRAME_WORKs are accepted
+#define REMEMBERED_WORK 4
+
+// long polling is given up after this many failed requests in a row and
+// not tried again for LONGPOLL_RETRY_SEC, getwork polling takes over
+#define LONGPOLL_MAX_FAILURES 5
+#define LONGPOLL_RETRY_SEC    300
 
 struct connection_data
   {
+  connection_data() : v2(false), next_work_id(0), nonce_range(0){}
+
   user_record user;
   stcp_socket_ptr sock;
+  vardiff diff;
+
+  bool                        v2;           ///< the miner sent a HELLO, frames from here on
+  std::string                 ptsaddr;      ///< from the HELLO, or the latest share of a legacy miner
+  std::shared_ptr<rate_meter> address_rate; ///< valid shares of ptsaddr on all connections, weighted
+  uint32_t                    next_work_id;
+  uint32_t                    nonce_range;  ///< nonces per FRAME_WORK, as the miner last asked for
+  sent_work                   works[REMEMBERED_WORK];
+  };
+
+/**
+ *  The connections of one reactor thread.  Everything in here is only
+ *  touched from `thread`, new work is handed over by a task on it.
+ */
+struct connection_shard
+  {
+  connection_shard(const std::string& name)
+    : thread(name){}
+
+  fc::thread                                            thread;
+  std::unordered_map<fc::ip::endpoint, connection_data> connections;
+  bitcoin::work                                         current_work;
+  work_packet                                           current_packet; ///< current_work, packed
+  };
+
+/** the work of one block for the connections of a shard, filled before any is written */
+struct work_batch
+  {
+  std::vector<work_packet>             packets;
+  std::vector<stcp_socket_ptr>         socks;
+  std::vector< pool_frame<pool_work> > frames;       ///< for protocol version 2
+  std::vector<stcp_socket_ptr>         frame_socks;
+  };
+
+/** times the new block fan-out, the last shard to finish its writes observes it */
+struct block_fanout
+  {
+  block_fanout(uint32_t shards)
+    : start(fc::time_point::now() ), pending(shards){}
+
+  fc::time_point        start;
+  std::atomic<uint32_t> pending;
   };
 
 struct config
   {
-  config() : fee(0), auto_pay_amount(0), port(4444){}
+  config() : fee(0), auto_pay_amount(0), port(4444), verify_threads(0), reactor_threads(0), db_flush_ms(1000), user_cache_size(1 << 18),
+    share_filter_capacity(1 << 20), share_filter_fp_rate(1e-6), vardiff_spm(20), vardiff_window_sec(60), vardiff_start(4),
+    getwork_poll_ms(500), longpoll(true), stats_interval_ms(30000), mock_block_sec(0), metrics_port(0),
+    payout_interval_sec(3600), payout_max_outputs(100), nonce_range(4096), max_nonce_range(1 << 20){}
 
   double fee;
-  double auto_pay_amount;
+  double auto_pay_amount; ///< users are paid once their balance reaches this many coins, 0 for no automatic payouts
 
   std::string host;
   uint16_t port;
   std::string user;
   std::string pass;
+  uint32_t verify_threads; ///< share verifier threads, 0 for one per core
+  std::string sha512;      ///< SHA-512 kernel name, empty for the fastest
+  uint32_t reactor_threads; ///< threads serving connections, 0 for one per core
+  uint32_t db_flush_ms;     ///< user records are written this often, a crash loses at most that much
+  uint32_t user_cache_size; ///< user records kept in memory
+  uint64_t share_filter_capacity; ///< valid shares remembered per block for duplicate detection, more are refused
+  double   share_filter_fp_rate;  ///< chance a new share is taken for a duplicate
+  double   vardiff_spm;           ///< shares per minute wanted from each connection
+  uint32_t vardiff_window_sec;    ///< retarget interval of a connection
+  uint8_t  vardiff_start;         ///< share_shift of new connections and of old miners, 4 is the old miner target
+  uint32_t getwork_poll_ms;       ///< getwork interval without long polling
+  bool     longpoll;              ///< wait for new blocks with long polling if bitcoind offers it
+  uint32_t stats_interval_ms;     ///< stats push interval of protocol version 2
+  uint32_t mock_block_sec;        ///< if not 0 there is no bitcoind, a mock makes a block this often
+  uint16_t metrics_port;          ///< serves Prometheus metrics at /metrics on this port, 0 for none
+  uint32_t payout_interval_sec;   ///< automatic payout rounds run this often
+  uint32_t payout_max_outputs;    ///< users paid in one transaction
+  uint32_t nonce_range;           ///< nonces handed to a connection with each work
+  uint32_t max_nonce_range;       ///< most nonces a protocol version 2 miner may ask for at once
   };
 
-FC_REFLECT(config, (host)(port)(user)(pass)(fee)(auto_pay_amount) )
+FC_REFLECT(config, (host)(port)(user)(pass)(fee)(auto_pay_amount)(verify_threads)(sha512)(reactor_threads)(db_flush_ms)
+             (user_cache_size)(share_filter_capacity)(share_filter_fp_rate)(vardiff_spm)(vardiff_window_sec)(vardiff_start)
+             (getwork_poll_ms)(longpoll)(stats_interval_ms)
+             (mock_block_sec)(metrics_port)(payout_interval_sec)(payout_max_outputs)(nonce_range)(max_nonce_range) )
 
 
 class server
 {
 public:
   fc::thread*                                           main_thread;
-  bts::db::level_map<std::string, user_record>          user_database;
+  user_database                                         users;
   fc::thread                                            btc_thread;
+  fc::thread                                            longpoll_thread;
+  std::unique_ptr<bitcoin::client>                      longpoll_client;
+  bool                                                  longpoll_running; ///< only touched on btc_thread
+  fc::time_point                                        longpoll_retry;   ///< no long polling before, only touched on btc_thread
+  fc::array<char, 32>                                   last_prev;        ///< only touched on btc_thread
   fc::bigint                                            share_target;
-  uint64_t                                              wallet_balance;
-  uint64_t                                              mature_balance;
-  std::ofstream                                         payment_log;
+  std::atomic<uint64_t>                                 wallet_balance;
+  std::atomic<uint64_t>                                 mature_balance;
 
   fc::future<void>                                      accept_loop_complete;
-  std::unordered_map<fc::ip::endpoint, connection_data> connections;
+  std::vector< std::unique_ptr<connection_shard> >      shards;
+  uint32_t                                              next_shard;
+  std::atomic<uint64_t>                                 connection_count;
   fc::tcp_server                                        tcp_serv;
 
   config                                                conf;
 
   std::unique_ptr<bitcoin::client>                      bitcoin_client;
-  std::unordered_set<uint64_t>                          recent_shares;
+  std::unique_ptr<payout_engine>                        payouts;
+  std::unique_ptr<share_verifier>                       verifier;
+  std::unique_ptr<share_filter>                         recent_shares;
   bitcoin::work                                         current_work;
 
+  rate_meter                                            pool_rate;     ///< valid shares, weighted
+  std::mutex                                            address_rates_mutex;
+  std::unordered_map< std::string, std::shared_ptr<rate_meter> > address_rates; ///< of the connected addresses
+
+  metrics_registry                                      metrics;
+  std::unique_ptr<metrics_server>                       metrics_http;
+  metrics_histogram*                                    verify_latency;
+  metrics_histogram*                                    connection_share_rate;
+  metrics_histogram*                                    db_flush_latency;
+  metrics_histogram*                                    rpc_getwork_latency;
+  metrics_histogram*                                    rpc_balance_latency;
+  metrics_histogram*                                    rpc_setwork_latency;
+  metrics_histogram*                                    rpc_send_latency;
+  metrics_histogram*                                    block_fanout_latency;
+  metrics_counter*                                      connections_accepted;
+  metrics_counter*                                      blocks_submitted;
+
+  /** reads the totals record, not every user */
   void load_database()
     {
-    auto itr = user_database.begin();
-    while (itr.valid() )
-      {
-      auto r = itr.value();
-      total_paid += r.total_paid;
-      total_earned += r.total_earned;
-      ++itr;
-      }
+    pool_totals totals = users.get_totals();
+    total_paid = totals.total_paid;
+    total_earned = totals.total_earned;
+    ilog("${n} users, earned ${e} paid ${p}", ("n", totals.users)("e", total_earned)("p", total_paid) );
     print_stats();
     }
 
   void dump_balances()
     {
-    auto itr = user_database.begin();
-    while (itr.valid() )
-      {
-      auto k = itr.key();
-      auto r = itr.value();
-      std::cout << k << ", " << r.valid << ", " << r.invalid << ", " << r.total_earned << ", " << r.total_paid << "\n";
-      ++itr;
-      }
+    users.for_each( [&](const std::string& k, const user_record& r){
+                      std::cout << k << ", " << r.valid << ", " << r.invalid << ", " << r.total_earned << ", " << r.total_paid << "\n";
+                      }
+                    );
     }
 
+  /** payout threshold in satoshi, more than a coin if auto_pay_amount is not set */
+  int64_t get_min_payout() const
+    {
+    return conf.auto_pay_amount > 0 ? int64_t(conf.auto_pay_amount * COIN) : COIN + 1;
+    }
+
+  /** finishes interrupted payouts and starts the automatic rounds if they are configured */
+  void start_payouts()
+    {
+    payouts.reset(new payout_engine(users, [this](const std::vector<bitcoin::payment>& p){ return send_payments(p); },
+                                    [this](const std::string& address){ return is_valid_address(address); },
+                                    "payouts.journal", "payments.log") );
+    payouts->recover();
+    if (conf.auto_pay_amount > 0)
+      payouts->start(get_min_payout(), conf.payout_max_outputs, fc::seconds(std::max<uint32_t>(conf.payout_interval_sec, 1) ) );
+    }
+
+  /** runs one payout round and waits for it */
   void pay_all()
     {
-    auto itr = user_database.begin();
-    while (itr.valid() )
-      {
-      auto k = itr.key();
-      auto r = itr.value();
-      if (r.get_balance() > COIN)
-        {
-        //pay(k,r.get_balance());
-        }
-      ++itr;
-      }
+    uint64_t sent = payouts->run_round(get_min_payout(), conf.payout_max_outputs);
+    total_paid += sent;
+    ilog("paid ${amnt}", ("amnt", sent) );
     print_stats();
     }
 
-  void pay(const std::string& key, uint64_t amount)
+  /** the RPC of a payout batch, runs on btc_thread like every bitcoind call */
+  payout_result send_payments(const std::vector<bitcoin::payment>& payments)
     {
-    wlog("sending ${amnt} to ${key}", ("amnt", amount)("key", key) );
+    if (!btc_thread.is_current() )
+      return btc_thread.async( [ = ](){ return send_payments(payments); }
+                               ).wait();
+    // whatever fails before the request is out did not pay anybody, the batch is given back
     try
       {
-      std::string trx_id = btc_thread.async( [ = ](){
-                                               std::string trx_id = bitcoin_client->sendtoaddress(key, amount);
-                                               ilog("sent ${amnt} to ${key} ${trx}", ("amnt", amount)("key", key) ("trx", trx_id) );
-                                               return trx_id;
-                                               }
-                                             ).wait();
-      payment_log << std::string(fc::time_point::now()) << ", " << key << ", " << amount << ", " << trx_id;
-      total_paid += amount;
-
-      user_record user;
-      auto        itr = user_database.find(key);
-      if (itr.valid() )
-        user = itr.value();
-      user.total_paid += amount;
-      user_database.store(key, user);
+      if (!bitcoin_client->connect(conf.host + ":3838", conf.user, conf.pass) )
+        return payout_result(false, "unable to connect to bitcoind");
       }
     catch (...)
       {
-      wlog("unable to send payment");
+      return payout_result(false, "unable to connect to bitcoind: " + boost::current_exception_diagnostic_information() );
+      }
+    metrics_timer t(*rpc_send_latency);
+    try
+      {
+      return payout_result(true, bitcoin_client->sendmany("", payments) );
+      }
+    catch (const bitcoin::rpc_error& e)
+      {
+      return payout_result(false, e.message() );
+      }
+    catch (const bitcoin::not_sent_error& e)
+      {
+      return payout_result(false, e.message() );
       }
     }
 
-  void print_stats()
+  /** asks bitcoind whether it can pay `address`, runs on btc_thread */
+  bool is_valid_address(const std::string& address)
     {
-    fc::time_point now = fc::time_point::now();
-    auto           elapsed = (now - last_window_start);
-    if (elapsed > fc::seconds(60) )
-      {
-      uint64_t found_shares = all_shares;
-      uint64_t delta = found_shares - last_window_start_shares;
+    if (!btc_thread.is_current() )
+      return btc_thread.async( [ = ](){ return is_valid_address(address); }
+                               ).wait();
+    bitcoin_client->connect(conf.host + ":3838", conf.user, conf.pass);
+    return bitcoin_client->validateaddress(address).isvalid;
+    }
 
-      share_per_min = delta / (elapsed.count() / 60000000.0);
+  /** valid shares per minute of the pool at difficulty 1, over the last minute */
+  double get_pool_spm() const
+    {
+    return pool_rate.per_minute(60);
+    }
 
-      last_window_start_shares = found_shares;
-      last_window_start = now;
-      }
+  void print_stats()
+    {
     std::cerr << "  wallet: " << (wallet_balance) / double(COIN)
               << "  mature: " << (mature_balance) / double(COIN)
     //     <<"  total_earned: " <<total_earned/double(COIN)
@@ -193,14 +401,20 @@ public:
     //     <<"  total_balance: "<<(total_earned-total_paid)/double(COIN)
     << "  pool: " << (all_shares)
     << "  stale: " << stale
-    << "  connections: " << connections.size()
-    << "  spm:" << share_per_min
+    << "  connections: " << connection_count
+    << "  spm:" << get_pool_spm()
     << " \r";
     }
 
   server()
-    : wallet_balance(0)
+    : longpoll_thread("longpoll"),
+    longpoll_running(false),
+    wallet_balance(0),
+    mature_balance(0),
+    next_shard(0),
+    connection_count(0)
     {
+    memset(last_prev.data, 0, sizeof(last_prev) );
     fc::sha256 share_tar;
     memset( (char*)&share_tar, 0xff, sizeof(share_tar) );
     ((char*)&share_tar)[0] = 0x3f;
@@ -210,9 +424,52 @@ public:
     main_thread = &fc::thread::current();
 
     bitcoin_client.reset(new bitcoin::client(fc::asio::default_io_service() ) );
+    longpoll_client.reset(new bitcoin::client(fc::asio::default_io_service() ) );
 
-    user_database.open("users2.db", true);
-    payment_log.open("payments.log", std::fstream::out | std::fstream::app);
+    users.open("users2.db");
+    register_metrics();
+    }
+
+  /**
+   *  Latencies are microseconds exported as seconds.  The hot paths only
+   *  add to per-thread slots, values the server keeps anyway are read at
+   *  scrape time.
+   */
+  void register_metrics()
+    {
+    std::vector<uint64_t> latency = exponential_buckets(50, 2, 18); // 50us to 6.5s
+
+    verify_latency = &metrics.histogram("pool_share_verify_seconds", "Time from queueing a share on the verifier to its result.",
+                                        latency, 1e6);
+    connection_share_rate = &metrics.histogram("pool_connection_shares_per_second",
+                                               "Share rate of a connection, observed once per vardiff window.",
+                                               exponential_buckets(10, 2, 16), 1e3);
+    db_flush_latency = &metrics.histogram("pool_db_flush_seconds", "Time to write the cached user records.", latency, 1e6);
+    rpc_getwork_latency = &metrics.histogram("pool_rpc_seconds", "Round trip of RPCs to bitcoind.", latency, 1e6, "method=\"getwork\"");
+    rpc_balance_latency = &metrics.histogram("pool_rpc_seconds", "", latency, 1e6, "method=\"getbalance\"");
+    rpc_setwork_latency = &metrics.histogram("pool_rpc_seconds", "", latency, 1e6, "method=\"setwork\"");
+    rpc_send_latency = &metrics.histogram("pool_rpc_seconds", "", latency, 1e6, "method=\"sendmany\"");
+    block_fanout_latency = &metrics.histogram("pool_block_fanout_seconds",
+                                              "Time from new work to the last connection having it written.", latency, 1e6);
+    connections_accepted = &metrics.counter("pool_connections_accepted_total", "Connections that completed the handshake.");
+    blocks_submitted = &metrics.counter("pool_blocks_submitted_total", "Shares that solved a block and were sent to bitcoind.");
+
+    metrics.gauge("pool_connections", "Open miner connections.", [this](){ return double(connection_count); });
+    metrics.counter_fn("pool_shares_accepted_total", "Valid shares, weighted by their difficulty.",
+                       [this](){ return double(all_shares); });
+    metrics.counter_fn("pool_shares_invalid_total", "Shares that failed verification.", [this](){ return double(total_invalid); });
+    metrics.counter_fn("pool_shares_stale_total", "Shares for a previous block.", [this](){ return double(stale); });
+    metrics.counter_fn("pool_share_filter_overflows_total", "Valid shares refused because the duplicate filter of the block was full.",
+                       [this](){ return recent_shares ? double(recent_shares->get_overflows() ) : 0.0; });
+    metrics.gauge("pool_shares_per_minute", "Valid shares per minute at difficulty 1 over the last minute.",
+                  [this](){ return get_pool_spm(); });
+    metrics.gauge("pool_connected_addresses", "Payout addresses with an open connection.", [this](){
+                    std::unique_lock<std::mutex> lock(address_rates_mutex);
+                    return double(address_rates.size() );
+                    }
+                  );
+    metrics.gauge("pool_wallet_balance_coins", "Wallet balance of all accounts.", [this](){ return wallet_balance / double(COIN); });
+    metrics.gauge("pool_mature_balance_coins", "Mature balance of the pool account.", [this](){ return mature_balance / double(COIN); });
     }
 
   ~server()
@@ -244,6 +501,18 @@ public:
       {
       elog("unexpected exception");
       }
+    users.close();
+    }
+
+  void start_reactors(uint32_t count)
+    {
+    for (uint32_t i = 0; i < std::max<uint32_t>(count, 1); ++i)
+      {
+      shards.push_back(std::unique_ptr<connection_shard>(new connection_shard("reactor" + fc::variant(i).as_string() ) ) );
+      connection_shard* shard = shards.back().get();
+      shard->thread.async( [ = ](){ stats_loop(*shard); }
+                           );
+      }
     }
 
   void start_btc_thread()
@@ -252,12 +521,25 @@ public:
                       );
     }
 
-  uint64_t get_next_nonce()
+  /**
+   *  Hands out `count` nonces no other connection gets.  Ranges are cut one
+   *  after the other from a single counter, so ranges of the same block only
+   *  overlap once more than 2^32 nonces were handed out for it.
+   *
+   *  @return the first nonce of the range, it may wrap around
+   */
+  uint32_t allocate_nonces(uint32_t count)
     {
-    static uint64_t next_nonce = 0;
-    return next_nonce += (1 << 12);
+    static std::atomic<uint64_t> next_nonce(0);
+    return uint32_t(next_nonce.fetch_add(std::max<uint32_t>(count, 1) ) );
     }
 
+  /**
+   *  Polls bitcoind for work.  The connection stays open between requests;
+   *  once bitcoind announces long polling new blocks come from
+   *  longpoll_loop() and this only polls every 10 seconds as a safety net,
+   *  until long polling fails for good.
+   */
   void bitcoind_thread()
     {
     while (true)
@@ -266,33 +548,20 @@ public:
         {
         print_stats();
         bitcoin_client->connect(conf.host + ":3838", conf.user, conf.pass);
-        auto latest_work = bitcoin_client->getwork();
+        bitcoin::work latest_work;
+          {
+          metrics_timer t(*rpc_getwork_latency);
+          latest_work = bitcoin_client->getwork();
+          }
         server_ok = true;
+        on_work(latest_work);
 
-        if (latest_work.prev != current_work.prev)
+        std::string lp = bitcoin_client->getwork_longpoll_path();
+        if (conf.longpoll && !lp.empty() && !longpoll_running && fc::time_point::now() >= longpoll_retry)
           {
-          // NEW BLOCK
-          wallet_balance = bitcoin_client->getbalance("*", 1);
-          mature_balance = bitcoin_client->getbalance("", 1);
-          //       uint64_t    block_num = bitcoin_client->getblockcount();
-          //       std::string tar       = bitcoin_client->gettarget();
-          //       ilog( "BLOCK NUM ${blocknum}", ("blocknum", block_num) );
-          //       ilog( "TARGET NUM ${blocknum}", ("blocknum", tar) );
-          /*
-                  fc::sha256 tarhash;
-                  fc::from_hex( tar, (char*)&tarhash, sizeof(tarhash) );
-                  std::reverse( (char*)&tarhash, ((char*)&tarhash)+sizeof(tarhash) );
-                  fc::bigint bi( (char*)&tarhash, sizeof(tarhash) );
-                  uint64_t  reward = get_reward( block_num );
-                  auto shares_per_block = ((share_target / bi).to_int64());
-                  current_pps = reward / shares_per_block;
-                  current_pps *= 1.0 - conf.fee;
-           */
-          ilog("NEW BLOCK\n");
-          //        ilog( "NEW BLOCK TARGET ${tar} REWARD ${R} PPS ${PPS}  SPP ${SPP}",
-          //             ("tar",tarhash)("R",reward/double(COIN))("PPS",current_pps/double(COIN))("SPP",shares_per_block/double(COIN))  );
-
-          update_work(latest_work);
+          longpoll_running = true;
+          longpoll_thread.async( [ = ](){ longpoll_loop(lp); }
+                                 );
           }
         }
       catch (...)
@@ -301,10 +570,88 @@ public:
         fc::usleep(fc::microseconds(1000 * 1000) );
         wlog("server error ${E}", ("E", boost::current_exception_diagnostic_information()) );
         }
-      fc::usleep(fc::microseconds(1000 * 500) );
+      fc::usleep(fc::microseconds(1000 * (longpoll_running ? 10000 : std::max<uint32_t>(conf.getwork_poll_ms, 10) ) ) );
       }
     }
 
+  /**
+   *  Waits on bitcoind for new work with a client of its own, so RPCs on
+   *  btc_thread are not held up.  Returns after LONGPOLL_MAX_FAILURES failed
+   *  requests in a row, bitcoind_thread() then polls at getwork_poll_ms again.
+   */
+  void longpoll_loop(const std::string& path)
+    {
+    ilog("long polling ${p}", ("p", path) );
+    uint32_t failures = 0;
+    while (failures < LONGPOLL_MAX_FAILURES)
+      {
+      try
+        {
+        longpoll_client->connect(conf.host + ":3838", conf.user, conf.pass);
+        bitcoin::work latest_work = longpoll_client->getwork_longpoll(path);
+        failures = 0;
+        btc_thread.async( [ = ](){ on_work(latest_work); }
+                          );
+        }
+      catch (...)
+        {
+        ++failures;
+        wlog("long poll error ${E}", ("E", boost::current_exception_diagnostic_information()) );
+        fc::usleep(fc::microseconds(1000 * 1000) );
+        }
+      }
+
+    wlog("giving up long polling ${p} for ${s} seconds", ("p", path)("s", LONGPOLL_RETRY_SEC) );
+    btc_thread.async( [ = ](){
+                        longpoll_running = false;
+                        longpoll_retry = fc::time_point::now() + fc::seconds(LONGPOLL_RETRY_SEC);
+                        }
+                      );
+    }
+
+  /** runs on btc_thread, sends the work out if it is for a new block */
+  void on_work(const bitcoin::work& latest_work)
+    {
+    if (latest_work.prev == last_prev)
+      return;
+    last_prev = latest_work.prev;
+
+    // NEW BLOCK
+    try
+      {
+      std::vector<std::string> accounts;
+      accounts.push_back("*");
+      accounts.push_back("");
+      metrics_timer            t(*rpc_balance_latency);
+      std::vector<uint64_t>    balances = bitcoin_client->getbalances(accounts, 1);
+      wallet_balance = balances[0];
+      mature_balance = balances[1];
+      }
+    catch (...)
+      {
+      wlog("unable to update balances ${E}", ("E", boost::current_exception_diagnostic_information()) );
+      }
+    //       uint64_t    block_num = bitcoin_client->getblockcount();
+    //       std::string tar       = bitcoin_client->gettarget();
+    //       ilog( "BLOCK NUM ${blocknum}", ("blocknum", block_num) );
+    //       ilog( "TARGET NUM ${blocknum}", ("blocknum", tar) );
+    /*
+            fc::sha256 tarhash;
+            fc::from_hex( tar, (char*)&tarhash, sizeof(tarhash) );
+            std::reverse( (char*)&tarhash, ((char*)&tarhash)+sizeof(tarhash) );
+            fc::bigint bi( (char*)&tarhash, sizeof(tarhash) );
+            uint64_t  reward = get_reward( block_num );
+            auto shares_per_block = ((share_target / bi).to_int64());
+            current_pps = reward / shares_per_block;
+            current_pps *= 1.0 - conf.fee;
+     */
+    ilog("NEW BLOCK\n");
+    //        ilog( "NEW BLOCK TARGET ${tar} REWARD ${R} PPS ${PPS}  SPP ${SPP}",
+    //             ("tar",tarhash)("R",reward/double(COIN))("PPS",current_pps/double(COIN))("SPP",shares_per_block/double(COIN))  );
+
+    update_work(latest_work);
+    }
+
   void submit_work(const bitcoin::work& h)
     {
     if (!btc_thread.is_current() )
@@ -314,6 +661,7 @@ public:
       return;
       }
     bitcoin_client->connect(conf.host + ":3838", conf.user, conf.pass);
+    metrics_timer t(*rpc_setwork_latency);
     bitcoin_client->setwork(h);
     }
 
@@ -325,61 +673,269 @@ public:
                           );
       return;
       }
-    recent_shares.clear();
+    recent_shares->rotate();
     current_work = latest;
-    for (auto itr = connections.begin(); itr != connections.end(); ++itr)
-      {
-      fc::async( [ = ](){  send_work(itr->second, current_work); }
-                 );
-      }
-    }
 
-  void send_work(const connection_data& con, const bitcoin::work& latest)
-    {
+    // everything but the connection fields is the same for every miner,
+    // pack it once here instead of once per connection
     work_message msg;
     msg.type = 0;
     msg.header = latest;
-    msg.header.nonce = get_next_nonce();
-    msg.user = con.user;
-    msg.pool_spm = share_per_min;
+    msg.pool_spm = float(get_pool_spm() );
     msg.pool_shares = all_shares;
     msg.pool_earned = wallet_balance;
     msg.mature_balance = mature_balance;
+    work_packet packet(msg);
 
-    auto data = fc::raw::pack(msg);
-    data.resize(192);
-    con.sock->write(data.data(), data.size() );
+    std::shared_ptr<block_fanout> fanout = std::make_shared<block_fanout>(uint32_t(shards.size() ) );
+    for (size_t i = 0; i < shards.size(); ++i)
+      {
+      connection_shard* shard = shards[i].get();
+      shard->thread.async( [ = ](){ send_block(*shard, latest, packet, fanout); }
+                           );
+      }
     }
 
-  void increment_share_count(const std::string& key, bool valid)
+  /**
+   *  Runs on the reactor thread of `shard`.  Patches the packet of every
+   *  connection into one batch first, then starts all writes together; the
+   *  sockets encrypt per connection, so each still gets a write of its own.
+   */
+  void send_block(connection_shard& shard, const bitcoin::work& latest, const work_packet& packet,
+                  const std::shared_ptr<block_fanout>& fanout)
     {
-    if (!server_ok)
+    shard.current_work = latest;
+    shard.current_packet = packet;
+
+    std::shared_ptr<work_batch> batch = std::make_shared<work_batch>();
+    batch->packets.reserve(shard.connections.size() );
+    batch->socks.reserve(shard.connections.size() );
+    for (auto itr = shard.connections.begin(); itr != shard.connections.end(); ++itr)
       {
-      wlog("Sever ! ok");
-      return;
+      // slow miners may not have submitted anything since the last block
+      retarget(itr->second);
+      if (itr->second.v2)
+        {
+        batch->frames.push_back(pool_frame<pool_work>(FRAME_WORK) );
+        make_work_frame(itr->second, latest, batch->frames.back() );
+        batch->frame_socks.push_back(itr->second.sock);
+        continue;
+        }
+      batch->packets.push_back(packet);
+      set_connection_fields(batch->packets.back(), itr->second);
+      batch->socks.push_back(itr->second.sock);
+      }
+    std::vector< fc::future<void> > writes;
+    writes.reserve(batch->socks.size() + batch->frame_socks.size() );
+    for (size_t i = 0; i < batch->socks.size(); ++i)
+      {
+      writes.push_back(fc::async( [ = ](){ batch->socks[i]->write(batch->packets[i].data, work_packet::size); }
+                                  ) );
+      }
+    for (size_t i = 0; i < batch->frame_socks.size(); ++i)
+      {
+      writes.push_back(fc::async( [ = ](){ batch->frame_socks[i]->write( (const char*)&batch->frames[i], sizeof(batch->frames[i]) ); }
+                                  ) );
       }
 
-    user_record user;
-    auto        itr = user_database.find(key);
-    if (itr.valid() )
-      user = itr.value();
-    if (valid)
+    for (size_t i = 0; i < writes.size(); ++i)
       {
-      user.valid++;
+      try
+        {
+        writes[i].wait();
+        }
+      catch (const fc::exception&)
+        {
+        // process_connection drops it on its next read
+        }
       }
-    else
+    if (--fanout->pending == 0)
+      block_fanout_latency->observe(uint64_t( (fc::time_point::now() - fanout->start).count() ) );
+    }
+
+  /** fills a FRAME_WORK with a fresh nonce range for con and remembers it so its shares can be checked */
+  void make_work_frame(connection_data& con, const bitcoin::work& latest, pool_frame<pool_work>& frame)
+    {
+    sent_work& work = con.works[++con.next_work_id % REMEMBERED_WORK];
+    work.id = con.next_work_id;
+    work.header = latest;
+    work.nonce_count = std::max<uint32_t>(con.nonce_range, 1);
+    work.header.nonce = allocate_nonces(work.nonce_count);
+    work.shift = con.diff.shift;
+
+    frame.head.work_id = work.id;
+    frame.body.header = work.header;
+    frame.body.share_shift = work.shift;
+    frame.body.nonce_count = work.nonce_count;
+    }
+
+  void send_work_frame(const connection_shard& shard, connection_data& con)
+    {
+    pool_frame<pool_work> frame(FRAME_WORK);
+    make_work_frame(con, shard.current_work, frame);
+    con.sock->write( (const char*)&frame, sizeof(frame) );
+    }
+
+  void send_stats(const connection_data& con)
+    {
+    pool_frame<pool_stats> frame(FRAME_STATS);
+    frame.body.user = con.user;
+    frame.body.mature_balance = mature_balance;
+    frame.body.pool_shares = all_shares;
+    frame.body.pool_earned = wallet_balance;
+    frame.body.pool_spm = float(get_pool_spm() );
+    frame.body.pool_fee = float(conf.fee);
+    frame.body.user_spm = con.address_rate ? float(con.address_rate->per_minute(60) ) : 0;
+    frame.body.connection_spm = float(con.diff.work_per_minute(60) );
+    con.sock->write( (const char*)&frame, sizeof(frame) );
+    }
+
+  /** pushes FRAME_STATS to the version 2 connections of `shard`, legacy ones get stats with every reply */
+  void stats_loop(connection_shard& shard)
+    {
+    while (true)
       {
-      user.invalid++;
-      total_invalid++;
+      fc::usleep(fc::microseconds(1000ll * std::max<uint32_t>(conf.stats_interval_ms, 1000) ) );
+
+      // writes yield, so work on a copy in case connections come and go
+      std::vector<connection_data> cons;
+      for (auto itr = shard.connections.begin(); itr != shard.connections.end(); ++itr)
+        if (itr->second.v2)
+          cons.push_back(itr->second);
+      for (size_t i = 0; i < cons.size(); ++i)
+        {
+        try
+          {
+          send_stats(cons[i]);
+          }
+        catch (const fc::exception&)
+          {
+          // process_connection drops it on its next read
+          }
+        }
       }
-    user_database.store(key, user);
     }
 
-  void process_connection(connection_data con)
+  void set_connection_fields(work_packet& packet, const connection_data& con)
+    {
+    // the packet has no room for the range, old miners are trusted to stay in it
+    packet.set_nonce(allocate_nonces(conf.nonce_range) );
+    packet.set_user(con.user);
+    packet.set_share_shift(con.diff.legacy ? 0 : con.diff.shift);
+    }
+
+  /** replies to a share with the current work of the shard and fresh pool stats */
+  void send_work(const connection_shard& shard, const connection_data& con, uint32_t type = SET_WORK)
+    {
+    work_packet packet(shard.current_packet);
+    packet.set_type(type);
+    packet.set_pool_stats(mature_balance, all_shares, wallet_balance, float(get_pool_spm() ) );
+    set_connection_fields(packet, con);
+    con.sock->write(packet.data, work_packet::size);
+    }
+
+  /** points con at the shared meter of `address`, the map lock is only taken when it changes */
+  void track_address(connection_data& con, const std::string& address)
+    {
+    if (con.address_rate && con.ptsaddr == address)
+      return;
+    untrack_address(con);
+    con.ptsaddr = address;
+
+    std::unique_lock<std::mutex>  lock(address_rates_mutex);
+    std::shared_ptr<rate_meter>& meter = address_rates[address];
+    if (!meter)
+      meter = std::make_shared<rate_meter>();
+    con.address_rate = meter;
+    }
+
+  /** drops the meter of an address once its last connection is gone */
+  void untrack_address(connection_data& con)
+    {
+    if (!con.address_rate)
+      return;
+    con.address_rate.reset();
+
+    std::unique_lock<std::mutex> lock(address_rates_mutex);
+    auto                         itr = address_rates.find(con.ptsaddr);
+    if (itr != address_rates.end() && itr->second.unique() )
+      address_rates.erase(itr);
+    }
+
+  /**
+   *  Counts the share and loads the updated record of its user.  Only the
+   *  cache of the user database is touched, flush_users() writes it out.
+   *
+   *  @param weight difficulty of the share, credited if it is valid
+   *  @return false if the user is not in the database or cannot be read
+   */
+  bool count_share(const std::string& key, bool valid, uint64_t weight, user_record& user)
     {
     try
       {
-      send_work(con, current_work);
+      if (!server_ok)
+        {
+        wlog("Sever ! ok");
+        return users.fetch(key, user);
+        }
+      if (!valid)
+        total_invalid++;
+      user = users.add_share(key, valid, weight);
+      return true;
+      }
+    catch (const fc::exception& e)
+      {
+      elog("${e}", ("e", e.to_detail_string() ) );
+      return false;
+      }
+    }
+
+  bool retarget(connection_data& con)
+    {
+    fc::time_point window_start = con.diff.window_start;
+    bool           changed = con.diff.retarget(conf.vardiff_spm, fc::seconds(std::max<uint32_t>(conf.vardiff_window_sec, 1) ) );
+    if (con.diff.window_start != window_start)
+      connection_share_rate->observe(uint64_t(con.diff.spm * 1000 / 60) );
+    return changed;
+    }
+
+  void flush_users()
+    {
+    while (true)
+      {
+      fc::usleep(fc::microseconds(1000 * std::max<uint32_t>(conf.db_flush_ms, 10) ) );
+      metrics_timer t(*db_flush_latency);
+      users.flush();
+      }
+    }
+
+  /** share_shift of new connections, and the one legacy miners stay at */
+  uint8_t get_start_shift() const
+    {
+    return std::min<uint8_t>(std::max<uint8_t>(conf.vardiff_start, 1), MAX_SHARE_SHIFT);
+    }
+
+  /** a share already credited in this block or the last, cheap enough to check before verifying */
+  bool is_known_share(const bitcoin::work& header)
+    {
+    return recent_shares->contains(fc::city_hash64( (char*)&header, sizeof(header)) );
+    }
+
+  /** @return false if the share was credited before, or this block has no room left to remember it */
+  bool remember_share(const bitcoin::work& header)
+    {
+    return recent_shares->insert(fc::city_hash64( (char*)&header, sizeof(header)) );
+    }
+
+  /** runs on the reactor thread of `shard`, which owns the connection at ep */
+  void process_connection(connection_shard& shard, const fc::ip::endpoint& ep)
+    {
+    try
+      {
+      connection_data& con = shard.connections[ep];
+      con.diff.shift = con.diff.prev_shift = get_start_shift();
+      // tells miners of protocol version 2 that a HELLO is safe to send
+      send_work(shard, con, HELLO);
 
       fc::array<char, 192> packet;
       while (true)
@@ -390,68 +946,206 @@ public:
         work_message                msg;
         fc::raw::unpack(ds, msg);
 
-        bool                        is_new = recent_shares.insert(fc::city_hash64( (char*)&msg.header, sizeof(msg.header)) ).second;
-        if (!is_new)
-          continue;
-
-        bool valid = server_ok && verify_share(msg.header);
-
-        increment_share_count(msg.ptsaddr, valid);
+        if (msg.type == HELLO)
+          {
+          if (msg.header.version < POOL_PROTOCOL_VERSION)
+            continue;
+          con.v2 = true;
+          track_address(con, msg.ptsaddr);
+          // runs until the connection drops
+          process_frames(shard, con);
+          }
 
-        auto itr = user_database.find(msg.ptsaddr);
+        if (is_known_share(msg.header) )
+          continue;
 
-        if (itr.valid() )
-          con.user = itr.value();
-        else
+        // a miner that echoes no shift predates vardiff, undo retargets before its first share
+        if (msg.share_shift == 0 && !con.diff.legacy)
+          {
+          con.diff.legacy = true;
+          con.diff.shift = con.diff.prev_shift = get_start_shift();
+          }
+        track_address(con, msg.ptsaddr);
+
+        // old miners only send shares below 0x03..., as much work as one of vardiff_start
+        // (0x03f0... with the default 4); credit it the same or they lose out to vardiff miners
+        uint8_t shift = con.diff.legacy ? con.diff.shift : std::min<uint8_t>(msg.share_shift, MAX_SHARE_SHIFT + 1);
+        con.diff.add_share(std::min<uint8_t>(shift, con.diff.shift) );
+        bool    valid = server_ok && shift >= con.diff.min_shift() && shift <= MAX_SHARE_SHIFT &&
+                        verify_share(shard, msg.header, get_share_target(shift), 1ull << shift);
+        if (valid)
+          con.address_rate->add(1ull << shift);
+
+        if (!count_share(msg.ptsaddr, valid, 1ull << shift, con.user) )
           elog("unable to find user in DB");
 
-        send_work(con, current_work);
+        retarget(con);
+        send_work(shard, con);
         }
       }
     catch (const fc::exception& e)
       {
-      connections.erase(con.sock->get_socket().remote_endpoint() );
+      auto itr = shard.connections.find(ep);
+      if (itr != shard.connections.end() )
+        untrack_address(itr->second);
+      shard.connections.erase(ep);
+      --connection_count;
       }
     }
 
-  bool verify_share(const bitcoin::work& header)
+  /**
+   *  Protocol version 2, after the HELLO of a miner, see pool_protocol.hpp.
+   *  All shares of a frame are queued on the verifier before the first is
+   *  waited for, so they are checked as one batch.
+   */
+  void process_frames(connection_shard& shard, connection_data& con)
     {
-    if (header.prev != current_work.prev)
+    pool_frame<pool_hello_ack> ack(FRAME_HELLO_ACK);
+    ack.body.version = POOL_PROTOCOL_VERSION;
+    ack.body.stats_interval_ms = conf.stats_interval_ms;
+    ack.body.max_shares = POOL_MAX_FRAME_SHARES;
+    con.sock->write( (const char*)&ack, sizeof(ack) );
+    con.nonce_range = std::min(conf.nonce_range, conf.max_nonce_range);
+    send_work_frame(shard, con);
+    send_stats(con);
+
+    std::vector<pool_share>                shares(POOL_MAX_FRAME_SHARES);
+    std::vector<bitcoin::work>             headers;
+    std::vector< fc::future<share_check> > checks;
+    std::vector<bool>                      fresh;
+    while (true)
       {
-      ++stale;
+      pool_frame_header head;
+      con.sock->read( (char*)&head, sizeof(head) );
+      if (head.magic == POOL_FRAME_MAGIC && head.type == FRAME_GET_WORK && head.size == sizeof(pool_work_request) )
+        {
+        // the miner used up its nonces
+        pool_work_request request;
+        con.sock->read( (char*)&request, sizeof(request) );
+        con.nonce_range = std::max<uint32_t>(std::min(request.nonce_count, conf.max_nonce_range), 1);
+        send_work_frame(shard, con);
+        continue;
+        }
+      if (head.magic != POOL_FRAME_MAGIC || head.type != FRAME_SHARES || head.count > POOL_MAX_FRAME_SHARES ||
+          head.size != head.count * sizeof(pool_share) )
+        FC_THROW_EXCEPTION(fc::exception, "invalid frame from miner");
+      if (head.size)
+        con.sock->read( (char*)shares.data(), head.size);
+
+      const sent_work* work = nullptr;
+      for (int i = 0; i < REMEMBERED_WORK; ++i)
+        if (con.works[i].id == head.work_id && head.work_id)
+          work = &con.works[i];
+      uint8_t  shift = work ? work->shift : 0;
+      uint64_t weight = 1ull << shift;
+
+      headers.resize(head.count);
+      checks.assign(head.count, fc::future<share_check>() );
+      fresh.assign(head.count, false);
+      fc::time_point queued = fc::time_point::now();
+      for (uint32_t i = 0; i < head.count; ++i)
+        {
+        if (!work)
+          {
+          // work the connection was sent too long ago
+          ++stale;
+          continue;
+          }
+        if (uint32_t(shares[i].nonce - work->header.nonce) >= work->nonce_count)
+          {
+          // outside the range of the connection, it may repeat another miner's work
+          fresh[i] = true;
+          continue;
+          }
+        headers[i] = work->header;
+        headers[i].nonce = shares[i].nonce;
+        headers[i].birthday_a = shares[i].birthday_a;
+        headers[i].birthday_b = shares[i].birthday_b;
+        fresh[i] = !is_known_share(headers[i]);
+        if (fresh[i] && server_ok && !is_stale(shard, headers[i]) )
+          checks[i] = verifier->verify(headers[i], get_share_target(shift) );
+        }
+
+      for (uint32_t i = 0; i < head.count; ++i)
+        {
+        if (work && !fresh[i])
+          continue;
+        con.diff.add_share(shift);
+        bool valid = false;
+        if (checks[i].valid() )
+          {
+          share_check check = checks[i].wait();
+          verify_latency->observe(uint64_t( (fc::time_point::now() - queued).count() ) );
+          valid = accept_share(headers[i], check, weight);
+          }
+        if (valid)
+          con.address_rate->add(weight);
+        if (!count_share(con.ptsaddr, valid, weight, con.user) )
+          elog("unable to find user in DB");
+        }
+
+      // no reply per frame, only new work if the difficulty moved
+      if (retarget(con) )
+        send_work_frame(shard, con);
+      }
+    }
+
+  /** counts the share as stale if it is not for the current block */
+  bool is_stale(const connection_shard& shard, const bitcoin::work& header)
+    {
+    if (header.prev == shard.current_work.prev)
+      return false;
+    ++stale;
+    return true;
+    }
+
+  /** @param weight difficulty of the share, added to the pool total if it is valid */
+  bool accept_share(const bitcoin::work& header, const share_check& check, uint64_t weight)
+    {
+    // only now, junk headers must not push valid shares out of the filter;
+    // a copy verified at the same time loses here
+    if (!check.valid || !remember_share(header) )
       return false;
+    all_shares += weight;
+    pool_rate.add(weight);
+    if (check.block)
+      {
+      blocks_submitted->add();
+      submit_work(header);
       }
+    return true;
+    }
 
-    auto result = Hash( (char*)&header, 88);
-    std::reverse((char*)&result, ((char*)&result) + sizeof(result) );
+  bool verify_share(const connection_shard& shard, const bitcoin::work& header, uint64_t target, uint64_t weight)
+    {
+    if (is_stale(shard, header) )
+      return false;
 
-    if ( (((unsigned char*)&result)[0] < 0x3f)  )
+    // yields to the other connections while the verifier threads work
+    share_check check;
       {
-      auto mid = Hash( (char*)&header, 80);
-      if (momentum_verify(mid, header.birthday_a, header.birthday_b) )
-        {
-        all_shares++;
-        if ( (((uint8_t*)&result)[0] == 0x00) &&
-             (((uint8_t*)&result)[1] == 0x00) )
-          submit_work(header);
-        return true;
-        }
+      metrics_timer t(*verify_latency);
+      check = verifier->verify(header, target).wait();
       }
-    return false;
+    return accept_share(header, check, weight);
     }
 
-  void accept_connection(const stcp_socket_ptr& s)
+  /** runs on the reactor thread of `shard` */
+  void accept_connection(connection_shard& shard, const stcp_socket_ptr& s)
     {
     try
       {
       // init DH handshake, TODO: this could yield.. what happens if we exit here before
       // adding s to connections list.
       s->accept();
-      ilog("accepted connection from ${ep}",
-           ("ep", std::string(s->get_socket().remote_endpoint()) ) );
-
-      connections[s->get_socket().remote_endpoint()].sock = s;
-      fc::async( [ = ](){ process_connection(connections[s->get_socket().remote_endpoint()]); }
+      fc::ip::endpoint ep = s->get_socket().remote_endpoint();
+      ilog("accepted connection from ${ep}", ("ep", std::string(ep) ) );
+
+      shard.connections[ep].sock = s;
+      ++connection_count;
+      connections_accepted->add();
+      connection_shard* owner = &shard;
+      fc::async( [ = ](){ process_connection(*owner, ep); }
                  );
       }
     catch (const fc::canceled_exception& e)
@@ -477,11 +1171,11 @@ public:
         stcp_socket_ptr sock = std::make_shared<stcp_socket>();
         tcp_serv.accept(sock->get_socket() );
 
-        // do the acceptance process async
-        fc::async( [ = ](){ accept_connection(sock); }
-                   );
-
-        fc::usleep(fc::microseconds(1000) );
+        // the handshake runs on the reactor that will own the connection,
+        // this loop goes straight back to accepting the next one
+        connection_shard* shard = shards[next_shard++ % shards.size()].get();
+        shard->thread.async( [ = ](){ accept_connection(*shard, sock); }
+                             );
         }
       }
     catch (fc::eof_exception& e)
@@ -519,6 +1213,25 @@ int main(int argc, char** argv)
       }
     server serv;
     serv.conf = fc::json::from_file<config>(argv[1]);
+    serv.users.set_cache_capacity(serv.conf.user_cache_size);
+    if (!serv.conf.sha512.empty() && !select_momentum_sha512(serv.conf.sha512) )
+      {
+      elog("unknown sha512 kernel ${k}", ("k", serv.conf.sha512) );
+      return -1;
+      }
+    ilog("sha512 kernel ${k}", ("k", get_momentum_sha512_verify().name) );
+    if (serv.conf.mock_block_sec)
+      {
+      wlog("no bitcoind, mock blocks every ${s} seconds", ("s", serv.conf.mock_block_sec) );
+      serv.bitcoin_client.reset(new bitcoin::mock_client(fc::asio::default_io_service(), serv.conf.mock_block_sec) );
+      serv.longpoll_client.reset(new bitcoin::mock_client(fc::asio::default_io_service(), serv.conf.mock_block_sec) );
+      }
+    uint32_t verify_threads = serv.conf.verify_threads ? serv.conf.verify_threads : std::thread::hardware_concurrency();
+    serv.verifier.reset(new share_verifier(verify_threads) );
+    serv.recent_shares.reset(new share_filter(serv.conf.share_filter_capacity, serv.conf.share_filter_fp_rate) );
+    serv.start_reactors(serv.conf.reactor_threads ? serv.conf.reactor_threads : std::thread::hardware_concurrency() );
+    if (serv.conf.metrics_port)
+      serv.metrics_http.reset(new metrics_server(serv.metrics, serv.conf.metrics_port) );
 
     serv.tcp_serv.listen(serv.conf.port);
 
@@ -527,6 +1240,7 @@ int main(int argc, char** argv)
     fc::usleep(fc::seconds(1));
 
     serv.start_btc_thread();
+    serv.start_payouts();
 
     fc::usleep(fc::seconds(1));
 
@@ -537,6 +1251,8 @@ int main(int argc, char** argv)
       wlog("done with payments\n");
       return 0;
       }
+    fc::async( [&](){ serv.flush_users(); }
+               );
     serv.accept_loop_complete = fc::async( [&](){ serv.accept_loop(); }
                                            );
     serv.accept_loop_complete.wait();
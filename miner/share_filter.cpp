@@ -0,0 +1,102 @@
+#include "share_filter.hpp"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+share_filter::share_filter(uint64_t capacity, double fp_rate, uint32_t shards_) :
+  shard_count(std::max<uint32_t>(shards_, 1) ),
+  overflows(0)
+  {
+  fp_rate = std::min(std::max(fp_rate, 1e-12), 0.5);
+  capacity = std::max<uint64_t>(capacity, shard_count);
+
+  // optimal Bloom filter: m = -n ln p / ln(2)^2 bits, k = m / n ln 2 hashes;
+  // a lookup checks two generations, so each gets half the rate
+  double bits_per_share = -log(fp_rate / 2) / (log(2.0) * log(2.0) );
+  // hashes never spread evenly, leave each shard some room above its part
+  shard_capacity = (capacity + shard_count - 1) / shard_count;
+  shard_capacity += shard_capacity / 8 + 16;
+  bit_count = (uint64_t(ceil(shard_capacity * bits_per_share) ) + 63) / 64 * 64;
+  hashes = std::max<uint32_t>(1, uint32_t(bits_per_share * log(2.0) + 0.5) );
+
+  shards.reset(new shard[shard_count]);
+  for (uint32_t s = 0; s < shard_count; ++s)
+    {
+    shards[s].bits[0].resize(size_t(bit_count / 64) );
+    shards[s].bits[1].resize(size_t(bit_count / 64) );
+    shards[s].current = 0;
+    shards[s].count = 0;
+    }
+  }
+
+bool share_filter::test(const std::vector<uint64_t>& bits, uint64_t h1, uint64_t h2) const
+  {
+  for (uint32_t i = 0; i < hashes; ++i)
+    {
+    uint64_t bit = (h1 + i * h2) % bit_count;
+    if (!(bits[size_t(bit / 64)] & (uint64_t(1) << (bit % 64) ) ) )
+      return false;
+    }
+  return true;
+  }
+
+share_filter::shard& share_filter::find(uint64_t hash, uint64_t& h1, uint64_t& h2)
+  {
+  // share hashes are city hashes already, derive the second one for double hashing
+  h1 = hash;
+  h2 = hash * 0x9e3779b97f4a7c15ULL;
+  h2 = (h2 ^ (h2 >> 29) ) | 1;
+  // the top 32 bits scaled to the shard count, even for counts that are no power of two
+  return shards[size_t( ( (hash >> 32) * shard_count) >> 32)];
+  }
+
+bool share_filter::contains(uint64_t hash)
+  {
+  uint64_t h1, h2;
+  shard&   s = find(hash, h1, h2);
+
+  std::unique_lock<std::mutex> lock(s.lock);
+  return test(s.bits[0], h1, h2) || test(s.bits[1], h1, h2);
+  }
+
+bool share_filter::insert(uint64_t hash)
+  {
+  uint64_t h1, h2;
+  shard&   s = find(hash, h1, h2);
+
+  std::unique_lock<std::mutex> lock(s.lock);
+  if (test(s.bits[0], h1, h2) || test(s.bits[1], h1, h2) )
+    return false;
+
+  // clearing the older generation here would let shares of this block be replayed
+  if (s.count >= shard_capacity)
+    {
+    ++overflows;
+    return false;
+    }
+  std::vector<uint64_t>& bits = s.bits[s.current];
+  for (uint32_t i = 0; i < hashes; ++i)
+    {
+    uint64_t bit = (h1 + i * h2) % bit_count;
+    bits[size_t(bit / 64)] |= uint64_t(1) << (bit % 64);
+    }
+  ++s.count;
+  return true;
+  }
+
+void share_filter::rotate()
+  {
+  for (uint32_t i = 0; i < shard_count; ++i)
+    {
+    shard&                       s = shards[i];
+    std::unique_lock<std::mutex> lock(s.lock);
+    s.current ^= 1;
+    memset(&s.bits[s.current][0], 0, s.bits[s.current].size() * sizeof(uint64_t) );
+    s.count = 0;
+    }
+  }
+
+size_t share_filter::memory_size() const
+  {
+  return size_t(shard_count) * 2 * size_t(bit_count / 8);
+  }
@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+/**
+ *  Fixed memory set of the valid shares of the current and the previous
+ *  block, for rejecting duplicate submissions.
+ *
+ *  Every shard is a pair of Bloom filters, one generation per block.  Hashes
+ *  go into the current filter and are looked up in both; rotate() clears the
+ *  older one on a new block and makes it current.  Nothing is forgotten
+ *  within a block: once the current filter of a shard holds its part of
+ *  `capacity` hashes it takes no more and insert() fails, so memory never
+ *  grows no matter the hashrate.  Shards are picked by hash and locked
+ *  separately so the reactor threads rarely contend.
+ *
+ *  Only verified shares should be inserted, junk must not use up a block's
+ *  capacity.
+ */
+class share_filter
+{
+public:
+  /**
+   *  @param capacity valid shares per block
+   *  @param fp_rate  chance that a new share is reported as a duplicate
+   */
+  share_filter(uint64_t capacity, double fp_rate, uint32_t shards = 64);
+
+  /** @return true if hash was (probably) inserted before */
+  bool     contains(uint64_t hash);
+  /** @return false if hash was (probably) inserted before or its shard is full */
+  bool     insert(uint64_t hash);
+  /** forgets the older generation of every shard, called on a new block */
+  void     rotate();
+  size_t   memory_size() const;
+  /** inserts refused because a shard was full */
+  uint64_t get_overflows() const { return overflows; }
+
+private:
+  struct shard
+    {
+    std::mutex            lock;
+    std::vector<uint64_t> bits[2];
+    int                   current;
+    uint64_t              count;
+    };
+
+  shard& find(uint64_t hash, uint64_t& h1, uint64_t& h2);
+  bool   test(const std::vector<uint64_t>& bits, uint64_t h1, uint64_t h2) const;
+
+  std::unique_ptr<shard[]> shards;
+  uint32_t                 shard_count;
+  uint64_t                 bit_count;      ///< per generation of a shard
+  uint64_t                 shard_capacity;
+  uint32_t                 hashes;         ///< bits set per share
+  std::atomic<uint64_t>    overflows;
+
+  share_filter(const share_filter&);
+  share_filter& operator=(const share_filter&);
+};
@@ -0,0 +1,117 @@
+#include "share_verifier.hpp"
+#include "momentum.hpp"
+#include <fc/crypto/sha256.hpp>
+#include <algorithm>
+#include <memory>
+
+share_verifier::share_verifier(uint32_t threads, uint32_t batch_size) :
+  batch_size(batch_size ? batch_size : 1),
+  stopping(false)
+  {
+  if (threads == 0)
+    threads = 1;
+  for (uint32_t i = 0; i < threads; ++i)
+    workers.push_back(std::thread( [ = ](){ run(); }
+                                   ) );
+  }
+
+share_verifier::~share_verifier()
+  {
+    {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    stopping = true;
+    }
+  queue_changed.notify_all();
+  for (size_t i = 0; i < workers.size(); ++i)
+    workers[i].join();
+  }
+
+fc::future<share_check> share_verifier::verify(const bitcoin::work& header, uint64_t target)
+  {
+  pending_share s;
+  s.header = header;
+  s.target = target;
+  s.done.reset(new fc::promise<share_check>("share_verifier::verify") );
+
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  queue.push_back(s);
+  lock.unlock();
+  queue_changed.notify_one();
+  return fc::future<share_check>(s.done);
+  }
+
+void share_verifier::run()
+  {
+  std::vector<pending_share> batch;
+  while (true)
+    {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (!stopping && queue.empty() )
+      queue_changed.wait(lock);
+    if (stopping)
+      break;
+
+    size_t n = std::min<size_t>(queue.size(), batch_size);
+    batch.assign(queue.begin(), queue.begin() + n);
+    queue.erase(queue.begin(), queue.begin() + n);
+    lock.unlock();
+
+    check(batch);
+    }
+
+  // nobody will check what is left, let the waiting connections go
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  for (size_t i = 0; i < queue.size(); ++i)
+    queue[i].done->set_value(share_check() );
+  queue.clear();
+  }
+
+static uint64_t load_be64(const unsigned char* p)
+  {
+  uint64_t r = 0;
+  for (int i = 0; i < 8; ++i)
+    r = (r << 8) | p[i];
+  return r;
+  }
+
+void share_verifier::check(std::vector<pending_share>& batch)
+  {
+  std::vector<share_check>    results(batch.size() );
+  std::vector<momentum_proof> proofs;
+  std::vector<size_t>         owners;
+  proofs.reserve(batch.size() );
+
+  // cheap target check first, only shares meeting it cost a momentum proof
+  for (size_t i = 0; i < batch.size(); ++i)
+    {
+    const bitcoin::work& h = batch[i].header;
+    fc::sha256           result = fc::sha256::hash(fc::sha256::hash( (char*)&h, 88) );
+    std::reverse( (char*)&result, ( (char*)&result) + sizeof(result) );
+
+    const unsigned char* r = (const unsigned char*)&result;
+    if (load_be64(r) >= batch[i].target)
+      continue;
+    results[i].block = r[0] == 0x00 && r[1] == 0x00;
+
+    momentum_proof p;
+    p.head = fc::sha256::hash(fc::sha256::hash( (char*)&h, 80) );
+    p.a = h.birthday_a;
+    p.b = h.birthday_b;
+    proofs.push_back(p);
+    owners.push_back(i);
+    }
+
+  if (!proofs.empty() )
+    {
+    std::unique_ptr<bool[]> valid(new bool[proofs.size()]);
+    momentum_verify_batch(&proofs[0], valid.get(), proofs.size() );
+    for (size_t p = 0; p < proofs.size(); ++p)
+      results[owners[p]].valid = valid[p];
+    }
+
+  for (size_t i = 0; i < batch.size(); ++i)
+    {
+    results[i].block = results[i].block && results[i].valid;
+    batch[i].done->set_value(results[i]);
+    }
+  }
@@ -0,0 +1,62 @@
+#pragma once
+#include "bitcoin.hpp"
+#include <fc/thread/future.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+/** outcome of checking one submitted header */
+struct share_check
+  {
+  share_check() : valid(false), block(false){}
+
+  bool valid; ///< meets the share target and carries a valid momentum proof
+  bool block; ///< valid and also meets the network target
+  };
+
+/**
+ *  Checks shares for the pool server off the fc main thread.
+ *
+ *  verify() only queues the header, worker threads take whatever has queued
+ *  up (at most `batch_size` shares) and check it as one batch: the header
+ *  hashes first, then the momentum proofs of the shares that met the target
+ *  through momentum_verify_batch() so the birthday hashes of different shares
+ *  fill the SIMD lanes together.  A lone share is checked right away, batches
+ *  only grow while the workers are busy.
+ */
+class share_verifier
+{
+public:
+  share_verifier(uint32_t threads, uint32_t batch_size = 64);
+  ~share_verifier();
+
+  /**
+   *  @param target the share is valid if the first 8 bytes of its (reversed)
+   *                header hash, read big endian, are below target
+   */
+  fc::future<share_check> verify(const bitcoin::work& header, uint64_t target);
+
+private:
+  struct pending_share
+    {
+    bitcoin::work                   header;
+    uint64_t                        target;
+    fc::promise<share_check>::ptr   done;
+    };
+
+  void run();
+  void check(std::vector<pending_share>& batch);
+
+  std::vector<std::thread>  workers;
+  std::mutex                queue_mutex;
+  std::condition_variable   queue_changed;
+  std::deque<pending_share> queue;
+  uint32_t                  batch_size;
+  bool                      stopping;
+
+  share_verifier(const share_verifier&);
+  share_verifier& operator=(const share_verifier&);
+};
@@ -0,0 +1,144 @@
+#include "table_memory.hpp"
+#include "search_pool.hpp"
+#include <fc/log/logger.hpp>
+#include <algorithm>
+#include <new>
+#include <vector>
+#include <stdint.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef __linux__
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+// from <numaif.h>, we only need the raw syscall and not libnuma
+#define TABLE_MPOL_BIND       2
+#define TABLE_MPOL_INTERLEAVE 3
+
+static void bind_numa(void* p, size_t bytes, const table_memory_options& opts)
+  {
+  if (!opts.interleave && opts.numa_node < 0)
+    return;
+
+  // the kernel refuses bits past the nodes it was built for, so only the online ones are set
+  std::vector<int> nodes;
+  int              mode = TABLE_MPOL_BIND;
+  if (opts.interleave)
+    {
+    mode = TABLE_MPOL_INTERLEAVE;
+    nodes = read_cpu_list("/sys/devices/system/node/online"); // same format as a cpu list
+    }
+  else
+    {
+    nodes.push_back(opts.numa_node);
+    }
+  if (nodes.empty() )
+    {
+    wlog("unable to read the online numa nodes, birthday table not interleaved");
+    return;
+    }
+
+  const int                  bits = int(sizeof(unsigned long) * 8);
+  int                        highest = *std::max_element(nodes.begin(), nodes.end() );
+  std::vector<unsigned long> mask(highest / bits + 1, 0);
+  for (size_t i = 0; i < nodes.size(); ++i)
+    mask[nodes[i] / bits] |= 1UL << (nodes[i] % bits);
+
+  // maxnode counts one bit more than the kernel reads
+  if (syscall(SYS_mbind, p, bytes, mode, mask.data(), (unsigned long)(highest + 2), 0) != 0)
+    wlog("unable to apply numa policy to birthday table, node ${n}", ("n", opts.numa_node) );
+  }
+#endif
+
+table_memory_options& get_table_memory_options()
+  {
+  static table_memory_options options;
+  return options;
+  }
+
+#ifdef WIN32
+
+void* alloc_table_memory(size_t bytes, const table_memory_options& opts, size_t& mapped)
+  {
+  void* p = nullptr;
+  if (opts.huge_pages)
+    {
+    // needs SeLockMemoryPrivilege, quietly fall back without it
+    size_t large = GetLargePageMinimum();
+    if (large)
+      {
+      mapped = (bytes + large - 1) / large * large;
+      p = VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+      }
+    }
+  if (!p)
+    {
+    mapped = bytes;
+    p = VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+  }
+
+void free_table_memory(void* p, size_t)
+  {
+  VirtualFree(p, 0, MEM_RELEASE);
+  }
+
+#else
+
+void* alloc_table_memory(size_t bytes, const table_memory_options& opts, size_t& mapped)
+  {
+  void* p = MAP_FAILED;
+#ifdef __linux__
+  if (opts.huge_pages)
+    {
+    size_t page = size_t(opts.huge_pages) << 20;
+    int    size_flag = (opts.huge_pages == 1024 ? 30 : 21) << MAP_HUGE_SHIFT;
+    mapped = (bytes + page - 1) / page * page;
+    p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | size_flag, -1, 0);
+    if (p == MAP_FAILED)
+      wlog("no ${s} MB huge pages reserved (see /proc/sys/vm/nr_hugepages), using transparent huge pages",
+           ("s", opts.huge_pages) );
+    }
+#endif
+  if (p == MAP_FAILED)
+    {
+    mapped = bytes;
+    p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+#ifdef __linux__
+    if (opts.huge_pages)
+      madvise(p, mapped, MADV_HUGEPAGE);
+#endif
+    }
+#ifdef __linux__
+  // pages are placed on first touch, so the policy has to be in place before
+  bind_numa(p, mapped, opts);
+#endif
+  return p;
+  }
+
+void free_table_memory(void* p, size_t mapped)
+  {
+  munmap(p, mapped);
+  }
+
+#endif
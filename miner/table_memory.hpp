@@ -0,0 +1,30 @@
+#pragma once
+#include <stddef.h>
+
+/**
+ *  How the multi gigabyte birthday tables get their memory.  The random
+ *  access phase of the search is dominated by TLB misses and, on multi
+ *  socket machines, by cross node traffic, so tables can be placed on huge
+ *  pages and bound to (or interleaved across) NUMA nodes.
+ */
+struct table_memory_options
+  {
+  table_memory_options() : huge_pages(0), numa_node(-1), interleave(false){}
+
+  int  huge_pages;  ///< 0 = normal pages, 2 = 2 MB pages, 1024 = 1 GB pages
+  int  numa_node;   ///< node to bind the table to, -1 leaves placement to the OS
+  bool interleave;  ///< spread the pages round robin over all nodes
+  };
+
+/** process wide defaults, set from the pool_miner command line */
+table_memory_options& get_table_memory_options();
+
+/**
+ *  Maps `bytes` of zero filled memory according to `opts`, falling back to
+ *  transparent huge pages and then to normal pages when the requested page
+ *  size is not available.
+ *
+ *  @param mapped receives the size that has to be passed to free_table_memory()
+ */
+void* alloc_table_memory(size_t bytes, const table_memory_options& opts, size_t& mapped);
+void  free_table_memory(void* p, size_t mapped);
@@ -0,0 +1,376 @@
+#include "user_database.hpp"
+#include <fc/exception/exception.hpp>
+#include <fc/io/datastream.hpp>
+#include <fc/io/raw.hpp>
+#include <fc/log/logger.hpp>
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <algorithm>
+#include <vector>
+
+template<typename T>
+static T unpack_slice(const leveldb::Slice& s)
+  {
+  T                           v;
+  fc::datastream<const char*> ds(s.data(), s.size() );
+  fc::raw::unpack(ds, v);
+  return v;
+  }
+
+// a 0 byte and a tag, see user_database
+static const char totals_key[] = { 0, 't' };
+static const char payout_prefix[] = { 0, 'p' };
+
+static bool is_meta_key(const leveldb::Slice& k)
+  {
+  return k.size() > 1 && k[0] == 0;
+  }
+
+/** the prefix, the balance big endian so entries sort by it, then the user */
+static std::string payout_key(int64_t balance, const std::string& user)
+  {
+  std::string k(payout_prefix, sizeof(payout_prefix) );
+  for (int i = 0; i < 8; ++i)
+    k += char(uint64_t(balance) >> (56 - 8 * i) );
+  return k + user;
+  }
+
+/** balance of the payout index entry for a record, 0 for none */
+static int64_t index_balance(const user_record& user)
+  {
+  return std::max<int64_t>(user.get_balance(), 0);
+  }
+
+// records cached when the server does not say
+#define USER_CACHE_DEFAULT_CAPACITY (1 << 18)
+
+// records evict() looks at per cache miss, a flush trims the rest
+#define USER_CACHE_EVICT_SCAN 16
+
+user_database::user_database() :
+  cache_capacity(USER_CACHE_DEFAULT_CAPACITY),
+  evictions(0){}
+
+user_database::~user_database()
+  {
+  try
+    {
+    close();
+    }
+  catch (...)
+    {
+    elog("unable to flush the user database");
+    }
+  }
+
+void user_database::open(const std::string& dir)
+  {
+  leveldb::Options opts;
+  opts.create_if_missing = true;
+
+  leveldb::DB*     ldb = nullptr;
+  leveldb::Status  status = leveldb::DB::Open(opts, dir, &ldb);
+  if (!status.ok() )
+    FC_THROW_EXCEPTION(fc::exception, "unable to open user database ${db}: ${msg}",
+                       ("db", dir)("msg", status.ToString() ) );
+  db.reset(ldb);
+
+  std::string value;
+  status = db->Get(leveldb::ReadOptions(), leveldb::Slice(totals_key, sizeof(totals_key) ), &value);
+  if (status.ok() )
+    totals = unpack_slice<pool_totals>(leveldb::Slice(value) );
+  else if (status.IsNotFound() )
+    build_index();
+  else
+    FC_THROW_EXCEPTION(fc::exception, "unable to read pool totals: ${msg}", ("msg", status.ToString() ) );
+  flushed_totals = totals;
+  }
+
+void user_database::build_index()
+  {
+  leveldb::WriteBatch                batch;
+  std::unique_ptr<leveldb::Iterator> itr(db->NewIterator(leveldb::ReadOptions() ) );
+  totals = pool_totals();
+  for (itr->SeekToFirst(); itr->Valid(); itr->Next() )
+    {
+    if (is_meta_key(itr->key() ) )
+      continue;
+    user_record user = unpack_slice<user_record>(itr->value() );
+    ++totals.users;
+    totals.valid += user.valid;
+    totals.invalid += user.invalid;
+    totals.total_earned += user.total_earned;
+    totals.total_paid += user.total_paid;
+    if (index_balance(user) )
+      batch.Put(payout_key(index_balance(user), unpack_slice<std::string>(itr->key() ) ), leveldb::Slice() );
+    }
+
+  std::vector<char> t = fc::raw::pack(totals);
+  batch.Put(leveldb::Slice(totals_key, sizeof(totals_key) ), leveldb::Slice(t.data(), t.size() ) );
+  leveldb::Status   status = db->Write(leveldb::WriteOptions(), &batch);
+  if (!status.ok() )
+    FC_THROW_EXCEPTION(fc::exception, "unable to write pool totals: ${msg}", ("msg", status.ToString() ) );
+  ilog("built pool totals and payout index of ${n} users", ("n", totals.users) );
+  }
+
+void user_database::close()
+  {
+  if (!db)
+    return;
+  flush();
+  db.reset();
+  }
+
+void user_database::set_cache_capacity(size_t records)
+  {
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  cache_capacity = std::max<size_t>(records, 1);
+  evict(cache.size() );
+  }
+
+user_database::cached_user& user_database::cached(const std::string& key, std::unique_lock<std::mutex>* unlock)
+  {
+  while (true)
+    {
+    auto itr = cache.find(key);
+    if (itr != cache.end() )
+      {
+      lru.splice(lru.begin(), lru, itr->second.lru_pos);
+      return itr->second;
+      }
+
+    cached_user       user;
+    std::string       value;
+    std::vector<char> k = fc::raw::pack(key);
+    uint64_t          seen = evictions;
+    if (unlock)
+      unlock->unlock();
+    leveldb::Status   status = db->Get(leveldb::ReadOptions(), leveldb::Slice(k.data(), k.size() ), &value);
+    if (unlock)
+      unlock->lock();
+    if (status.ok() )
+      {
+      user.record = unpack_slice<user_record>(leveldb::Slice(value) );
+      user.stored = true;
+      user.indexed_balance = index_balance(user.record);
+      }
+    else if (!status.IsNotFound() )
+      {
+      // not cached, a flush would overwrite the record with an empty one
+      FC_THROW_EXCEPTION(fc::exception, "unable to read user ${k}: ${msg}", ("k", key)("msg", status.ToString() ) );
+      }
+
+    // another thread may have loaded it meanwhile, or changed, written and
+    // dropped it again, which would make what was read stale; the second
+    // read keeps the lock so a busy cache cannot starve this one
+    if (cache.count(key) || (unlock && evictions != seen) )
+      {
+      unlock = nullptr;
+      continue;
+      }
+    lru.push_front(key);
+    user.lru_pos = lru.begin();
+    cached_user& cur = cache[key] = user;
+    evict(USER_CACHE_EVICT_SCAN);
+    return cur;
+    }
+  }
+
+void user_database::evict(size_t scan)
+  {
+  auto itr = lru.end();
+  while (cache.size() > cache_capacity && scan-- && itr != lru.begin() )
+    {
+    --itr;
+    auto cur = cache.find(*itr);
+    if (cur->second.flushing || dirty.count(*itr) || itr == lru.begin() )
+      continue;
+    cache.erase(cur);
+    itr = lru.erase(itr);
+    ++evictions;
+    }
+  }
+
+bool user_database::fetch(const std::string& key, user_record& user)
+  {
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  cached_user&                 cur = cached(key, &lock);
+  if (!cur.stored)
+    return false;
+  user = cur.record;
+  return true;
+  }
+
+void user_database::store(const std::string& key, const user_record& user)
+  {
+  update(key, [&](user_record& cur){ cur = user; }
+         );
+  }
+
+user_record user_database::update(const std::string& key, const std::function<void (user_record&)>& f)
+  {
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  cached(key, &lock);
+  return update_locked(key, f);
+  }
+
+user_record user_database::update_locked(const std::string& key, const std::function<void (user_record&)>& f)
+  {
+  // loaded by the caller unless it had to keep the lock throughout
+  cached_user& cur = cached(key, nullptr);
+  user_record  before = cur.record;
+  f(cur.record);
+  if (!cur.stored)
+    ++totals.users;
+  cur.stored = true;
+  dirty.insert(key);
+
+  totals.valid += cur.record.valid - before.valid;
+  totals.invalid += cur.record.invalid - before.invalid;
+  totals.total_earned += cur.record.total_earned - before.total_earned;
+  totals.total_paid += cur.record.total_paid - before.total_paid;
+  return cur.record;
+  }
+
+user_record user_database::add_share(const std::string& key, bool valid, uint64_t weight)
+  {
+  return update(key, [ = ](user_record& user){
+                  if (valid)
+                    user.valid += weight;
+                  else
+                    user.invalid++;
+                  }
+                );
+  }
+
+bool user_database::apply_payout(uint64_t id, const std::vector< std::pair<std::string, uint64_t> >& payments, bool refund)
+  {
+  for (size_t i = 0; i < payments.size(); ++i)
+    {
+    // load them first, below only records evicted meanwhile are read under the lock
+    user_record ignored;
+    fetch(payments[i].first, ignored);
+    }
+
+    {
+    // all at once, a flush on another thread must not write half a batch
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    for (size_t i = 0; i < payments.size(); ++i)
+      {
+      int64_t amount = int64_t(payments[i].second);
+      update_locked(payments[i].first, [ = ](user_record& user){ user.total_paid += refund ? -amount : amount; }
+                    );
+      }
+    if (refund)
+      totals.last_refund = id;
+    else
+      totals.last_payout = id;
+    }
+  flush();
+
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  return refund ? flushed_totals.last_refund >= id : flushed_totals.last_payout >= id;
+  }
+
+size_t user_database::flush()
+  {
+  // the index entries a flush replaces are the ones the previous flush wrote
+  std::unique_lock<std::mutex> flushing(flush_mutex);
+  leveldb::WriteBatch          batch;
+  std::vector<std::string>     keys;
+  std::vector<int64_t>         balances;
+  pool_totals                  written;
+  leveldb::WriteOptions        opts;
+    {
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    keys.assign(dirty.begin(), dirty.end() );
+    for (size_t i = 0; i < keys.size(); ++i)
+      {
+      // dirty records are never evicted
+      cached_user&      cur = cache[keys[i]];
+      cur.flushing = true;
+      std::vector<char>  k = fc::raw::pack(keys[i]);
+      std::vector<char>  v = fc::raw::pack(cur.record);
+      batch.Put(leveldb::Slice(k.data(), k.size() ), leveldb::Slice(v.data(), v.size() ) );
+
+      balances.push_back(index_balance(cur.record) );
+      if (balances.back() != cur.indexed_balance)
+        {
+        if (cur.indexed_balance)
+          batch.Delete(payout_key(cur.indexed_balance, keys[i]) );
+        if (balances.back() )
+          batch.Put(payout_key(balances.back(), keys[i]), leveldb::Slice() );
+        }
+      }
+    written = totals;
+    std::vector<char> t = fc::raw::pack(written);
+    batch.Put(leveldb::Slice(totals_key, sizeof(totals_key) ), leveldb::Slice(t.data(), t.size() ) );
+    dirty.clear();
+    // the payout journal is synced, the payouts it records must not be lost either
+    opts.sync = written.last_payout != flushed_totals.last_payout || written.last_refund != flushed_totals.last_refund;
+    }
+  if (keys.empty() )
+    return 0;
+
+  leveldb::Status              status = db->Write(opts, &batch);
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  for (size_t i = 0; i < keys.size(); ++i)
+    {
+    cached_user& cur = cache[keys[i]];
+    cur.flushing = false;
+    if (status.ok() )
+      cur.indexed_balance = balances[i];
+    }
+  if (!status.ok() )
+    {
+    // keep them for the next flush
+    dirty.insert(keys.begin(), keys.end() );
+    elog("unable to write ${n} user records: ${msg}", ("n", keys.size() )("msg", status.ToString() ) );
+    return 0;
+    }
+  flushed_totals = written;
+  evict(cache.size() );
+  return keys.size();
+  }
+
+size_t user_database::dirty_count() const
+  {
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  return dirty.size();
+  }
+
+void user_database::for_each(const std::function<void (const std::string& key, const user_record& user)>& f)
+  {
+  flush();
+  std::unique_ptr<leveldb::Iterator> itr(db->NewIterator(leveldb::ReadOptions() ) );
+  for (itr->SeekToFirst(); itr->Valid(); itr->Next() )
+    if (!is_meta_key(itr->key() ) )
+      f(unpack_slice<std::string>(itr->key() ), unpack_slice<user_record>(itr->value() ) );
+  }
+
+void user_database::for_each_payout(int64_t min_balance,
+                                    const std::function<void (const std::string& key, const user_record& user)>& f)
+  {
+  flush();
+  // collect first, f may pay users and so move their index entries
+  std::vector<std::string>           keys;
+  leveldb::Slice                     prefix(payout_prefix, sizeof(payout_prefix) );
+  std::unique_ptr<leveldb::Iterator> itr(db->NewIterator(leveldb::ReadOptions() ) );
+  for (itr->Seek(payout_key(std::max<int64_t>(min_balance, 1), std::string() ) ); itr->Valid() && itr->key().starts_with(prefix);
+       itr->Next() )
+    keys.push_back(std::string(itr->key().data() + prefix.size() + 8, itr->key().size() - prefix.size() - 8) );
+  itr.reset();
+
+  for (size_t i = 0; i < keys.size(); ++i)
+    {
+    user_record user;
+    if (fetch(keys[i], user) && user.get_balance() >= min_balance)
+      f(keys[i], user);
+    }
+  }
+
+pool_totals user_database::get_totals() const
+  {
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  return totals;
+  }
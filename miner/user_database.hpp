@@ -1,5 +1,16 @@
 #pragma once
 #include <fc/reflect/reflect.hpp>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace leveldb { class DB; }
 
 struct user_record
   {
@@ -16,3 +27,126 @@ struct user_record
   };
 
 FC_REFLECT(user_record, (valid)(invalid)(total_earned)(total_paid) )
+
+/** sums over every user record, kept up to date with each flush */
+struct pool_totals
+  {
+  pool_totals() : users(0), valid(0), invalid(0), total_earned(0), total_paid(0), last_payout(0), last_refund(0){}
+
+  uint64_t users;
+  uint64_t valid;
+  uint64_t invalid;
+  int64_t  total_earned;
+  int64_t  total_paid;
+  uint64_t last_payout; ///< id of the last payout batch added to total_paid
+  uint64_t last_refund; ///< id of the last payout batch taken back after bitcoind refused it
+  };
+
+FC_REFLECT(pool_totals, (users)(valid)(invalid)(total_earned)(total_paid)(last_payout)(last_refund) )
+
+/**
+ *  User records of the pool by payout address, stored in leveldb with the
+ *  encoding of bts::db::level_map<std::string, user_record> so existing
+ *  databases open unchanged.
+ *
+ *  Changes only go to an in-memory cache; flush() writes every record changed
+ *  since the previous flush in one WriteBatch.  The server flushes on a timer
+ *  and on shutdown, a crash loses at most the shares of one flush interval.
+ *  All methods are thread safe, and records missing from the cache are read
+ *  without holding the cache lock.  The least recently used records beyond
+ *  the cache capacity are dropped once they are written.  A record that
+ *  cannot be read throws, it is never taken for a new user.
+ *
+ *  The same batch updates a pool_totals record and an index of the users
+ *  with a positive balance ordered by balance, so neither startup nor a
+ *  payout run has to read every user.  Both live under keys starting with
+ *  a 0 byte followed by more bytes, which no packed string starts with
+ *  unless it is the empty one.  Databases without them get them built on
+ *  open.
+ */
+class user_database
+{
+public:
+  user_database();
+  ~user_database();
+
+  void   open(const std::string& dir);
+  /** flushes and closes the database */
+  void   close();
+  /** records kept in memory, more only while they wait for a flush */
+  void   set_cache_capacity(size_t records);
+
+  /** @return false if there is no record for key */
+  bool   fetch(const std::string& key, user_record& user);
+  void   store(const std::string& key, const user_record& user);
+  /** applies f to the record of key (a new one if there is none) and returns the result */
+  user_record update(const std::string& key, const std::function<void (user_record&)>& f);
+  /**
+   *  Counts one share, the record is created on the first share of a user.
+   *  A valid share is credited `weight` (its difficulty), an invalid one 1.
+   */
+  user_record add_share(const std::string& key, bool valid, uint64_t weight = 1);
+  /**
+   *  Adds the payments of payout batch `id` to total_paid, or takes them
+   *  back if `refund`, and flushes.  The records and the batch id are
+   *  written together and synced to disk, so after a crash get_totals()
+   *  tells whether it happened.
+   *
+   *  @return false if the write failed
+   */
+  bool   apply_payout(uint64_t id, const std::vector< std::pair<std::string, uint64_t> >& payments, bool refund);
+
+  /** @return the number of records written */
+  size_t flush();
+  size_t dirty_count() const;
+
+  /** flushes, then calls f for every record in the database */
+  void   for_each(const std::function<void (const std::string& key, const user_record& user)>& f);
+  /**
+   *  Flushes, then calls f for the users with a balance of at least
+   *  min_balance, lowest balance first.  f may change the records.
+   */
+  void   for_each_payout(int64_t min_balance, const std::function<void (const std::string& key, const user_record& user)>& f);
+
+  /** totals including changes not flushed yet */
+  pool_totals get_totals() const;
+
+private:
+  struct cached_user
+    {
+    cached_user() : stored(false), indexed_balance(0), flushing(false){}
+
+    user_record                      record;
+    bool                             stored;          ///< in the database or stored since
+    int64_t                          indexed_balance; ///< balance of the payout index entry in the database, 0 for none
+    bool                             flushing;        ///< being written, must stay until flush() is done with it
+    std::list<std::string>::iterator lru_pos;
+    };
+
+  /**
+   *  Cached record of key, loaded on first use.  Takes cache_mutex held in
+   *  `unlock` and releases it while reading the database, callers that must
+   *  keep it pass null and read under the lock.
+   */
+  cached_user& cached(const std::string& key, std::unique_lock<std::mutex>* unlock);
+  /** drops least recently used records that are written until the cache fits, at most `scan` looked at */
+  void         evict(size_t scan);
+  /** update() with cache_mutex held */
+  user_record  update_locked(const std::string& key, const std::function<void (user_record&)>& f);
+  /** builds the totals and the payout index of a database that predates them */
+  void         build_index();
+
+  std::unique_ptr<leveldb::DB>                 db;
+  std::mutex                                   flush_mutex;
+  mutable std::mutex                           cache_mutex;
+  std::unordered_map<std::string, cached_user> cache;
+  std::list<std::string>                       lru;            ///< keys of cache, most recently used first
+  size_t                                       cache_capacity;
+  uint64_t                                     evictions;      ///< a record read outside the lock may be stale if this moved
+  std::unordered_set<std::string>              dirty;
+  pool_totals                                  totals;
+  pool_totals                                  flushed_totals; ///< as last written
+
+  user_database(const user_database&);
+  user_database& operator=(const user_database&);
+};
@@ -5,7 +5,7 @@
 struct work_message
   {
   work_message()
-    : type(0), mature_balance(0), pool_shares(0), pool_earned(0), pool_spm(0), pool_fee(0){}
+    : type(0), mature_balance(0), pool_shares(0), pool_earned(0), pool_spm(0), pool_fee(0), share_shift(0){}
 
   uint32_t type;
   bitcoin::work header;
@@ -17,14 +17,34 @@ struct work_message
   float pool_fee;
 
   std::string ptsaddr;
+  /**
+   *  Share difficulty of the connection: shares must hash below
+   *  get_share_target(share_shift) and are credited 2^share_shift.  Miners
+   *  echo it back with every share; older miners leave it 0 and are held to
+   *  (and credited) the shift pool_server starts connections at, 4 matches
+   *  the 0x03 first byte they always mined to.  One byte so a share with a 34 character
+   *  address still fits the 192 byte packet.
+   */
+  uint8_t share_shift;
   };
 
+// header hashes of shares start with a byte below 0x3f
+#define POOL_SHARE_TARGET 0x3f00000000000000ull
+#define MAX_SHARE_SHIFT   48
+
+/** @return the bound on the first 8 bytes of a (reversed) share hash, read big endian */
+inline uint64_t get_share_target(uint8_t share_shift)
+  {
+  return POOL_SHARE_TARGET >> share_shift;
+  }
+
 enum work_types
   {
   SET_WORK,
   INVALID,
   STALE,
-  OK
+  OK,
+  HELLO  ///< opens protocol version 2, and marks the connect packet of a server that takes it, see pool_protocol.hpp
   };
 
 #include <fc/reflect/reflect.hpp>
@@ -38,5 +58,87 @@ FC_REFLECT(work_message,
            (pool_spm)
            (pool_fee)
            (ptsaddr)
+           (share_shift)
            );
 
+#include <fc/io/raw.hpp>
+#include <fc/io/datastream.hpp>
+#include <string.h>
+
+/**
+ *  A work_message packed into its 192 byte packet once per block.  The
+ *  fields that differ between connections or replies are patched in place,
+ *  which is much cheaper than packing the whole message for every miner.
+ */
+class work_packet
+{
+public:
+  enum { size = 192 };
+
+  work_packet()
+    {
+    init(work_message() );
+    }
+
+  explicit work_packet(const work_message& msg)
+    {
+    init(msg);
+    }
+
+  void set_type(uint32_t type)
+    {
+    patch(0, type);
+    }
+
+  void set_nonce(uint32_t nonce)
+    {
+    patch(nonce_offset, nonce);
+    }
+
+  void set_user(const user_record& user)
+    {
+    patch(user_offset, user);
+    }
+
+  void set_pool_stats(uint64_t mature_balance, uint64_t pool_shares, uint64_t pool_earned, float pool_spm)
+    {
+    patch(stats_offset, mature_balance);
+    patch(stats_offset + 8, pool_shares);
+    patch(stats_offset + 16, pool_earned);
+    patch(stats_offset + 24, pool_spm);
+    }
+
+  void set_share_shift(uint8_t share_shift)
+    {
+    patch(share_shift_offset, share_shift);
+    }
+
+  char data[size];
+
+private:
+  void init(const work_message& msg)
+    {
+    std::vector<char> packed = fc::raw::pack(msg);
+    memset(data, 0, sizeof(data) );
+    memcpy(data, packed.data(), std::min<size_t>(packed.size(), sizeof(data) ) );
+
+    nonce_offset = fc::raw::pack_size(msg.type) + fc::raw::pack_size(msg.header.version) + fc::raw::pack_size(msg.header.prev) +
+                   fc::raw::pack_size(msg.header.merk) + fc::raw::pack_size(msg.header.time) + fc::raw::pack_size(msg.header.bits);
+    user_offset = fc::raw::pack_size(msg.type) + fc::raw::pack_size(msg.header);
+    stats_offset = user_offset + fc::raw::pack_size(msg.user);
+    share_shift_offset = stats_offset + 3 * sizeof(uint64_t) + 2 * sizeof(float) + fc::raw::pack_size(msg.ptsaddr);
+    }
+
+  template<typename T>
+  void patch(size_t offset, const T& v)
+    {
+    fc::datastream<char*> ds(data + offset, sizeof(data) - offset);
+    fc::raw::pack(ds, v);
+    }
+
+  size_t nonce_offset;
+  size_t user_offset;
+  size_t stats_offset;
+  size_t share_shift_offset;
+};
+
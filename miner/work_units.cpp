@@ -0,0 +1,267 @@
+#include "work_units.hpp"
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+uint64_t& get_thread_count();
+
+uint64_t physical_memory_bytes()
+  {
+#ifdef WIN32
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if (GlobalMemoryStatusEx(&status) )
+    return status.ullTotalPhys;
+  return 0;
+#elif defined(_SC_PHYS_PAGES)
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page <= 0)
+    return 0;
+  return uint64_t(pages) * uint64_t(page);
+#else
+  return 0;
+#endif
+  }
+
+#ifdef WIN32
+
+uint32_t cpus_per_last_level_cache()
+  {
+  DWORD bytes = 0;
+  GetLogicalProcessorInformation(nullptr, &bytes);
+  std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(bytes / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION) );
+  if (info.empty() || !GetLogicalProcessorInformation(info.data(), &bytes) )
+    return 0;
+
+  uint32_t level = 0;
+  uint32_t cpus = 0;
+  for (size_t i = 0; i < info.size(); ++i)
+    {
+    if (info[i].Relationship != RelationCache || !(info[i].ProcessorMask & 1) || info[i].Cache.Level < level)
+      continue;
+    level = info[i].Cache.Level;
+    cpus = 0;
+    for (ULONG_PTR mask = info[i].ProcessorMask; mask; mask &= mask - 1)
+      ++cpus;
+    }
+  return cpus;
+  }
+
+std::vector< std::vector<int> > last_level_cache_groups()
+  {
+  std::vector< std::vector<int> > groups;
+  DWORD                           bytes = 0;
+  GetLogicalProcessorInformation(nullptr, &bytes);
+  std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(bytes / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION) );
+  if (info.empty() || !GetLogicalProcessorInformation(info.data(), &bytes) )
+    return groups;
+
+  uint32_t level = 0;
+  for (size_t i = 0; i < info.size(); ++i)
+    {
+    if (info[i].Relationship != RelationCache || info[i].Cache.Level < level)
+      continue;
+    if (info[i].Cache.Level > level)
+      groups.clear();
+    level = info[i].Cache.Level;
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < int(sizeof(ULONG_PTR) * 8); ++cpu)
+      if (info[i].ProcessorMask & (ULONG_PTR(1) << cpu) )
+        cpus.push_back(cpu);
+    // the data and instruction caches of a level are listed apart
+    if (std::find(groups.begin(), groups.end(), cpus) == groups.end() )
+      groups.push_back(cpus);
+    }
+  return groups;
+  }
+
+int numa_node_of_cpu(int cpu)
+  {
+  UCHAR node = 0;
+  if (cpu > 255 || !GetNumaProcessorNode(UCHAR(cpu), &node) || node == 0xff)
+    return -1;
+  return node;
+  }
+
+#else
+
+/** cpus sharing the last level cache of `cpu`, empty if unknown */
+static std::vector<int> last_level_cache_cpus(int cpu)
+  {
+  // the caches of a cpu are index0, index1, ... the highest level is the last
+  int              level = 0;
+  std::vector<int> cpus;
+  for (int index = 0; index < 16; ++index)
+    {
+    std::stringstream dir;
+    dir << "/sys/devices/system/cpu/cpu" << cpu << "/cache/index" << index << "/";
+    std::ifstream     in( (dir.str() + "level").c_str() );
+    int               cache_level = 0;
+    if (!(in >> cache_level) )
+      break;
+    if (cache_level < level)
+      continue;
+    level = cache_level;
+    cpus = read_cpu_list(dir.str() + "shared_cpu_list");
+    }
+  return cpus;
+  }
+
+uint32_t cpus_per_last_level_cache()
+  {
+  return uint32_t(last_level_cache_cpus(0).size() );
+  }
+
+std::vector< std::vector<int> > last_level_cache_groups()
+  {
+  std::vector< std::vector<int> > groups;
+  std::vector<int>                cpus = read_cpu_list("/sys/devices/system/cpu/online");
+  std::set<int>                   seen;
+  for (size_t i = 0; i < cpus.size(); ++i)
+    {
+    if (seen.count(cpus[i]) )
+      continue;
+    std::vector<int> group = last_level_cache_cpus(cpus[i]);
+    if (group.empty() )
+      return std::vector< std::vector<int> >();
+    seen.insert(group.begin(), group.end() );
+    groups.push_back(group);
+    }
+  return groups;
+  }
+
+int numa_node_of_cpu(int cpu)
+  {
+  std::vector<int> nodes = read_cpu_list("/sys/devices/system/node/online");
+  for (size_t i = 0; i < nodes.size(); ++i)
+    {
+    std::vector<int> cpus = cpus_of_numa_node(nodes[i]);
+    if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end() )
+      return nodes[i];
+    }
+  return -1;
+  }
+
+#endif
+
+uint32_t choose_work_units(uint32_t threads, uint64_t unit_bytes)
+  {
+  uint32_t units = 1;
+  uint32_t per_cache = cpus_per_last_level_cache();
+  if (per_cache)
+    units = std::max<uint32_t>(threads / per_cache, 1);
+  units = std::min(units, std::max<uint32_t>(threads / 2, 1) );
+
+  uint64_t memory = physical_memory_bytes();
+  if (memory && unit_bytes)
+    units = uint32_t(std::min<uint64_t>(units, std::max<uint64_t>(memory / 2 / unit_bytes, 1) ) );
+  return units;
+  }
+
+/**
+ *  The last level caches of `cpus`, each only with the cpus it shares with
+ *  them, those of a numa node next to each other.  One group of all of them
+ *  if the caches are unknown.
+ */
+static std::vector< std::vector<int> > group_by_cache(const std::vector<int>& cpus)
+  {
+  std::vector< std::vector<int> >                   caches = last_level_cache_groups();
+  std::vector< std::pair<int, std::vector<int> > >  by_node;
+  std::set<int>                                     wanted(cpus.begin(), cpus.end() );
+  std::set<int>                                     placed;
+  for (size_t i = 0; i < caches.size(); ++i)
+    {
+    std::vector<int> group;
+    for (size_t c = 0; c < caches[i].size(); ++c)
+      if (wanted.count(caches[i][c]) && placed.insert(caches[i][c]).second)
+        group.push_back(caches[i][c]);
+    if (!group.empty() )
+      by_node.push_back(std::make_pair(numa_node_of_cpu(group.front() ), group) );
+    }
+  std::stable_sort(by_node.begin(), by_node.end(),
+                   [](const std::pair<int, std::vector<int> >& a, const std::pair<int, std::vector<int> >& b){ return a.first < b.first; }
+                   );
+
+  std::vector< std::vector<int> > groups;
+  for (size_t i = 0; i < by_node.size(); ++i)
+    groups.push_back(by_node[i].second);
+  // cpus no cache was found for
+  std::vector<int>                rest;
+  for (size_t i = 0; i < cpus.size(); ++i)
+    if (!placed.count(cpus[i]) )
+      rest.push_back(cpus[i]);
+  if (!rest.empty() )
+    groups.push_back(rest);
+  return groups;
+  }
+
+/** whole groups for each unit, or a share of one group if there are more units than groups */
+static std::vector<int> cpus_of_unit(const std::vector< std::vector<int> >& groups, uint32_t unit, uint32_t units)
+  {
+  std::vector<int> cpus;
+  size_t           count = groups.size();
+  if (count >= units)
+    {
+    for (size_t g = count * unit / units; g < count * (unit + 1) / units; ++g)
+      cpus.insert(cpus.end(), groups[g].begin(), groups[g].end() );
+    return cpus;
+    }
+
+  // units first .. last share group g
+  size_t   g = count * unit / units;
+  uint32_t first = unit;
+  uint32_t last = unit;
+  while (first > 0 && count * (first - 1) / units == g)
+    --first;
+  while (last + 1 < units && count * (last + 1) / units == g)
+    ++last;
+  const std::vector<int>& all = groups[g];
+  uint32_t                sharing = last - first + 1;
+  if (all.size() < sharing)
+    return all;
+  cpus.assign(all.begin() + all.size() * (unit - first) / sharing, all.begin() + all.size() * (unit - first + 1) / sharing);
+  return cpus;
+  }
+
+work_unit_pools::work_unit_pools(uint32_t u) :
+  units(std::max<uint32_t>(u, 1) )
+  {
+  if (units == 1)
+    return;
+
+  uint32_t                        threads = std::max<uint32_t>(uint32_t(get_thread_count() ), units);
+  std::vector<int>                cpus = get_search_cpus();
+  std::vector< std::vector<int> > groups;
+  if (!cpus.empty() )
+    groups = group_by_cache(cpus);
+  for (uint32_t i = 0; i < units; ++i)
+    {
+    std::vector<int>     mine;
+    table_memory_options memory = get_table_memory_options();
+    if (!groups.empty() )
+      {
+      mine = cpus_of_unit(groups, i, units);
+      // next to the cpus of the unit unless the command line placed the tables
+      if (memory.numa_node < 0 && !memory.interleave)
+        memory.numa_node = numa_node_of_cpu(mine.front() );
+      }
+    uint32_t count = uint32_t(uint64_t(threads) * (i + 1) / units - uint64_t(threads) * i / units);
+    pools.push_back(std::unique_ptr<search_pool>(new search_pool(count, mine, memory) ) );
+    }
+  }
+
+search_pool& work_unit_pools::pool(uint32_t unit)
+  {
+  if (pools.empty() )
+    return get_search_pool();
+  return *pools[unit % pools.size()];
+  }
@@ -0,0 +1,53 @@
+#pragma once
+#include "search_pool.hpp"
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+/** physical memory of the machine, 0 if unknown */
+uint64_t physical_memory_bytes();
+
+/** cpus sharing the last level cache with cpu 0, 0 if unknown */
+uint32_t cpus_per_last_level_cache();
+
+/** the cpus of each last level cache, empty if unknown */
+std::vector< std::vector<int> > last_level_cache_groups();
+
+/** numa node of `cpu`, -1 if unknown */
+int numa_node_of_cpu(int cpu);
+
+/**
+ *  Work units to split `threads` search threads into: one per last level
+ *  cache, so the threads of a unit share one, but no more than half the
+ *  physical memory has tables for and at least 2 threads per unit.
+ *
+ *  @param unit_bytes table memory of one unit
+ */
+uint32_t choose_work_units(uint32_t threads, uint64_t unit_bytes);
+
+/**
+ *  The search pools of concurrent work units.  Each unit searches its own
+ *  nonces on its own tables with its own share of the search threads, so on
+ *  large hosts one unit's hashing overlaps the table probes of another.  A
+ *  single unit uses get_search_pool().
+ *
+ *  With --pin every unit gets the cpus of whole last level caches (or a
+ *  share of one if there are more units than caches), and unless the table
+ *  placement was given on the command line its tables are bound to the numa
+ *  node of those cpus.
+ */
+class work_unit_pools
+{
+public:
+  explicit work_unit_pools(uint32_t units);
+
+  uint32_t     size() const { return units; }
+  search_pool& pool(uint32_t unit);
+
+private:
+  uint32_t                                   units;
+  std::vector< std::unique_ptr<search_pool> > pools; ///< empty for a single unit
+
+  work_unit_pools(const work_unit_pools&);
+  work_unit_pools& operator=(const work_unit_pools&);
+};